@@ -58,9 +58,7 @@ main(void)
 
 	struct stat frame_stat;
 	char filename[FILENAME_LEN];
-	unsigned char *buffer;
-	ssize_t r;
-	size_t count, len, buffer_len = 0;
+	size_t len;
 	int i, fd, ret;
 
 	/* TODO: add audio */
@@ -98,24 +96,12 @@ main(void)
 			perror(" ");
 			return EXIT_FAILURE;
 		}
-		/* FIXME */
-		len = frame_stat.st_size;
-		if (len > buffer_len) {
-			if (buffer_len > 0)
-				free(buffer);
-			buffer_len = len;
-			buffer = malloc(buffer_len);
-		}
-		count = 0;
-		while (count < len) {
-			r = read(fd, buffer + count, len - count);
-			if (r < 0) {
-				(void)fprintf(stderr, "Failed to read from "
-				    "buffer\n");
-				perror(" ");
-				return EXIT_FAILURE;
-			}
-			count += (size_t)r;
+		len = (size_t)frame_stat.st_size;
+
+		/* the frame is copied from fd to the AVI file by the kernel */
+		if (gwavi_add_frame_fd(gwavi, fd, 0, len) == -1) {
+			(void)fprintf(stderr, "Cannot add frame to video\n");
+			return EXIT_FAILURE;
 		}
 
 		if (close(fd) == -1) {
@@ -123,11 +109,6 @@ main(void)
 			perror(" ");
 			return EXIT_FAILURE;
 		}
-
-		if (gwavi_add_frame(gwavi, buffer, len) == -1) {
-			(void)fprintf(stderr, "Cannot add frame to video\n");
-			return EXIT_FAILURE;
-		}
 	}
 
 	if (gwavi_close(gwavi) == -1) {
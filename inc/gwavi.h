@@ -34,10 +34,56 @@
 #define H_GWAVI
 
 #include <stddef.h> /* for size_t */
+#include <sys/types.h> /* for off_t */
+#include <sys/uio.h> /* for struct iovec */
 
 /* structures */
 struct gwavi_t;
 struct gwavi_audio_t;
+struct gwavi_seg_t;
+struct gwavi_dvr_t;
+struct gwavi_pool_t;
+struct gwavi_place_t;
+
+/* memory allocation functions, see gwavi_set_allocator() */
+struct gwavi_allocator_t
+{
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *ctx;		/* passed to the functions above */
+};
+
+/* error codes, see gwavi_last_error() */
+enum gwavi_error_code
+{
+	GWAVI_OK = 0,
+	GWAVI_EINVAL,		/* invalid argument */
+	GWAVI_ENOMEM,		/* memory allocation failed */
+	GWAVI_EIO,		/* writing or seeking the output file failed */
+	GWAVI_ESTATE,		/* call not allowed in the current state */
+	GWAVI_EFULL,		/* preallocated index or queue is full */
+	GWAVI_ESYS		/* system call failed, see sys_errno */
+};
+
+/* severity of the messages passed to the log callback */
+enum gwavi_log_level
+{
+	GWAVI_LOG_NONE = 0,	/* disable logging */
+	GWAVI_LOG_ERROR,
+	GWAVI_LOG_WARNING
+};
+
+/* error or warning passed to the log callback or queued in realtime mode */
+struct gwavi_error_t
+{
+	int level;		/* enum gwavi_log_level */
+	int code;		/* enum gwavi_error_code */
+	const char *where;	/* function the error occurred in */
+	const char *what;	/* description of the error */
+	int sys_errno;		/* related errno value, 0 if none */
+	char detail[5];		/* fourcc at fault, "" if none */
+};
 
 /* Main ibrary functions */
 struct gwavi_t *gwavi_open(const char *filename, unsigned int width,
@@ -45,7 +91,115 @@ struct gwavi_t *gwavi_open(const char *filename, unsigned int width,
 			   struct gwavi_audio_t *audio);
 int gwavi_add_frame(struct gwavi_t *gwavi, unsigned char *buffer, size_t len);
 int gwavi_add_audio(struct gwavi_t *gwavi, unsigned char *buffer, size_t len);
+int gwavi_add_framev(struct gwavi_t *gwavi, const struct iovec *iov,
+		     int iovcnt);
+int gwavi_add_frame_fd(struct gwavi_t *gwavi, int fd, off_t offset,
+		       size_t len);
+int gwavi_add_audiov(struct gwavi_t *gwavi, const struct iovec *iov,
+		     int iovcnt);
+int gwavi_add_video_stream(struct gwavi_t *gwavi, unsigned int width,
+			   unsigned int height, const char *fourcc,
+			   unsigned int fps);
+int gwavi_add_audio_stream(struct gwavi_t *gwavi, struct gwavi_audio_t *audio);
+int gwavi_add_stream_chunk(struct gwavi_t *gwavi, unsigned int stream,
+			   unsigned char *buffer, size_t len);
 int gwavi_close(struct gwavi_t *gwavi);
+int gwavi_close_async(struct gwavi_t *gwavi,
+		      void (*cb)(void *ctx, int status), void *ctx);
+int gwavi_snapshot(struct gwavi_t *gwavi, const char *path);
+
+/*
+ * Segmented recording: gwavi_reopen() closes the current file and starts a new
+ * one reusing the gwavi_t structure and its memory. gwavi_reserve() sizes the
+ * index upfront so adding chunks does not allocate and
+ * gwavi_set_index_staging() serializes it while recording so that closing
+ * takes constant time.
+ */
+int gwavi_reopen(struct gwavi_t *gwavi, const char *filename);
+int gwavi_reserve(struct gwavi_t *gwavi, unsigned int count);
+int gwavi_set_index_staging(struct gwavi_t *gwavi, int enable);
+
+/* uncompressed video of constant frame size, with an index computed at close */
+int gwavi_set_fixed_frame_size(struct gwavi_t *gwavi, size_t frame_size);
+
+/*
+ * Automatic segmentation: a gwavi_seg_t rolls over to the next file of a
+ * sequence at a keyframe, once a size, duration or frame count threshold is
+ * reached. The next file is opened in the background beforehand.
+ */
+struct gwavi_seg_t *gwavi_seg_open(const char *pattern, unsigned int width,
+				   unsigned int height, const char *fourcc,
+				   unsigned int fps,
+				   struct gwavi_audio_t *audio);
+int gwavi_seg_set_limits(struct gwavi_seg_t *seg, unsigned long max_bytes,
+			 unsigned int max_seconds, unsigned int max_frames);
+int gwavi_seg_add_frame(struct gwavi_seg_t *seg, unsigned char *buffer,
+			size_t len, int keyframe);
+int gwavi_seg_add_audio(struct gwavi_seg_t *seg, unsigned char *buffer,
+			size_t len);
+int gwavi_seg_set_log(struct gwavi_seg_t *seg,
+		      void (*log)(void *ctx, const struct gwavi_error_t *error),
+		      void *ctx, int level);
+struct gwavi_t *gwavi_seg_current(struct gwavi_seg_t *seg);
+int gwavi_seg_close(struct gwavi_seg_t *seg);
+
+/*
+ * Placement: files of segmented recordings, or of any handle, spread across
+ * several directories, typically one per disk.
+ */
+enum gwavi_place_policy
+{
+	GWAVI_PLACE_ROUND_ROBIN = 0,	/* each directory in turn */
+	GWAVI_PLACE_LEAST_OPEN,		/* fewest files being written */
+	GWAVI_PLACE_FREE_SPACE		/* most free space per file written */
+};
+
+struct gwavi_place_t *gwavi_place_create(const char *const *dirs,
+					 unsigned int count, int policy);
+int gwavi_place_pick(struct gwavi_place_t *place, const char *name,
+		     char *path, size_t size);
+void gwavi_place_release(struct gwavi_place_t *place, int dir);
+void gwavi_place_destroy(struct gwavi_place_t *place);
+struct gwavi_seg_t *gwavi_seg_open_placed(struct gwavi_place_t *place,
+					  const char *pattern,
+					  unsigned int width,
+					  unsigned int height,
+					  const char *fourcc, unsigned int fps,
+					  struct gwavi_audio_t *audio);
+
+/*
+ * Pre-trigger recording: a gwavi_dvr_t keeps the last seconds in memory and
+ * writes them to a file when gwavi_dvr_trigger() is called, then goes on
+ * recording to it.
+ */
+struct gwavi_dvr_t *gwavi_dvr_open(size_t max_bytes, unsigned int seconds,
+				   unsigned int fps);
+int gwavi_dvr_add_frame(struct gwavi_dvr_t *dvr, unsigned char *buffer,
+			size_t len, int keyframe);
+int gwavi_dvr_add_audio(struct gwavi_dvr_t *dvr, unsigned char *buffer,
+			size_t len);
+int gwavi_dvr_trigger(struct gwavi_dvr_t *dvr, struct gwavi_t *gwavi);
+struct gwavi_t *gwavi_dvr_detach(struct gwavi_dvr_t *dvr);
+void gwavi_dvr_close(struct gwavi_dvr_t *dvr);
+
+/*
+ * Zero-copy frame buffers: the encoder writes directly into a buffer obtained
+ * from gwavi_frame_alloc() which is then emitted as a single write by
+ * gwavi_commit_frame(). Buffers are recycled between frames.
+ */
+unsigned char *gwavi_frame_alloc(struct gwavi_t *gwavi, size_t max_len);
+int gwavi_commit_frame(struct gwavi_t *gwavi, unsigned char *frame,
+		       size_t len);
+void gwavi_frame_free(struct gwavi_t *gwavi, unsigned char *frame);
+
+/*
+ * Streamed frames: a frame too large to be buffered can be written in pieces
+ * between gwavi_frame_begin() and gwavi_frame_end().
+ */
+int gwavi_frame_begin(struct gwavi_t *gwavi, size_t len);
+int gwavi_frame_append(struct gwavi_t *gwavi, const unsigned char *buffer,
+		       size_t len);
+int gwavi_frame_end(struct gwavi_t *gwavi);
 
 /*
  * If needed, these functions can be called before closing the file to
@@ -58,5 +212,91 @@ int gwavi_set_codec(struct gwavi_t *gwavi, const char *fourcc);
 int gwavi_set_size(struct gwavi_t *gwavi, unsigned int width,
 		    unsigned int height);
 
+/*
+ * Errors: functions return -1 (or NULL) on error and record the error code in
+ * the gwavi_t structure. Errors and warnings are also passed to a log callback
+ * which prints them on stderr by default. gwavi_set_log() with a NULL gwavi
+ * changes the defaults used for messages not tied to a gwavi_t structure and
+ * inherited by the ones opened afterwards.
+ */
+int gwavi_last_error(struct gwavi_t *gwavi);
+const char *gwavi_strerror(int code);
+void gwavi_set_log(struct gwavi_t *gwavi,
+		   void (*log)(void *ctx, const struct gwavi_error_t *error),
+		   void *ctx, int level);
+
+/*
+ * Memory: gwavi_set_allocator() with a NULL gwavi changes the allocator used
+ * by the gwavi_t structures opened afterwards, otherwise it only changes the
+ * one of the given structure.
+ */
+int gwavi_set_allocator(struct gwavi_t *gwavi,
+			const struct gwavi_allocator_t *allocator);
+
+/*
+ * Threaded mode: gwavi_add_frame() and gwavi_add_audio() (and their vectored
+ * variants) can be called concurrently from several threads, the chunks being
+ * written by a dedicated thread.
+ */
+int gwavi_set_threaded(struct gwavi_t *gwavi, unsigned int max_queued);
+
+/*
+ * File descriptor budget: parkable handles have their file closed when too
+ * many are open, and reopened on their next write.
+ */
+int gwavi_set_fd_budget(unsigned int max_open);
+int gwavi_set_parkable(struct gwavi_t *gwavi, int enable);
+int gwavi_park(struct gwavi_t *gwavi);
+
+/* sinks receiving a copy of the bytes written to the file */
+int gwavi_add_sink(struct gwavi_t *gwavi, int fd, size_t ring_size);
+
+/*
+ * Live mode: the file can be played while it is being recorded. The index
+ * published to shared memory is this structure followed by count idx1
+ * entries of 16 bytes.
+ */
+struct gwavi_live_index_t
+{
+	volatile unsigned int seq;	/* odd while being updated */
+	unsigned int count;	/* entries published */
+	unsigned int capacity;	/* entries the object has room for */
+	unsigned int frames;	/* video frames published */
+	unsigned int movi;	/* file offset the entry offsets are from */
+};
+
+int gwavi_set_live(struct gwavi_t *gwavi, unsigned int interval_ms,
+		   const char *shm_name);
+int gwavi_read_live_index(const char *shm_name, unsigned char *entries,
+			  unsigned int max_entries, unsigned int *movi);
+
+/* I/O worker pools shared by many handles in threaded mode */
+struct gwavi_pool_t *gwavi_pool_create(unsigned int threads, const int *cpus);
+int gwavi_pool_attach(struct gwavi_pool_t *pool, struct gwavi_t *gwavi,
+		      unsigned int max_queued);
+int gwavi_pool_destroy(struct gwavi_pool_t *pool);
+
+/* timestamped frames, gaps filled with empty chunks repeating a frame */
+int gwavi_add_frame_ts(struct gwavi_t *gwavi, double timestamp,
+		       unsigned char *buffer, size_t len);
+
+/* frames added out of order, written in sequence number order */
+int gwavi_add_frame_seq(struct gwavi_t *gwavi, unsigned int seq,
+			unsigned char *buffer, size_t len);
+int gwavi_set_reorder_window(struct gwavi_t *gwavi, unsigned int window);
+
+/*
+ * Parallel mode: the same functions can be called concurrently from several
+ * threads, each one writing its chunk to the file itself with pwritev().
+ */
+int gwavi_set_parallel(struct gwavi_t *gwavi, unsigned int max_chunks);
+
+/*
+ * Realtime mode: no allocation while adding chunks and errors are queued in a
+ * lock-free ring instead of being logged.
+ */
+int gwavi_set_realtime(struct gwavi_t *gwavi, unsigned int max_chunks);
+int gwavi_pop_error(struct gwavi_t *gwavi, struct gwavi_error_t *error);
+
 #endif /* ndef H_GWAVI */
 
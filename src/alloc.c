@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Memory allocation for gwavi library.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for recursive mutexes */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+static void *
+libc_malloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *
+libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void
+libc_free(void *ctx, void *ptr)
+{
+	(void)ctx;
+	free(ptr);
+}
+
+static const struct gwavi_allocator_t libc_allocator = {
+	libc_malloc, libc_realloc, libc_free, NULL
+};
+
+/* allocator used without gwavi_t structure and inherited by gwavi_open() */
+static struct gwavi_allocator_t default_allocator = {
+	libc_malloc, libc_realloc, libc_free, NULL
+};
+
+/*
+ * Copy the default allocator to alloc, for objects other than gwavi_t
+ * structures that need to remember the allocator they were allocated with.
+ */
+void
+gwavi_default_allocator(struct gwavi_allocator_t *alloc)
+{
+	*alloc = default_allocator;
+}
+
+/*
+ * Allocate a zeroed gwavi_t structure with the default allocator, which is
+ * remembered to free it and used for all its other allocations.
+ */
+struct gwavi_t *
+gwavi_alloc_handle(void)
+{
+	struct gwavi_allocator_t alloc = default_allocator;
+	pthread_mutexattr_t attr;
+	struct gwavi_t *gwavi;
+
+	gwavi = (struct gwavi_t *)alloc.malloc(alloc.ctx,
+					       sizeof(struct gwavi_t));
+	if (!gwavi)
+		return NULL;
+	(void)memset(gwavi, 0, sizeof(struct gwavi_t));
+	gwavi->alloc = alloc;
+	gwavi->handle_alloc = alloc;
+
+	/* taken again when closing completes a streamed frame */
+	(void)pthread_mutexattr_init(&attr);
+	(void)pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	(void)pthread_mutex_init(&gwavi->park_lock, &attr);
+	(void)pthread_mutexattr_destroy(&attr);
+
+	return gwavi;
+}
+
+/*
+ * Free a gwavi_t structure with the allocator it was allocated with.
+ */
+void
+gwavi_free_handle(struct gwavi_t *gwavi)
+{
+	struct gwavi_allocator_t alloc = gwavi->handle_alloc;
+
+	(void)pthread_mutex_destroy(&gwavi->park_lock);
+	alloc.free(alloc.ctx, gwavi);
+}
+
+void *
+gwavi_malloc(struct gwavi_t *gwavi, size_t size)
+{
+	const struct gwavi_allocator_t *alloc =
+		gwavi ? &gwavi->alloc : &default_allocator;
+
+	return alloc->malloc(alloc->ctx, size);
+}
+
+void *
+gwavi_realloc(struct gwavi_t *gwavi, void *ptr, size_t size)
+{
+	const struct gwavi_allocator_t *alloc =
+		gwavi ? &gwavi->alloc : &default_allocator;
+
+	return alloc->realloc(alloc->ctx, ptr, size);
+}
+
+void
+gwavi_free(struct gwavi_t *gwavi, void *ptr)
+{
+	const struct gwavi_allocator_t *alloc =
+		gwavi ? &gwavi->alloc : &default_allocator;
+
+	if (ptr)
+		alloc->free(alloc->ctx, ptr);
+}
+
+/**
+ * This function sets the functions used to allocate memory. By default, the
+ * C library malloc(), realloc() and free() are used.
+ *
+ * When gwavi is NULL, the allocator becomes the default one, used by
+ * gwavi_open() for the gwavi_t structure and inherited by it. It must not be
+ * changed while another thread is opening a gwavi_t structure.
+ *
+ * Otherwise, the allocator is only used for the memory of this gwavi_t
+ * structure: the index (staged or not) and the reorder window are moved to
+ * memory obtained from the new allocator and the idle frame buffers are
+ * released. The gwavi_t structure itself is still freed with the allocator it
+ * was allocated with. The allocator cannot be changed while buffers obtained
+ * with gwavi_frame_alloc() are in use, frames wait in the reorder window or
+ * sinks are attached.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-, or NULL to
+ * set the default allocator.
+ * @param allocator Allocation functions, or NULL to go back to the C library
+ * ones. All three functions must be set. The structure is copied.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_allocator(struct gwavi_t *gwavi,
+		    const struct gwavi_allocator_t *allocator)
+{
+	struct gwavi_allocator_t old;
+	struct gwavi_frame_buf_t *buf;
+	struct gwavi_reorder_slot_t *reorder = NULL;
+	struct gwavi_index_entry_t *offsets;
+	unsigned char *index = NULL;
+	char *filename;
+	size_t reorder_size, filename_size;
+
+	if (!allocator)
+		allocator = &libc_allocator;
+	if (!allocator->malloc || !allocator->realloc || !allocator->free) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_allocator",
+			     "allocator functions cannot be NULL", 0);
+		return -1;
+	}
+
+	if (!gwavi) {
+		default_allocator = *allocator;
+		return 0;
+	}
+
+	if (gwavi->threaded || gwavi->parallel) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_allocator",
+			     "not available in threaded or parallel mode", 0);
+		return -1;
+	}
+	if (gwavi->frames_out || gwavi->reorder_held) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_allocator",
+			     "frame buffers are in use", 0);
+		return -1;
+	}
+	/* the sinks are freed with the allocator of the handle */
+	if (gwavi->tee) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_allocator",
+			     "not available with sinks", 0);
+		return -1;
+	}
+
+	filename_size = strlen(gwavi->filename) + 1;
+	filename = (char *)allocator->malloc(allocator->ctx, filename_size);
+	if (!filename) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_set_allocator",
+			     "could not allocate memory for file name", 0);
+		return -1;
+	}
+	(void)memcpy(filename, gwavi->filename, filename_size);
+
+	offsets = (struct gwavi_index_entry_t *)allocator->malloc(
+			allocator->ctx, (size_t)gwavi->offsets_len *
+			sizeof(struct gwavi_index_entry_t));
+	if (!offsets) {
+		allocator->free(allocator->ctx, filename);
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_set_allocator",
+			     "could not allocate memory for gwavi offsets table",
+			     0);
+		return -1;
+	}
+	(void)memcpy(offsets, gwavi->offsets,
+		     (size_t)gwavi->offsets_ptr *
+		     sizeof(struct gwavi_index_entry_t));
+
+	if (gwavi->index) {
+		index = (unsigned char *)allocator->malloc(allocator->ctx,
+				(size_t)gwavi->offsets_len * 16);
+		if (!index) {
+			allocator->free(allocator->ctx, offsets);
+			allocator->free(allocator->ctx, filename);
+			gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_set_allocator",
+				     "could not allocate memory for staged "
+				     "index", 0);
+			return -1;
+		}
+		(void)memcpy(index, gwavi->index,
+			     (size_t)gwavi->offsets_ptr * 16);
+	}
+
+	/* the reorder window holds no frame, only its slots move */
+	reorder_size = gwavi->reorder_window *
+		sizeof(struct gwavi_reorder_slot_t);
+	if (reorder_size) {
+		reorder = (struct gwavi_reorder_slot_t *)allocator->malloc(
+				allocator->ctx, reorder_size);
+		if (!reorder) {
+			if (index)
+				allocator->free(allocator->ctx, index);
+			allocator->free(allocator->ctx, offsets);
+			allocator->free(allocator->ctx, filename);
+			gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_set_allocator",
+				     "could not allocate memory for reorder "
+				     "window", 0);
+			return -1;
+		}
+		(void)memset(reorder, 0, reorder_size);
+	}
+
+	old = gwavi->alloc;
+	old.free(old.ctx, gwavi->filename);
+	gwavi->filename = filename;
+	old.free(old.ctx, gwavi->offsets);
+	gwavi->offsets = offsets;
+	if (gwavi->index)
+		old.free(old.ctx, gwavi->index);
+	gwavi->index = index;
+	if (gwavi->reorder)
+		old.free(old.ctx, gwavi->reorder);
+	gwavi->reorder = reorder;
+	while (gwavi->frame_pool) {
+		buf = gwavi->frame_pool;
+		gwavi->frame_pool = buf->next;
+		old.free(old.ctx, buf);
+	}
+	gwavi->frame_pool_len = 0;
+	gwavi->alloc = *allocator;
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Atomic operations used by gwavi. C89 has none so they map to the GCC
+ * builtins, which clang supports as well.
+ */
+#ifndef H_GWAVI_ATOMIC
+#define H_GWAVI_ATOMIC
+
+/* full memory barrier */
+#define gwavi_barrier()		__sync_synchronize()
+
+/* add v to *p and return the previous value */
+#define gwavi_fetch_add(p, v)	__sync_fetch_and_add((p), (v))
+
+/* subtract v from *p and return the previous value */
+#define gwavi_fetch_sub(p, v)	__sync_fetch_and_sub((p), (v))
+
+/* store v into *p if it holds old and return the value *p held */
+#define gwavi_compare_swap(p, old, v) \
+	__sync_val_compare_and_swap((p), (old), (v))
+
+/*
+ * Store v into *p and return the previous value. The builtin is only an
+ * acquire barrier, the leading barrier makes it a full one.
+ */
+#define gwavi_exchange(p, v) \
+	(__sync_synchronize(), __sync_lock_test_and_set((p), (v)))
+
+#endif /* ndef H_GWAVI_ATOMIC */
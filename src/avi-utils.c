@@ -46,69 +46,54 @@ write_avi_header(FILE *out, struct gwavi_header_t *avi_header)
 {
 	long marker, t;
 
-	if (write_chars_bin(out, "avih", 4) == -1) {
-		(void)fprintf(stderr, "write_avi_header: write_chars_bin() "
-			      "failed\n");
+	if (write_chars_bin(out, "avih", 4) == -1)
 		return -1;
-	}
-	if ((marker = ftell(out)) == -1) {
-		perror("write_avi_header (ftell)");
+	if ((marker = ftell(out)) == -1)
 		return -1;
-	}
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 
 	if (write_int(out, avi_header->time_delay) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->data_rate) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->reserved) == -1)
-		goto write_int_failed;
+		return -1;
 	/* dwFlags */
 	if (write_int(out, avi_header->flags) == -1)
-		goto write_int_failed;
+		return -1;
 	/* dwTotalFrames */
 	if (write_int(out, avi_header->number_of_frames) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->initial_frames) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->data_streams) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->buffer_size) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->width) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->height) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->time_scale) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->playback_data_rate) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->starting_time) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, avi_header->data_length) == -1)
-		goto write_int_failed;
+		return -1;
 
-	if ((t = ftell(out)) == -1) {
-		perror("write_avi_header (ftell)");
+	if ((t = ftell(out)) == -1)
 		return -1;
-	}
-	if (fseek(out, marker, SEEK_SET) == -1) {
-		perror("write_avi_header (fseek)");
+	if (fseek(out, marker, SEEK_SET) == -1)
 		return -1;
-	}
 	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
-		goto write_int_failed;
-	if (fseek(out, t, SEEK_SET) == -1) {
-		perror("write_avi_header (fseek)");
 		return -1;
-	}
+	if (fseek(out, t, SEEK_SET) == -1)
+		return -1;
 
 	return 0;
-
-write_int_failed:
-	(void)fprintf(stderr, "write_avi_header: write_int() failed\n");
-	return -1;
 }
 
 int
@@ -117,66 +102,50 @@ write_stream_header(FILE *out, struct gwavi_stream_header_t *stream_header)
 	long marker, t;
 
 	if (write_chars_bin(out, "strh", 4) == -1)
-		goto write_chars_bin_failed;
-	if ((marker = ftell(out)) == -1) {
-		perror("write_stream_header (ftell)");
 		return -1;
-	}
+	if ((marker = ftell(out)) == -1)
+		return -1;
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 
 	if (write_chars_bin(out, stream_header->data_type, 4) == -1)
-		goto write_chars_bin_failed;
+		return -1;
 	if (write_chars_bin(out, stream_header->codec, 4) == -1)
-		goto write_chars_bin_failed;
+		return -1;
 	if (write_int(out, stream_header->flags) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->priority) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->initial_frames) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->time_scale) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->data_rate) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->start_time) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->data_length) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->buffer_size) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->video_quality) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_header->sample_size) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 
-	if ((t = ftell(out)) == -1) {
-		perror("write_stream_header (ftell)");
+	if ((t = ftell(out)) == -1)
 		return -1;
-	}
-	if (fseek(out, marker, SEEK_SET) == -1) {
-		perror("write_stream_header (fseek)");
+	if (fseek(out, marker, SEEK_SET) == -1)
 		return -1;
-	}
 	write_int(out, (unsigned int)(t - marker - 4));
-	if (fseek(out, t, SEEK_SET) == -1){
-		perror("write_stream_header (fseek)");
+	if (fseek(out, t, SEEK_SET) == -1)
 		return -1;
-	}
 
 	return 0;
-
-write_int_failed:
-	(void)fprintf(stderr, "write_stream_header: write_int() failed\n");
-	return -1;
-
-write_chars_bin_failed:
-	(void)fprintf(stderr, "write_stream_header: write_chars_bin() failed\n");
-	return -1;
 }
 
 int
@@ -185,86 +154,61 @@ write_stream_format_v(FILE *out, struct gwavi_stream_format_v_t *stream_format_v
 	long marker,t;
 	unsigned int i;
 
-	if (write_chars_bin(out, "strf", 4) == -1) {
-		(void)fprintf(stderr, "write_stream_format_v: write_chars_bin()"
-			      " failed\n");
+	if (write_chars_bin(out, "strf", 4) == -1)
 		return -1;
-	}
-	if ((marker = ftell(out)) == -1) {
-		perror("write_stream_format_v (ftell)");
+	if ((marker = ftell(out)) == -1)
 		return -1;
-	}
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 
 	if (write_int(out, stream_format_v->header_size) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->width) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->height) == -1)
-		goto write_int_failed;
-	if (write_short(out, stream_format_v->num_planes) == -1) {
-		(void)fprintf(stderr, "write_stream_format_v: write_short() "
-			      "failed\n");
 		return -1;
-	}
-	if (write_short(out, stream_format_v->bits_per_pixel) == -1) {
-		(void)fprintf(stderr, "write_stream_format_v: write_short() "
-			      "failed\n");
+	if (write_short(out, stream_format_v->num_planes) == -1)
+		return -1;
+	if (write_short(out, stream_format_v->bits_per_pixel) == -1)
 		return -1;
-	}
 	if (write_int(out, stream_format_v->compression_type) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->image_size) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->x_pels_per_meter) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->y_pels_per_meter) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->colors_used) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_v->colors_important) == -1)
-		goto write_int_failed;
+		return -1;
 
 	if (stream_format_v->colors_used != 0)
 		for (i = 0; i < stream_format_v->colors_used; i++) {
 			if (fputc(stream_format_v->palette[i] & 255, out)
 					== EOF)
-				goto fputc_failed;
+				return -1;
 			if (fputc((stream_format_v->palette[i] >> 8) & 255, out)
 					== EOF)
-				goto fputc_failed;
+				return -1;
 			if (fputc((stream_format_v->palette[i] >> 16) & 255, out)
 					== EOF)
-				goto fputc_failed;
+				return -1;
 			if (fputc(0, out) == EOF)
-				goto fputc_failed;
+				return -1;
 		}
 
-	if ((t = ftell(out)) == -1) {
-		perror("write_stream_format_v (ftell)");
+	if ((t = ftell(out)) == -1)
 		return -1;
-	}
-	if (fseek(out,marker,SEEK_SET) == -1) {
-		perror("write_stream_format_v (fseek)");
+	if (fseek(out,marker,SEEK_SET) == -1)
 		return -1;
-	}
 	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
-		goto write_int_failed;
-	if (fseek(out, t, SEEK_SET) == -1) {
-		perror("write_stream_format_v (fseek)");
 		return -1;
-	}
+	if (fseek(out, t, SEEK_SET) == -1)
+		return -1;
 
 	return 0;
-
-write_int_failed:
-	(void)fprintf(stderr, "write_stream_format_v: write_int() failed\n");
-	return -1;
-
-fputc_failed:
-	(void)fprintf(stderr, "write_stream_format_v: fputc() failed\n");
-	return -1;
 }
 
 int
@@ -272,224 +216,213 @@ write_stream_format_a(FILE *out, struct gwavi_stream_format_a_t *stream_format_a
 {
 	long marker, t;
 
-	if (write_chars_bin(out, "strf", 4) == -1) {
-		(void)fprintf(stderr, "write_stream_format_a: write_chars_bin()"
-			      " failed\n");
+	if (write_chars_bin(out, "strf", 4) == -1)
 		return -1;
-	}
-	if ((marker = ftell(out)) == -1) {
-		perror("write_stream_format_a (ftell)");
+	if ((marker = ftell(out)) == -1)
 		return -1;
-	}
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
+		return -1;
 
 	if (write_short(out, stream_format_a->format_type) == -1)
-		goto write_short_failed;
+		return -1;
 	if (write_short(out, stream_format_a->channels) == -1)
-		goto write_short_failed;
+		return -1;
 	if (write_int(out, stream_format_a->sample_rate) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_int(out, stream_format_a->bytes_per_second) == -1)
-		goto write_int_failed;
+		return -1;
 	if (write_short(out, stream_format_a->block_align) == -1)
-		goto write_short_failed;
+		return -1;
 	if (write_short(out, stream_format_a->bits_per_sample) == -1)
-		goto write_short_failed;
+		return -1;
 	if (write_short(out, stream_format_a->size) == -1)
-		goto write_short_failed;
+		return -1;
 
-	if ((t = ftell(out)) == -1) {
-		perror("write_stream_format_a (ftell)");
+	if ((t = ftell(out)) == -1)
 		return -1;
-	}
-	if (fseek(out, marker, SEEK_SET) == -1) {
-		perror("write_stream_format_a (fseek)");
+	if (fseek(out, marker, SEEK_SET) == -1)
 		return -1;
-	}
 	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
-		goto write_int_failed;
-	if (fseek(out, t, SEEK_SET) == -1) {
-		perror("write_stream_format_a (fseek)");
 		return -1;
-	}
+	if (fseek(out, t, SEEK_SET) == -1)
+		return -1;
 
 	return 0;
+}
 
-write_int_failed:
-	(void)fprintf(stderr, "write_stream_format_a: write_int() failed\n");
-	return -1;
+/*
+ * Write the strl list describing a stream.
+ */
+static int
+write_stream_list(FILE *out, struct gwavi_stream_t *stream)
+{
+	long marker, t;
 
-write_short_failed:
-	(void)fprintf(stderr, "write_stream_format_a: write_short() failed\n");
-	return -1;
+	if (write_chars_bin(out, "LIST", 4) == -1)
+		return -1;
+	if ((marker = ftell(out)) == -1)
+		return -1;
+	if (write_int(out, 0) == -1)
+		return -1;
+	if (write_chars_bin(out, "strl", 4) == -1)
+		return -1;
+	if (write_stream_header(out, &stream->header) == -1)
+		return -1;
+	if (stream->audio) {
+		if (write_stream_format_a(out, &stream->format_a) == -1)
+			return -1;
+	} else if (write_stream_format_v(out, &stream->format_v) == -1) {
+		return -1;
+	}
+
+	if ((t = ftell(out)) == -1)
+		return -1;
+	if (fseek(out, marker, SEEK_SET) == -1)
+		return -1;
+	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
+		return -1;
+	if (fseek(out, t, SEEK_SET) == -1)
+		return -1;
+
+	return 0;
 }
 
 int
 write_avi_header_chunk(struct gwavi_t *gwavi)
 {
 	long marker, t;
-	long sub_marker;
+	unsigned int i;
 	FILE *out = gwavi->out;
 
 	if (write_chars_bin(out, "LIST", 4) == -1)
-		goto write_chars_bin_failed;
+		return -1;
 	if ((marker = ftell(out)) == -1)
-		goto ftell_failed;
-	if (write_int(out, 0) == -1)
-		goto write_int_failed;
-	if (write_chars_bin(out, "hdrl", 4) == -1)
-		goto write_chars_bin_failed;
-	if (write_avi_header(out, &gwavi->avi_header) == -1) {
-		(void)fprintf(stderr, "write_avi_header_chunk: "
-			      "write_avi_header() failed\n");
 		return -1;
-	}
-
-	if (write_chars_bin(out, "LIST", 4) == -1)
-		goto write_chars_bin_failed;
-	if ((sub_marker = ftell(out)) == -1)
-		goto ftell_failed;
 	if (write_int(out, 0) == -1)
-		goto write_int_failed;
-	if (write_chars_bin(out, "strl", 4) == -1)
-		goto write_chars_bin_failed;
-	if (write_stream_header(out, &gwavi->stream_header_v) == -1) {
-		(void)fprintf(stderr, "write_avi_header_chunk: "
-			      "write_stream_header failed\n");
 		return -1;
-	}
-	if (write_stream_format_v(out, &gwavi->stream_format_v) == -1) {
-		(void)fprintf(stderr, "write_avi_header_chunk: "
-			      "write_stream_format_v failed\n");
+	if (write_chars_bin(out, "hdrl", 4) == -1)
+		return -1;
+	if (write_avi_header(out, &gwavi->avi_header) == -1)
 		return -1;
-	}
-
-	if ((t = ftell(out)) == -1)
-		goto ftell_failed;
 
-	if (fseek(out, sub_marker, SEEK_SET) == -1)
-		goto fseek_failed;
-	if (write_int(out, (unsigned int)(t - sub_marker - 4)) == -1)
-		goto write_int_failed;
-	if (fseek(out, t, SEEK_SET) == -1)
-		goto fseek_failed;
-
-	if (gwavi->avi_header.data_streams == 2) {
-		if (write_chars_bin(out, "LIST", 4) == -1)
-			goto write_chars_bin_failed;
-		if ((sub_marker = ftell(out)) == -1)
-			goto ftell_failed;
-		if (write_int(out, 0) == -1)
-			goto write_int_failed;
-		if (write_chars_bin(out, "strl", 4) == -1)
-			goto write_chars_bin_failed;
-		if (write_stream_header(out, &gwavi->stream_header_a) == -1) {
-			(void)fprintf(stderr, "write_avi_header_chunk: "
-				      "write_stream_header failed\n");
-			return -1;
-		}
-		if (write_stream_format_a(out, &gwavi->stream_format_a) == -1) {
-			(void)fprintf(stderr, "write_avi_header_chunk: "
-				      "write_stream_format_a failed\n");
+	for (i = 0; i < gwavi->avi_header.data_streams; i++)
+		if (write_stream_list(out, &gwavi->streams[i]) == -1)
 			return -1;
-		}
-
-		if ((t = ftell(out)) == -1)
-			goto ftell_failed;
-		if (fseek(out, sub_marker, SEEK_SET) == -1)
-			goto fseek_failed;
-		if (write_int(out, (unsigned int)(t - sub_marker - 4)) == -1)
-			goto write_int_failed;
-		if (fseek(out, t, SEEK_SET) == -1)
-			goto fseek_failed;
-	}
 
 	if ((t = ftell(out)) == -1)
-		goto ftell_failed;
+		return -1;
 	if (fseek(out, marker, SEEK_SET) == -1)
-		goto fseek_failed;
+		return -1;
 	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
-		goto write_int_failed;
+		return -1;
 	if (fseek(out, t, SEEK_SET) == -1)
-		goto fseek_failed;
+		return -1;
 
 	return 0;
+}
 
-ftell_failed:
-	perror("write_avi_header_chunk (ftell)");
-	return -1;
-
-fseek_failed:
-	perror("write_avi_header_chunk (fseek)");
-	return -1;
+/* index entries serialized before each write, 16 bytes each */
+#define INDEX_BLOCK_ENTRIES	4096
 
-write_int_failed:
-	(void)fprintf(stderr, "write_avi_header_chunk: write_int() failed\n");
-	return -1;
+/*
+ * Store n in little endian at dst.
+ */
+static void
+put_le32(unsigned char *dst, unsigned int n)
+{
+	dst[0] = (unsigned char)n;
+	dst[1] = (unsigned char)(n >> 8);
+	dst[2] = (unsigned char)(n >> 16);
+	dst[3] = (unsigned char)(n >> 24);
+}
 
-write_chars_bin_failed:
-	(void)fprintf(stderr, "write_avi_header_chunk: write_chars_bin() failed\n");
-	return -1;
+/*
+ * Serialize the 16 bytes idx1 entry of a chunk at dst, offset being its
+ * position relative to the movi list.
+ */
+void
+put_index_entry(unsigned char *dst, const struct gwavi_index_entry_t *entry,
+		unsigned int offset)
+{
+	dst[0] = (unsigned char)('0' + entry->stream / 10);
+	dst[1] = (unsigned char)('0' + entry->stream % 10);
+	(void)memcpy(dst + 2, entry->audio ? "wb" : "dc", 2);
+	put_le32(dst + 4, entry->flags);
+	put_le32(dst + 8, offset);
+	put_le32(dst + 12, entry->size);
 }
 
+/*
+ * Write the idx1 chunk. The entries are serialized into 64 KB blocks which
+ * are each written with a single fwrite().
+ */
 int
-write_index(FILE *out, int count, unsigned int *offsets)
+write_index(FILE *out, int count, const struct gwavi_index_entry_t *offsets)
 {
-	long marker, t;
+	unsigned char block[INDEX_BLOCK_ENTRIES * 16], *entry;
+	const struct gwavi_index_entry_t *chunk;
 	unsigned int offset = 4;
+	int t, n;
 
-	if (offsets == 0)
+	if (offsets == 0 || count < 0)
 		return -1;
 
-	if (write_chars_bin(out, "idx1", 4) == -1) {
-		(void)fprintf(stderr, "write_index: write_chars_bin) failed\n");
+	if (write_chars_bin(out, "idx1", 4) == -1)
 		return -1;
-	}
-	if ((marker = ftell(out)) == -1) {
-		perror("write_index (ftell)");
+	if (write_int(out, (unsigned int)count * 16) == -1)
 		return -1;
-	}
-	if (write_int(out, 0) == -1)
-		goto write_int_failed;
-
-	for (t = 0; t < count; t++) {
-		if ((offsets[t] & 0x80000000) == 0)
-			write_chars(out, "00dc");
-		else {
-			write_chars(out, "01wb");
-			offsets[t] &= 0x7fffffff;
+
+	for (t = 0; t < count; t += n) {
+		n = count - t < INDEX_BLOCK_ENTRIES ?
+			count - t : INDEX_BLOCK_ENTRIES;
+		for (entry = block; entry < block + n * 16; entry += 16) {
+			chunk = &offsets[t + (entry - block) / 16];
+			put_index_entry(entry, chunk, offset);
+			offset += chunk->size + 8;
 		}
-		if (write_int(out, 0x10) == -1)
-			goto write_int_failed;
-		if (write_int(out, offset) == -1)
-			goto write_int_failed;
-		if (write_int(out, offsets[t]) == -1)
-			goto write_int_failed;
-
-		offset = offset + offsets[t] + 8;
+		if (fwrite(block, 16, (size_t)n, out) != (size_t)n)
+			return -1;
 	}
 
-	if ((t = ftell(out)) == -1) {
-		perror("write_index (ftell)");
+	return 0;
+}
+
+/*
+ * Write the idx1 chunk of count video keyframes of size bytes each, computing
+ * the entries instead of reading them from an offsets table.
+ */
+int
+write_fixed_index(FILE *out, int count, unsigned int size)
+{
+	unsigned char block[INDEX_BLOCK_ENTRIES * 16], *entry;
+	struct gwavi_index_entry_t chunk;
+	unsigned int offset = 4;
+	int t, n;
+
+	if (count < 0)
 		return -1;
-	}
-	if (fseek(out, marker, SEEK_SET) == -1) {
-		perror("write_index (fseek)");
+
+	if (write_chars_bin(out, "idx1", 4) == -1)
 		return -1;
-	}
-	if (write_int(out, (unsigned int)(t - marker - 4)) == -1)
-		goto write_int_failed;
-	if (fseek(out, t, SEEK_SET) == -1) {
-		perror("write_index (fseek)");
+	if (write_int(out, (unsigned int)count * 16) == -1)
 		return -1;
+
+	chunk.size = size;
+	chunk.stream = 0;
+	chunk.audio = 0;
+	chunk.flags = GWAVI_IF_KEYFRAME;
+	for (t = 0; t < count; t += n) {
+		n = count - t < INDEX_BLOCK_ENTRIES ?
+			count - t : INDEX_BLOCK_ENTRIES;
+		for (entry = block; entry < block + n * 16; entry += 16) {
+			put_index_entry(entry, &chunk, offset);
+			offset += size + 8;
+		}
+		if (fwrite(block, 16, (size_t)n, out) != (size_t)n)
+			return -1;
 	}
 
 	return 0;
-
-write_int_failed:
-	(void)fprintf(stderr, "write_index: write_int() failed\n");
-	return -1;
 }
 
 /**
@@ -551,10 +484,8 @@ check_fourcc(const char *fourcc)
 		"YV92"
 		"ZLIB ZMBV ZPEG ZYGO ZYYY";
 
-	if (!fourcc) {
-		(void)fputs("fourcc cannot be NULL", stderr);
+	if (!fourcc)
 		return -1;
-	}
 	if (strchr(fourcc, ' ') || !strstr(valid_fourcc, fourcc))
 		ret = 1;
 
@@ -38,6 +38,8 @@
 
 /*
  * Utility functions for gwavi library.
+ * They return 0 on success and -1 on error without printing anything, errno
+ * being left as set by the failing call: reporting is up to the caller.
  */
 
 /* Functions declaration */
@@ -49,7 +51,12 @@ int write_stream_format_v(FILE *out,
 int write_stream_format_a(FILE *out,
 			  struct gwavi_stream_format_a_t *stream_format_a);
 int write_avi_header_chunk(struct gwavi_t *gwavi);
-int write_index(FILE *out, int count, unsigned int *offsets);
+void put_index_entry(unsigned char *dst,
+		     const struct gwavi_index_entry_t *entry,
+		     unsigned int offset);
+int write_index(FILE *out, int count,
+		const struct gwavi_index_entry_t *offsets);
+int write_fixed_index(FILE *out, int count, unsigned int size);
 int check_fourcc(const char *fourcc);
 
 #endif /* ndef GWAVI_UTILS_H */
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * File descriptor budget: handles made parkable with gwavi_set_parkable() are
+ * kept in a least recently used list, and the least recently used ones have
+ * their file closed when more than the budget are open. A parked handle
+ * remembers its write position and reopens its file on its next write, its
+ * headers and index being in memory all along.
+ *
+ * Handles are parked by writes made on other handles, possibly from other
+ * threads, so each handle has a lock that is held by its own thread from
+ * gwavi_fd_resume() to gwavi_fd_release() while it uses its file. A handle
+ * whose lock is busy is skipped when parking. The budget lock is taken after
+ * the lock of a handle, and the locks of the other handles are only tried
+ * while holding it.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int budget_max;		/* 0 for no limit */
+static unsigned int budget_open;	/* handles in the list */
+static struct gwavi_t *lru_head;	/* most recently used */
+static struct gwavi_t *lru_tail;
+
+/*
+ * Insert a handle at the head of the list. Called with the lock held.
+ */
+static void
+lru_insert(struct gwavi_t *gwavi)
+{
+	gwavi->lru_prev = NULL;
+	gwavi->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = gwavi;
+	else
+		lru_tail = gwavi;
+	lru_head = gwavi;
+	gwavi->lru_linked = 1;
+	budget_open++;
+}
+
+/*
+ * Remove a handle from the list. Called with the lock held.
+ */
+static void
+lru_remove(struct gwavi_t *gwavi)
+{
+	if (gwavi->lru_prev)
+		gwavi->lru_prev->lru_next = gwavi->lru_next;
+	else
+		lru_head = gwavi->lru_next;
+	if (gwavi->lru_next)
+		gwavi->lru_next->lru_prev = gwavi->lru_prev;
+	else
+		lru_tail = gwavi->lru_prev;
+	gwavi->lru_linked = 0;
+	budget_open--;
+}
+
+/*
+ * Close the file of a handle, remembering where to go on writing. Called with
+ * the budget lock and the lock of the handle held. Return 0 on success, -1 on
+ * error, in which case the file is left open when the buffered data could not
+ * be written, and parked anyway once it was.
+ */
+static int
+park(struct gwavi_t *gwavi, const char *caller)
+{
+	long pos;
+
+	if (fflush(gwavi->out) == EOF || (pos = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "could not flush file of parked handle", errno);
+		return -1;
+	}
+	lru_remove(gwavi);
+	gwavi->parked = 1;
+	gwavi->parked_pos = pos;
+	if (fclose(gwavi->out) == EOF) {
+		gwavi->out = NULL;
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "could not close file of parked handle", errno);
+		return -1;
+	}
+	gwavi->out = NULL;
+
+	return 0;
+}
+
+/*
+ * Park the least recently used handles until the budget is met, except the
+ * given one and the ones in use. Called with the budget lock held.
+ */
+static void
+enforce_budget(struct gwavi_t *except)
+{
+	struct gwavi_t *gwavi, *prev;
+
+	for (gwavi = lru_tail; gwavi && budget_max && budget_open > budget_max;
+	     gwavi = prev) {
+		prev = gwavi->lru_prev;
+		if (gwavi == except ||
+		    pthread_mutex_trylock(&gwavi->park_lock) != 0)
+			continue;
+		(void)park(gwavi, "park");
+		(void)pthread_mutex_unlock(&gwavi->park_lock);
+	}
+}
+
+/*
+ * Account for a file a parkable handle opened.
+ */
+void
+gwavi_fd_opened(struct gwavi_t *gwavi)
+{
+	if (!gwavi->parkable)
+		return;
+
+	(void)pthread_mutex_lock(&budget_lock);
+	lru_insert(gwavi);
+	enforce_budget(gwavi);
+	(void)pthread_mutex_unlock(&budget_lock);
+}
+
+/*
+ * Take a handle out of the budget, before it closes its file or stops being
+ * parkable.
+ */
+void
+gwavi_fd_forget(struct gwavi_t *gwavi)
+{
+	if (!gwavi->parkable)
+		return;
+
+	(void)pthread_mutex_lock(&budget_lock);
+	if (gwavi->lru_linked)
+		lru_remove(gwavi);
+	(void)pthread_mutex_unlock(&budget_lock);
+}
+
+/*
+ * Return non zero if a handle has a file, open or parked. Parking changes both
+ * with the budget lock held.
+ */
+int
+gwavi_fd_has_file(struct gwavi_t *gwavi)
+{
+	int ret;
+
+	if (!gwavi->parkable)
+		return gwavi->out != NULL;
+
+	(void)pthread_mutex_lock(&budget_lock);
+	ret = gwavi->out != NULL || gwavi->parked;
+	(void)pthread_mutex_unlock(&budget_lock);
+
+	return ret;
+}
+
+/*
+ * Make sure the file of a handle about to be written to is open, reopening it
+ * if it was parked, and mark the handle as the most recently used one. On
+ * success, the handle cannot be parked until gwavi_fd_release() is called.
+ * Return 0 on success, -1 on error.
+ */
+int
+gwavi_fd_resume(struct gwavi_t *gwavi, const char *caller)
+{
+	FILE *out;
+	int ret = 0;
+
+	if (!gwavi->parkable)
+		return 0;
+
+	(void)pthread_mutex_lock(&gwavi->park_lock);
+	(void)pthread_mutex_lock(&budget_lock);
+	if (gwavi->lru_linked) {
+		if (lru_head != gwavi) {
+			lru_remove(gwavi);
+			lru_insert(gwavi);
+		}
+	} else if (gwavi->parked) {
+		if ((out = fopen(gwavi->filename, "rb+")) == NULL) {
+			gwavi_report(gwavi, GWAVI_EIO, caller,
+				     "could not reopen file of parked handle",
+				     errno);
+			ret = -1;
+		} else if (fseek(out, gwavi->parked_pos, SEEK_SET) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, caller,
+				     "fseek() failed", errno);
+			(void)fclose(out);
+			ret = -1;
+		} else {
+			gwavi->out = out;
+			gwavi->parked = 0;
+			lru_insert(gwavi);
+			enforce_budget(gwavi);
+		}
+	}
+	(void)pthread_mutex_unlock(&budget_lock);
+	if (ret == -1)
+		(void)pthread_mutex_unlock(&gwavi->park_lock);
+
+	return ret;
+}
+
+/*
+ * Let a handle be parked again once its thread is done with its file.
+ */
+void
+gwavi_fd_release(struct gwavi_t *gwavi)
+{
+	if (gwavi->parkable)
+		(void)pthread_mutex_unlock(&gwavi->park_lock);
+}
+
+/**
+ * This function sets how many parkable handles can have their file open at
+ * the same time, see gwavi_set_parkable(). When more are needed, the least
+ * recently used ones are parked.
+ *
+ * @param max_open Maximum number of open files, or 0 for no limit, which is
+ * the default.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_fd_budget(unsigned int max_open)
+{
+	(void)pthread_mutex_lock(&budget_lock);
+	budget_max = max_open;
+	enforce_budget(NULL);
+	(void)pthread_mutex_unlock(&budget_lock);
+
+	return 0;
+}
+
+/**
+ * This function makes a handle parkable: its file can be closed when the
+ * budget set with gwavi_set_fd_budget() is exceeded, or with gwavi_park(),
+ * and is reopened on the next write. This lets a process keep far more
+ * recordings than it can have open files.
+ *
+ * A handle can be parked by calls made on other handles, from any thread: each
+ * handle is locked while it writes to its file, and handles in use are not
+ * parked. A handle must still only be used by one thread at a time. Threaded,
+ * parallel and realtime modes and sinks are not available to parkable
+ * handles.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param enable Non zero to make the handle parkable, zero to reopen its file
+ * if needed and keep it open.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_parkable(struct gwavi_t *gwavi, int enable)
+{
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_parkable",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (gwavi->threaded || gwavi->parallel) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parkable",
+			     "not available in threaded or parallel mode", 0);
+		return -1;
+	}
+	if (!enable == !gwavi->parkable)
+		return 0;
+	if (enable && gwavi->tee) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parkable",
+			     "not available with sinks", 0);
+		return -1;
+	}
+	/* reopening the file would break the bounds of realtime mode */
+	if (enable && gwavi->realtime) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parkable",
+			     "not available in realtime mode", 0);
+		return -1;
+	}
+
+	if (enable) {
+		gwavi->parkable = 1;
+		if (gwavi->out)
+			gwavi_fd_opened(gwavi);
+		return 0;
+	}
+
+	if (gwavi_fd_resume(gwavi, "gwavi_set_parkable") == -1)
+		return -1;
+	gwavi_fd_forget(gwavi);
+	gwavi_fd_release(gwavi);
+	gwavi->parkable = 0;
+
+	return 0;
+}
+
+/**
+ * This function parks a parkable handle right away, closing its file until
+ * the next write, for instance when its source goes idle.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open() and made
+ * parkable with gwavi_set_parkable().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_park(struct gwavi_t *gwavi)
+{
+	int ret = 0;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_park",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (!gwavi->parkable) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_park",
+			     "handle is not parkable", 0);
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&gwavi->park_lock);
+	(void)pthread_mutex_lock(&budget_lock);
+	if (gwavi->lru_linked)
+		ret = park(gwavi, "gwavi_park");
+	(void)pthread_mutex_unlock(&budget_lock);
+	(void)pthread_mutex_unlock(&gwavi->park_lock);
+
+	return ret;
+}
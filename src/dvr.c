@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Pre-trigger recording: a gwavi_dvr_t keeps the last seconds of video and
+ * audio in a fixed size memory ring and writes them to an AVI file when an
+ * event occurs, then keeps recording to that file.
+ *
+ * Frames and audio data are stored as records (header then payload) laid out
+ * one after the other in the ring. A record never wraps: when it does not fit
+ * at the end of the ring, it goes to the start and the end is skipped. The
+ * oldest record is always the keyframe starting a group of pictures, so that
+ * the dumped video can be decoded: room is made by evicting whole groups.
+ */
+
+#include <string.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+#define DVR_VIDEO	0
+#define DVR_AUDIO	1
+#define DVR_WRAP	2	/* the rest of the ring is skipped */
+
+/* records start on 8 bytes boundaries */
+#define DVR_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct gwavi_dvr_record_t
+{
+	size_t len;		/* payload length */
+	int type;		/* DVR_* */
+	int keyframe;
+};
+
+struct gwavi_dvr_t
+{
+	struct gwavi_allocator_t alloc;	/* this structure was allocated with */
+	unsigned char *ring;
+	size_t size;		/* bytes of the ring */
+	size_t head;		/* where the next record goes */
+	size_t tail;		/* oldest record */
+	unsigned int count;	/* records in the ring */
+	unsigned int frames;	/* video records in the ring */
+	unsigned int max_frames;	/* frames kept, 0 to only use size */
+	struct gwavi_t *live;	/* file recorded to since the trigger */
+};
+
+/*
+ * Return the size a record with a payload of len bytes takes in the ring.
+ */
+static size_t
+record_size(size_t len)
+{
+	return DVR_ALIGN(sizeof(struct gwavi_dvr_record_t) + len);
+}
+
+/*
+ * Return the position of the record at pos, which is the start of the ring
+ * when the end of the ring is skipped from pos.
+ */
+static size_t
+record_at(struct gwavi_dvr_t *dvr, size_t pos)
+{
+	if (dvr->size - pos < sizeof(struct gwavi_dvr_record_t) ||
+	    ((struct gwavi_dvr_record_t *)(dvr->ring + pos))->type == DVR_WRAP)
+		return 0;
+
+	return pos;
+}
+
+/*
+ * Return room for a record of need bytes at the head of the ring, NULL if
+ * there is not enough free space.
+ */
+static unsigned char *
+ring_reserve(struct gwavi_dvr_t *dvr, size_t need)
+{
+	struct gwavi_dvr_record_t *wrap;
+
+	if (dvr->count == 0)
+		dvr->head = dvr->tail = 0;
+
+	if (dvr->count == 0 || dvr->head > dvr->tail) {
+		/* free space is at the end and at the start of the ring */
+		if (dvr->size - dvr->head >= need)
+			return dvr->ring + dvr->head;
+		if (need > dvr->tail)
+			return NULL;
+		if (dvr->size - dvr->head >= sizeof(struct gwavi_dvr_record_t)) {
+			wrap = (struct gwavi_dvr_record_t *)(dvr->ring +
+							     dvr->head);
+			wrap->type = DVR_WRAP;
+		}
+		dvr->head = 0;
+		return dvr->ring;
+	}
+
+	/* free space is between head and tail */
+	if (dvr->tail - dvr->head >= need)
+		return dvr->ring + dvr->head;
+
+	return NULL;
+}
+
+/*
+ * Remove the oldest record from the ring.
+ */
+static void
+ring_pop(struct gwavi_dvr_t *dvr)
+{
+	struct gwavi_dvr_record_t *record;
+
+	dvr->tail = record_at(dvr, dvr->tail);
+	record = (struct gwavi_dvr_record_t *)(dvr->ring + dvr->tail);
+	if (record->type == DVR_VIDEO)
+		dvr->frames--;
+	dvr->tail += record_size(record->len);
+	dvr->count--;
+}
+
+/*
+ * Return the oldest record of the ring, which must not be empty.
+ */
+static struct gwavi_dvr_record_t *
+ring_peek(struct gwavi_dvr_t *dvr)
+{
+	dvr->tail = record_at(dvr, dvr->tail);
+
+	return (struct gwavi_dvr_record_t *)(dvr->ring + dvr->tail);
+}
+
+/*
+ * Evict the oldest group of pictures: the keyframe at the tail of the ring
+ * and everything up to the next keyframe.
+ */
+static void
+evict_gop(struct gwavi_dvr_t *dvr)
+{
+	struct gwavi_dvr_record_t *record;
+
+	ring_pop(dvr);
+	while (dvr->count > 0) {
+		record = ring_peek(dvr);
+		if (record->type == DVR_VIDEO && record->keyframe)
+			break;
+		ring_pop(dvr);
+	}
+}
+
+/*
+ * Return the number of video frames of the oldest group of pictures.
+ */
+static unsigned int
+first_gop_frames(struct gwavi_dvr_t *dvr)
+{
+	struct gwavi_dvr_record_t *record;
+	unsigned int i, frames = 0;
+	size_t pos = dvr->tail;
+
+	for (i = 0; i < dvr->count; i++) {
+		pos = record_at(dvr, pos);
+		record = (struct gwavi_dvr_record_t *)(dvr->ring + pos);
+		if (record->type == DVR_VIDEO) {
+			if (record->keyframe && frames > 0)
+				break;
+			frames++;
+		}
+		pos += record_size(record->len);
+	}
+
+	return frames;
+}
+
+/*
+ * Store a record in the ring, evicting the oldest groups of pictures to make
+ * room. Return 0 on success (including when the record is dropped because the
+ * ring does not start with a keyframe), -1 on error.
+ */
+static int
+ring_add(struct gwavi_dvr_t *dvr, int type, int keyframe,
+	 const unsigned char *buffer, size_t len, const char *caller)
+{
+	struct gwavi_dvr_record_t *record;
+	unsigned char *dst;
+	size_t need = record_size(len);
+	unsigned int gop;
+
+	if (need > dvr->size) {
+		gwavi_report(NULL, GWAVI_EFULL, caller,
+			     "data larger than the ring", 0);
+		dvr->count = dvr->frames = 0;
+		return -1;
+	}
+
+	for (;;) {
+		/* the ring must start with a keyframe */
+		if (dvr->count == 0 && !(type == DVR_VIDEO && keyframe))
+			return 0;
+		if ((dst = ring_reserve(dvr, need)) != NULL)
+			break;
+		evict_gop(dvr);
+	}
+
+	record = (struct gwavi_dvr_record_t *)dst;
+	record->len = len;
+	record->type = type;
+	record->keyframe = keyframe;
+	(void)memcpy(record + 1, buffer, len);
+	dvr->head = (size_t)(dst - dvr->ring) + need;
+	dvr->count++;
+	if (type != DVR_VIDEO)
+		return 0;
+	dvr->frames++;
+
+	/* drop the groups of pictures older than needed */
+	while (dvr->max_frames && dvr->frames > dvr->max_frames) {
+		gop = first_gop_frames(dvr);
+		if (dvr->frames - gop < dvr->max_frames)
+			break;
+		evict_gop(dvr);
+	}
+
+	return 0;
+}
+
+/**
+ * This function creates a pre-trigger recorder keeping the last seconds of
+ * video and audio in memory.
+ *
+ * @param max_bytes Size of the memory ring the frames and audio data are
+ * kept in, record headers included.
+ * @param seconds Duration kept, or 0 to keep as much as fits in max_bytes.
+ * More is kept since the oldest frame is always a keyframe.
+ * @param fps Number of frames per second of the video.
+ *
+ * @return Structure to pass to the other gwavi_dvr functions, NULL on error.
+ */
+struct gwavi_dvr_t *
+gwavi_dvr_open(size_t max_bytes, unsigned int seconds, unsigned int fps)
+{
+	struct gwavi_allocator_t alloc;
+	struct gwavi_dvr_t *dvr;
+
+	max_bytes &= ~(size_t)7;
+	if (max_bytes < record_size(0) || (seconds && !fps)) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_dvr_open",
+			     "invalid ring size or frame rate", 0);
+		return NULL;
+	}
+
+	gwavi_default_allocator(&alloc);
+	dvr = (struct gwavi_dvr_t *)alloc.malloc(alloc.ctx,
+			sizeof(struct gwavi_dvr_t) + max_bytes);
+	if (!dvr) {
+		gwavi_report(NULL, GWAVI_ENOMEM, "gwavi_dvr_open",
+			     "could not allocate memory for ring", 0);
+		return NULL;
+	}
+	(void)memset(dvr, 0, sizeof(struct gwavi_dvr_t));
+	dvr->alloc = alloc;
+	dvr->ring = (unsigned char *)(dvr + 1);
+	dvr->size = max_bytes;
+	dvr->max_frames = seconds * fps;
+
+	return dvr;
+}
+
+/**
+ * This function adds a video frame to a pre-trigger recorder. Before the
+ * trigger, it is kept in the ring, or dropped if no keyframe has been added
+ * yet. After the trigger, it is added to the file.
+ *
+ * @param dvr Pre-trigger recorder created with gwavi_dvr_open().
+ * @param buffer Video buffer.
+ * @param len Video buffer length.
+ * @param keyframe Non zero if the frame is a keyframe.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_dvr_add_frame(struct gwavi_dvr_t *dvr, unsigned char *buffer,
+		    size_t len, int keyframe)
+{
+	if (!dvr || !buffer) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_dvr_add_frame",
+			     "dvr and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+
+	if (dvr->live)
+		return gwavi_add_frame(dvr->live, buffer, len);
+
+	return ring_add(dvr, DVR_VIDEO, keyframe, buffer, len,
+			"gwavi_dvr_add_frame");
+}
+
+/**
+ * This function adds audio data to a pre-trigger recorder, the same way
+ * gwavi_dvr_add_frame() does for video frames.
+ *
+ * @param dvr Pre-trigger recorder created with gwavi_dvr_open().
+ * @param buffer Audio data buffer.
+ * @param len Audio data buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_dvr_add_audio(struct gwavi_dvr_t *dvr, unsigned char *buffer,
+		    size_t len)
+{
+	if (!dvr || !buffer) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_dvr_add_audio",
+			     "dvr and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+
+	if (dvr->live)
+		return gwavi_add_audio(dvr->live, buffer, len);
+
+	return ring_add(dvr, DVR_AUDIO, 0, buffer, len,
+			"gwavi_dvr_add_audio");
+}
+
+/**
+ * This function writes the content of the ring to an AVI file with
+ * gwavi_add_frame() and gwavi_add_audio(), then makes the following frames
+ * and audio data go to that file too until gwavi_dvr_detach() is called.
+ *
+ * @param dvr Pre-trigger recorder created with gwavi_dvr_open().
+ * @param gwavi Main gwavi structure initialized with gwavi_open(), which
+ * remains owned by the caller.
+ *
+ * @return 0 on success, -1 on error. The ring is emptied and recording goes on
+ * to the file even on error.
+ */
+int
+gwavi_dvr_trigger(struct gwavi_dvr_t *dvr, struct gwavi_t *gwavi)
+{
+	struct gwavi_dvr_record_t *record;
+	int ret = 0;
+
+	if (!dvr || !gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_dvr_trigger",
+			     "dvr and/or gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (dvr->live) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_dvr_trigger",
+			     "already recording to a file", 0);
+		return -1;
+	}
+
+	while (dvr->count > 0) {
+		record = ring_peek(dvr);
+		if (record->type == DVR_VIDEO) {
+			if (gwavi_add_frame(gwavi, (unsigned char *)(record + 1),
+					    record->len) == -1)
+				ret = -1;
+		} else if (gwavi_add_audio(gwavi,
+					   (unsigned char *)(record + 1),
+					   record->len) == -1) {
+			ret = -1;
+		}
+		ring_pop(dvr);
+	}
+	dvr->live = gwavi;
+
+	return ret;
+}
+
+/**
+ * This function stops recording to the file given to gwavi_dvr_trigger(),
+ * which can then be closed, and goes back to keeping frames in the ring.
+ *
+ * @param dvr Pre-trigger recorder created with gwavi_dvr_open().
+ *
+ * @return The gwavi_t structure frames were recorded to, NULL if there was
+ * none.
+ */
+struct gwavi_t *
+gwavi_dvr_detach(struct gwavi_dvr_t *dvr)
+{
+	struct gwavi_t *gwavi;
+
+	if (!dvr) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_dvr_detach",
+			     "dvr argument cannot be NULL", 0);
+		return NULL;
+	}
+
+	gwavi = dvr->live;
+	dvr->live = NULL;
+
+	return gwavi;
+}
+
+/**
+ * This function frees a pre-trigger recorder. The file it may be recording to
+ * is left open.
+ *
+ * @param dvr Pre-trigger recorder created with gwavi_dvr_open().
+ */
+void
+gwavi_dvr_close(struct gwavi_dvr_t *dvr)
+{
+	struct gwavi_allocator_t alloc;
+
+	if (!dvr)
+		return;
+
+	alloc = dvr->alloc;
+	alloc.free(alloc.ctx, dvr);
+}
@@ -34,7 +34,14 @@
  * Usefull IO functions.
  */
 
+#define _GNU_SOURCE /* for copy_file_range(), splice() and pwritev() */
+
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 int
 write_int(FILE *out, unsigned int n)
@@ -87,3 +94,141 @@ write_chars_bin(FILE *out, const char *s, int count)
 	return 0;
 }
 
+
+/*
+ * Copy len bytes at in_off in in_fd to out_off in out_fd without changing the
+ * file offset of either descriptor. The copy is done in the kernel with
+ * copy_file_range() when possible, then splice() through a pipe and finally
+ * falls back to pread()/pwrite() through a bounce buffer. Returns -1 with
+ * errno set on failure, EIO when in_fd ends before len bytes were read.
+ */
+int
+copy_fd_range(int out_fd, off_t out_off, int in_fd, off_t in_off, size_t len)
+{
+	char buffer[16384];
+	size_t done;
+	ssize_t r, w;
+#ifdef __linux__
+	loff_t in_pos = in_off, out_pos = out_off;
+	int fds[2];
+
+	while (len > 0) {
+		r = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+		if (r <= 0)
+			break;
+		len -= (size_t)r;
+	}
+	if (len == 0)
+		return 0;
+	if (r == 0) { /* in_fd is shorter than expected */
+		errno = EIO;
+		return -1;
+	}
+
+	if (pipe(fds) == 0) {
+		while (len > 0) {
+			r = splice(in_fd, &in_pos, fds[1], NULL, len,
+				   SPLICE_F_MOVE);
+			if (r <= 0)
+				break;
+			while (r > 0) {
+				w = splice(fds[0], NULL, out_fd, &out_pos,
+					   (size_t)r, SPLICE_F_MOVE);
+				if (w <= 0) {
+					if (w == 0)
+						errno = EIO;
+					(void)close(fds[0]);
+					(void)close(fds[1]);
+					return -1;
+				}
+				r -= w;
+				len -= (size_t)w;
+			}
+		}
+		(void)close(fds[0]);
+		(void)close(fds[1]);
+		if (len == 0)
+			return 0;
+		if (r == 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	in_off = in_pos;
+	out_off = out_pos;
+#endif /* __linux__ */
+
+	while (len > 0) {
+		r = pread(in_fd, buffer, len < sizeof(buffer) ?
+			  len : sizeof(buffer), in_off);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == 0) /* in_fd is shorter than expected */
+				errno = EIO;
+			return -1;
+		}
+		in_off += r;
+		for (done = 0; done < (size_t)r; done += (size_t)w) {
+			w = pwrite(out_fd, buffer + done, (size_t)r - done,
+				   out_off);
+			if (w <= 0) {
+				if (w == -1 && errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				if (w == 0)
+					errno = EIO;
+				return -1;
+			}
+			out_off += w;
+		}
+		len -= (size_t)r;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the iovcnt buffers described by iov at offset in fd without changing
+ * its file offset, going on after partial writes. iov is modified. Returns -1
+ * with errno set on failure.
+ */
+int
+pwritev_full(int fd, off_t offset, struct iovec *iov, int iovcnt)
+{
+	ssize_t w;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+#ifdef __linux__
+		w = pwritev(fd, iov, iovcnt, offset);
+#else
+		w = pwrite(fd, iov->iov_base, iov->iov_len, offset);
+#endif /* __linux__ */
+		if (w <= 0) {
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w == 0) /* nothing written, errno left stale */
+				errno = EIO;
+			return -1;
+		}
+		offset += w;
+		while (w > 0) {
+			if ((size_t)w < iov->iov_len) {
+				iov->iov_base = (char *)iov->iov_base + w;
+				iov->iov_len -= (size_t)w;
+				break;
+			}
+			w -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+	}
+
+	return 0;
+}
@@ -41,6 +41,9 @@ int write_int(FILE *out, unsigned int n);
 int write_short(FILE *out, unsigned int n);
 int write_chars(FILE *out, const char *s);
 int write_chars_bin(FILE *out, const char *s, int count);
+int copy_fd_range(int out_fd, off_t out_off, int in_fd, off_t in_off,
+		  size_t len);
+int pwritev_full(int fd, off_t offset, struct iovec *iov, int iovcnt);
 
 #endif /* ndef H_FILEIO */
 
@@ -34,480 +34,2874 @@
  * This is the file containing gwavi library functions.
  */
 
+#define _POSIX_C_SOURCE 200809L /* for fileno() and threads */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <sys/uio.h>
 
 #include "gwavi.h"
 #include "gwavi_private.h"
 #include "avi-utils.h"
 #include "fileio.h"
+#include "atomic.h"
 
-/**
- * This is the first function you should call when using gwavi library.
- * It allocates memory for a gwavi_t structure and returns it and takes care of
- * initializing the AVI header with the provided information.
- *
- * When you're done creating your AVI file, you should call gwavi_close()
- * function to free memory allocated for the gwavi_t structure and properly
- * close the output file.
- *
- * @param filename This is the name of the AVI file which will be generated by
- * this library.
- * @param width Width of a frame.
- * @param height Height of a frame.
- * @param fourcc FourCC representing the codec of the video encoded stream. a
- * FourCC is a sequence of four chars used to uniquely identify data formats.
- * For more information, you can visit www.fourcc.org.
- * @param fps Number of frames per second of your video. It needs to be > 0.
- * @param audio This parameter is optionnal. It is used for the audio track. If
- * you do not want to add an audio track to your AVI file, simply pass NULL for
- * this argument.
- *
- * @return Structure containing required information in order to create the AVI
- * file. If an error occured, NULL is returned.
+/*
+ * Grow the offsets table, and the staged index if any, to len entries.
+ * Return 0 on success, -1 on error.
  */
-struct gwavi_t *
-gwavi_open(const char *filename, unsigned int width, unsigned int height,
-	   const char *fourcc, unsigned int fps, struct gwavi_audio_t *audio)
+static int
+grow_index(struct gwavi_t *gwavi, int len, const char *caller)
 {
-	struct gwavi_t *gwavi;
-	FILE *out;
+	struct gwavi_index_entry_t *offsets;
+	unsigned char *index;
+
+	offsets = (struct gwavi_index_entry_t *)gwavi_realloc(gwavi,
+			gwavi->offsets,
+			(size_t)len * sizeof(struct gwavi_index_entry_t));
+	if (offsets == NULL) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, caller,
+			     "could not grow gwavi offsets table", 0);
+		return -1;
+	}
+	gwavi->offsets = offsets;
+
+	if (gwavi->index) {
+		index = (unsigned char *)gwavi_realloc(gwavi, gwavi->index,
+						       (size_t)len * 16);
+		if (index == NULL) {
+			gwavi_report(gwavi, GWAVI_ENOMEM, caller,
+				     "could not grow staged index", 0);
+			return -1;
+		}
+		gwavi->index = index;
+	}
+	gwavi->offsets_len = len;
 
-	if (check_fourcc(fourcc) != 0)
-		(void)fprintf(stderr, "WARNING: given fourcc does not seem to "
-			      "be valid: %s\n", fourcc);
-	if (fps < 1)
-		return NULL;
-	if ((out = fopen(filename, "wb+")) == NULL) {
-		perror("gwavi_open: failed to open file for writing");
-		return NULL;
+	return 0;
+}
+
+/*
+ * Fill the index entry of a chunk of size bytes of the given stream. An empty
+ * video chunk is a dropped frame, repeating the previous one, and is not a
+ * keyframe.
+ */
+static void
+set_entry(struct gwavi_t *gwavi, struct gwavi_index_entry_t *entry,
+	  int stream, size_t size)
+{
+	entry->size = (unsigned int)size;
+	entry->stream = (unsigned char)stream;
+	entry->audio = (unsigned char)gwavi->streams[stream].audio;
+	entry->flags = size > 0 || entry->audio ? GWAVI_IF_KEYFRAME : 0;
+}
+
+/*
+ * Record a new entry in the offsets table for a chunk of size bytes of the
+ * given stream, growing it when needed, and serialize its idx1 entry when the
+ * index is staged. Return 0 on success, -1 on error.
+ */
+static int
+add_offset(struct gwavi_t *gwavi, int stream, size_t size)
+{
+	struct gwavi_index_entry_t *entry;
+
+	/* the index is computed from the number of frames */
+	if (gwavi->fixed_size) {
+		gwavi->movi_offset += (unsigned int)size + 8;
+		gwavi->offsets_ptr++;
+		gwavi->offset_count++;
+		return 0;
 	}
 
-	if ((gwavi = (struct gwavi_t *)malloc(sizeof(struct gwavi_t))) == NULL) {
-		(void)fprintf(stderr, "gwavi_open: could not allocate memoryi "
-			      "for gwavi structure\n");
-		return NULL;
+	if (gwavi->offsets_ptr >= gwavi->offsets_len) {
+		if (gwavi->realtime) {
+			gwavi_report(gwavi, GWAVI_EFULL, "add_offset",
+				     "gwavi offsets table is full", 0);
+			return -1;
+		}
+		if (grow_index(gwavi, gwavi->offsets_len + 1024, "add_offset")
+				== -1)
+			return -1;
 	}
-	memset(gwavi, 0, sizeof(struct gwavi_t));
+	entry = &gwavi->offsets[gwavi->offsets_ptr];
+	set_entry(gwavi, entry, stream, size);
+	if (gwavi->index)
+		put_index_entry(gwavi->index + gwavi->offsets_ptr * 16, entry,
+				gwavi->movi_offset);
+	gwavi->movi_offset += entry->size + 8;
+	gwavi->offsets_ptr++;
+	gwavi->offset_count++;
 
-	gwavi->out = out;
+	return 0;
+}
 
-	/* set avi header */
-	gwavi->avi_header.time_delay= 1000000 / fps;
-	gwavi->avi_header.data_rate = width * height * 3;
-	gwavi->avi_header.flags = 0x10;
+/*
+ * Return the length of len bytes once padded to a 4 bytes boundary.
+ */
+static size_t
+pad_length(size_t len)
+{
+	size_t maxi_pad;  /* if your frame is raggin, give it some paddin' */
 
-	if (audio)
-		gwavi->avi_header.data_streams = 2;
-	else
-		gwavi->avi_header.data_streams = 1;
+	maxi_pad = len % 4;
+	if (maxi_pad > 0)
+		maxi_pad = 4 - maxi_pad;
 
-	/* this field gets updated when calling gwavi_close() */
-	gwavi->avi_header.number_of_frames = 0;
-	gwavi->avi_header.width = width;
-	gwavi->avi_header.height = height;
-	gwavi->avi_header.buffer_size = (width * height * 3);
+	return len + maxi_pad;
+}
 
-	/* set stream header */
-	(void)strcpy(gwavi->stream_header_v.data_type, "vids");
-	(void)memcpy(gwavi->stream_header_v.codec, fourcc, 4);
-	gwavi->stream_header_v.time_scale = 1;
-	gwavi->stream_header_v.data_rate = fps;
-	gwavi->stream_header_v.buffer_size = (width * height * 3);
-	gwavi->stream_header_v.data_length = 0;
+/*
+ * Check that a chunk of len bytes of the given stream can be added in fixed
+ * frame size mode. Return 0 if it can, -1 otherwise.
+ */
+static int
+check_fixed(struct gwavi_t *gwavi, int stream, size_t len, const char *caller)
+{
+	if (!gwavi->fixed_size)
+		return 0;
+	if (stream != GWAVI_STREAM_VIDEO) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller,
+			     "only video frames in fixed frame size mode", 0);
+		return -1;
+	}
+	if (len != gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_EINVAL, caller,
+			     "frame length differs from the fixed frame size",
+			     0);
+		return -1;
+	}
 
-	/* set stream format */
-	gwavi->stream_format_v.header_size = 40;
-	gwavi->stream_format_v.width = width;
-	gwavi->stream_format_v.height = height;
-	gwavi->stream_format_v.num_planes = 1;
-	gwavi->stream_format_v.bits_per_pixel = 24;
-	gwavi->stream_format_v.compression_type =
-		((unsigned int)fourcc[3] << 24) +
-		((unsigned int)fourcc[2] << 16) +
-		((unsigned int)fourcc[1] << 8) +
-		((unsigned int)fourcc[0]);
-	gwavi->stream_format_v.image_size = width * height * 3;
-	gwavi->stream_format_v.colors_used = 0;
-	gwavi->stream_format_v.colors_important = 0;
+	return 0;
+}
+
+/*
+ * Return the total length of the iovcnt buffers described by iov.
+ */
+static size_t
+iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
 
-	gwavi->stream_format_v.palette = 0;
-	gwavi->stream_format_v.palette_count = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
-	if (audio) {
-		/* set stream header */
-		memcpy(gwavi->stream_header_a.data_type, "auds", 4);
-		gwavi->stream_header_a.codec[0] = 1;
-		gwavi->stream_header_a.codec[1] = 0;
-		gwavi->stream_header_a.codec[2] = 0;
-		gwavi->stream_header_a.codec[3] = 0;
-		gwavi->stream_header_a.time_scale = 1;
-		gwavi->stream_header_a.data_rate = audio->samples_per_second;
-		gwavi->stream_header_a.buffer_size =
-			audio->channels * (audio->bits / 8) * audio->samples_per_second;
-		/* when set to -1, drivers use default quality value */
-		gwavi->stream_header_a.audio_quality = -1;
-		gwavi->stream_header_a.sample_size =
-			(audio->bits / 8) * audio->channels;
-
-		/* set stream format */
-		gwavi->stream_format_a.format_type = 1;
-		gwavi->stream_format_a.channels = audio->channels;
-		gwavi->stream_format_a.sample_rate = audio->samples_per_second;
-		gwavi->stream_format_a.bytes_per_second =
-			audio->channels * (audio->bits / 8) * audio->samples_per_second;
-		gwavi->stream_format_a.block_align =
-			audio->channels * (audio->bits / 8);
-		gwavi->stream_format_a.bits_per_sample = audio->bits;
-		gwavi->stream_format_a.size = 0;
+	return len;
+}
+
+/*
+ * Check that the output file is not written by several threads, in threaded or
+ * parallel mode. Return 0 if so, -1 otherwise.
+ */
+static int
+check_sequential(struct gwavi_t *gwavi, const char *caller)
+{
+	if (gwavi->threaded || gwavi->parallel) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller,
+			     "not available in threaded or parallel mode", 0);
+		return -1;
 	}
 
-	if (write_chars_bin(out, "RIFF", 4) == -1)
-		goto write_chars_bin_failed;
-	if (write_int(out, 0) == -1) {
-		(void)fprintf(stderr, "gwavi_info: write_int() failed\n");
-		return NULL;
+	return 0;
+}
+
+/*
+ * Check that a new chunk can be written to the output file: the file must be
+ * open, no frame must be being streamed and the file must not be written by
+ * several threads. Return 0 if so, the file being held against parking until
+ * gwavi_fd_release(), -1 otherwise.
+ */
+static int
+check_writable(struct gwavi_t *gwavi, const char *caller)
+{
+	if (check_sequential(gwavi, caller) == -1)
+		return -1;
+	if (gwavi_fd_resume(gwavi, caller) == -1)
+		return -1;
+	if (!gwavi->out) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller,
+			     "no output file, gwavi_reopen() failed", 0);
+		gwavi_fd_release(gwavi);
+		return -1;
+	}
+	if (gwavi->in_chunk) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller, "a frame is being "
+			     "streamed, call gwavi_frame_end() first", 0);
+		gwavi_fd_release(gwavi);
+		return -1;
 	}
-	if (write_chars_bin(out, "AVI ", 4) == -1)
-		goto write_chars_bin_failed;
 
-	if (write_avi_header_chunk(gwavi) == -1) {
-		(void)fprintf(stderr, "gwavi_info: write_avi_header_chunk "
-			      "failed\n");
-		return NULL;
+	return 0;
+}
+
+/*
+ * Serialize the 8 bytes header of a chunk (id and size) into dst.
+ */
+static void
+put_chunk_header(unsigned char *dst, const char *id, size_t size)
+{
+	(void)memcpy(dst, id, 4);
+	dst[4] = (unsigned char)size;
+	dst[5] = (unsigned char)(size >> 8);
+	dst[6] = (unsigned char)(size >> 16);
+	dst[7] = (unsigned char)(size >> 24);
+}
+
+/*
+ * Write a chunk of the given stream whose payload is made of the iovcnt
+ * buffers described by iov, len being their total length, and record it in
+ * the offsets table. Return 0 on success, -1 on error.
+ */
+static int
+write_chunk(struct gwavi_t *gwavi, int stream, const struct iovec *iov,
+	    int iovcnt, size_t len)
+{
+	static const unsigned char zeros[4] = { 0, 0, 0, 0 };
+	unsigned char header[8];
+	size_t size = pad_length(len);
+	int i;
+
+	if (add_offset(gwavi, stream, size) == -1)
+		return -1;
+
+	put_chunk_header(header, gwavi->streams[stream].chunk_id, size);
+	if (fwrite(header, 1, 8, gwavi->out) != 8)
+		goto fwrite_failed;
+
+	for (i = 0; i < iovcnt; i++)
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, gwavi->out)
+				!= iov[i].iov_len)
+			goto fwrite_failed;
+
+	if (fwrite(zeros, 1, size - len, gwavi->out) != size - len)
+		goto fwrite_failed;
+
+	if (gwavi->live_interval)
+		return gwavi_live_tick(gwavi);
+
+	return 0;
+
+fwrite_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "write_chunk", "fwrite() failed", 0);
+	return -1;
+}
+
+/*
+ * Write a chunk of the given stream and account for it in the stream header.
+ * Return 0 on success, -1 on error.
+ */
+static int
+add_chunk(struct gwavi_t *gwavi, int stream, const struct iovec *iov,
+	  int iovcnt, size_t len)
+{
+	struct gwavi_stream_header_t *header = &gwavi->streams[stream].header;
+
+	if (!gwavi->streams[stream].audio) {
+		header->data_length++;
+		return write_chunk(gwavi, stream, iov, iovcnt, len);
 	}
 
-	if (write_chars_bin(out, "LIST", 4) == -1)
-		goto write_chars_bin_failed;
-	if ((gwavi->marker = ftell(out)) == -1) {
-		perror("gwavi_info (ftell)");
-		return NULL;
+	if (write_chunk(gwavi, stream, iov, iovcnt, len) == -1)
+		return -1;
+	header->data_length += (unsigned int)pad_length(len);
+
+	return 0;
+}
+
+/*
+ * Check that the file is writable and write a chunk of the given stream in
+ * sequential mode. Return 0 on success, -1 on error.
+ */
+static int
+add_checked_chunk(struct gwavi_t *gwavi, int stream, const struct iovec *iov,
+		  int iovcnt, size_t len, const char *caller)
+{
+	int ret;
+
+	if (check_writable(gwavi, caller) == -1)
+		return -1;
+	ret = add_chunk(gwavi, stream, iov, iovcnt, len);
+	gwavi_fd_release(gwavi);
+
+	return ret;
+}
+
+/*
+ * Copy a chunk and queue it for the writer thread. Can be called from any
+ * thread. Return 0 on success, -1 on error.
+ */
+static int
+submit_chunk(struct gwavi_t *gwavi, int stream, const struct iovec *iov,
+	     int iovcnt, size_t len, const char *caller)
+{
+	struct gwavi_job_t *job;
+	unsigned char *dst;
+	int i;
+
+	if (gwavi->writer_failed) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "writer thread failed to write a chunk", 0);
+		return -1;
 	}
-	if (write_int(out, 0) == -1) {
-		(void)fprintf(stderr, "gwavi_info: write_int() failed\n");
-		return NULL;
+	if (gwavi_fetch_add(&gwavi->jobs_queued, 1) >= gwavi->jobs_max) {
+		(void)gwavi_fetch_sub(&gwavi->jobs_queued, 1);
+		gwavi_report(gwavi, GWAVI_EFULL, caller,
+			     "too many chunks waiting to be written", 0);
+		return -1;
 	}
-	if (write_chars_bin(out, "movi", 4) == -1)
-		goto write_chars_bin_failed;
 
-	gwavi->offsets_len = 1024;
-	if ((gwavi->offsets = (unsigned int *)malloc((size_t)gwavi->offsets_len *
-				      sizeof(unsigned int)))
-			== NULL) {
-		(void)fprintf(stderr, "gwavi_info: could not allocate memory "
-			      "for gwavi offsets table\n");
-		return NULL;
+	job = (struct gwavi_job_t *)gwavi_malloc(gwavi,
+			sizeof(struct gwavi_job_t) + len);
+	if (!job) {
+		(void)gwavi_fetch_sub(&gwavi->jobs_queued, 1);
+		gwavi_report(gwavi, GWAVI_ENOMEM, caller,
+			     "could not allocate memory for chunk copy", 0);
+		return -1;
+	}
+	dst = (unsigned char *)(job + 1);
+	for (i = 0; i < iovcnt; i++) {
+		(void)memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	job->stream = stream;
+	job->len = len;
+	job->seq = gwavi_fetch_add(&gwavi->seq_next[stream], 1);
+
+	gwavi_queue_push(&gwavi->jobs, &job->node);
+	if (gwavi->pool)
+		gwavi_pool_schedule(gwavi);
+	else
+		(void)sem_post(&gwavi->jobs_sem);
+
+	return 0;
+}
+
+/*
+ * Reserve the byte range and index entry of a chunk of the given stream with
+ * a compare and swap of the cursor and write it there. The cursor never moves
+ * past the limits, so a failed reservation cannot carry into the chunk count.
+ * Can be called from any thread. Return 0 on success, -1 on error.
+ */
+static int
+write_parallel_chunk(struct gwavi_t *gwavi, int stream, const struct iovec *iov,
+		     int iovcnt, size_t len, const char *caller)
+{
+	static unsigned char zeros[4] = { 0, 0, 0, 0 };
+	struct iovec parts[GWAVI_PARALLEL_IOV_MAX + 2];
+	unsigned char header[8];
+	size_t size = pad_length(len);
+	unsigned long long old, seen;
+	unsigned long pos;
+	unsigned int slot;
+	int i;
+
+	if (iovcnt > GWAVI_PARALLEL_IOV_MAX) {
+		gwavi_report(gwavi, GWAVI_EINVAL, caller,
+			     "too many buffers for parallel mode", 0);
+		return -1;
+	}
+	if (gwavi->parallel_full || size > gwavi->parallel_limit)
+		goto full;
+
+	old = gwavi->parallel_cursor;
+	for (;;) {
+		slot = (unsigned int)(old >> 32) +
+			(unsigned int)gwavi->parallel_first;
+		pos = (unsigned long)(old & 0xffffffffUL);
+		if (slot >= (unsigned int)gwavi->offsets_len ||
+		    8 + size > gwavi->parallel_limit - pos) {
+			gwavi->parallel_full = 1;
+			goto full;
+		}
+		seen = gwavi_compare_swap(&gwavi->parallel_cursor, old,
+					  old + (((unsigned long long)1 << 32) |
+						 (8 + size)));
+		if (seen == old)
+			break;
+		old = seen;
+	}
+
+	set_entry(gwavi, &gwavi->offsets[slot], stream, size);
+	put_chunk_header(header, gwavi->streams[stream].chunk_id, size);
+	(void)gwavi_fetch_add(&gwavi->streams[stream].header.data_length,
+			      gwavi->streams[stream].audio ?
+			      (unsigned int)size : 1);
+	if (gwavi->index)
+		put_index_entry(gwavi->index + slot * 16, &gwavi->offsets[slot],
+				gwavi->movi_offset + (unsigned int)pos);
+
+	parts[0].iov_base = header;
+	parts[0].iov_len = 8;
+	for (i = 0; i < iovcnt; i++)
+		parts[i + 1] = iov[i];
+	parts[iovcnt + 1].iov_base = zeros;
+	parts[iovcnt + 1].iov_len = size - len;
+	if (pwritev_full(gwavi->parallel_fd, (off_t)gwavi->parallel_base +
+			 (off_t)pos, parts, iovcnt + 2) == -1) {
+		gwavi->parallel_failed = 1;
+		gwavi_report(gwavi, GWAVI_EIO, caller, "pwritev() failed",
+			     errno);
+		return -1;
+	}
+
+	return 0;
+
+full:
+	gwavi_report(gwavi, GWAVI_EFULL, caller,
+		     "reserved chunks or maximum file size reached", 0);
+	return -1;
+}
+
+/*
+ * Write and free a job popped by the writer thread. Once a chunk could not be
+ * written, the following ones are dropped.
+ */
+static void
+write_job(struct gwavi_t *gwavi, struct gwavi_job_t *job)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)(job + 1);
+	iov.iov_len = job->len;
+	if (!gwavi->writer_failed &&
+	    add_chunk(gwavi, job->stream, &iov, 1, job->len) == -1)
+		gwavi->writer_failed = 1;
+
+	gwavi->seq_write[job->stream] = job->seq + 1;
+	gwavi_free(gwavi, job);
+	(void)gwavi_fetch_sub(&gwavi->jobs_queued, 1);
+}
+
+/*
+ * Pop the next job of the queue, waiting for a producer halfway through
+ * pushing it.
+ */
+static struct gwavi_job_t *
+pop_job(struct gwavi_t *gwavi)
+{
+	struct gwavi_queue_node_t *node;
+
+	while ((node = gwavi_queue_pop(&gwavi->jobs)) == NULL)
+		(void)sched_yield();
+
+	return (struct gwavi_job_t *)node;
+}
+
+/*
+ * Write a popped job if its turn came, followed by the held jobs of its
+ * stream whose turn comes next. Producers of a same stream may push their
+ * jobs in another order than they got their sequence numbers: the jobs that
+ * are early are held until the missing ones arrive.
+ */
+static void
+take_job(struct gwavi_t *gwavi, struct gwavi_job_t *job)
+{
+	struct gwavi_job_t **pos;
+	int stream = job->stream;
+
+	pos = &gwavi->held[stream];
+	while (*pos && (int)((*pos)->seq - job->seq) < 0)
+		pos = &(*pos)->held;
+	job->held = *pos;
+	*pos = job;
+
+	while ((job = gwavi->held[stream]) != NULL &&
+	       job->seq == gwavi->seq_write[stream]) {
+		gwavi->held[stream] = job->held;
+		write_job(gwavi, job);
+	}
+}
+
+/*
+ * Write the jobs still held once all producers are done: nothing should be
+ * left, but be safe.
+ */
+static void
+flush_held(struct gwavi_t *gwavi)
+{
+	struct gwavi_job_t *job;
+	int stream;
+
+	for (stream = 0; stream < 2; stream++)
+		while ((job = gwavi->held[stream]) != NULL) {
+			gwavi->held[stream] = job->held;
+			write_job(gwavi, job);
+		}
+}
+
+/*
+ * Writer thread of threaded mode: write the queued chunks, in submission order
+ * within each stream, until the stop job is popped.
+ */
+static void *
+writer_main(void *arg)
+{
+	struct gwavi_t *gwavi = (struct gwavi_t *)arg;
+	struct gwavi_job_t *job;
+
+	for (;;) {
+		while (sem_wait(&gwavi->jobs_sem) == -1 && errno == EINTR)
+			;
+		job = pop_job(gwavi);
+		if (job->stream < 0)
+			break;
+		take_job(gwavi, job);
+	}
+	flush_held(gwavi);
+
+	return NULL;
+}
+
+/*
+ * Write count jobs of a handle attached to a pool, count being no more than
+ * the jobs it was scheduled for. Called by the pool workers, never by two at
+ * the same time for a same handle.
+ */
+void
+gwavi_run_jobs(struct gwavi_t *gwavi, unsigned int count)
+{
+	while (count-- > 0)
+		take_job(gwavi, pop_job(gwavi));
+}
+
+/*
+ * Write the frames held in the reorder window whose sequence numbers are
+ * below until, skipping the missing ones, and move the window past them.
+ * Return 0 on success, -1 if a frame could not be written.
+ */
+static int
+reorder_advance(struct gwavi_t *gwavi, unsigned int until)
+{
+	struct gwavi_reorder_slot_t *slot;
+	struct iovec iov;
+	int ret = 0;
+
+	while ((int)(until - gwavi->reorder_next) > 0) {
+		if (gwavi->reorder_held == 0) {
+			gwavi->reorder_next = until;
+			break;
+		}
+		slot = &gwavi->reorder[gwavi->reorder_next %
+				       gwavi->reorder_window];
+		if (slot->frame) {
+			iov.iov_base = slot->frame;
+			iov.iov_len = slot->len;
+			if (add_chunk(gwavi, GWAVI_STREAM_VIDEO, &iov, 1,
+				      slot->len) == -1)
+				ret = -1;
+			gwavi_free(gwavi, slot->frame);
+			slot->frame = NULL;
+			gwavi->reorder_held--;
+		}
+		gwavi->reorder_next++;
+	}
+
+	return ret;
+}
+
+/*
+ * Write the frames held in the reorder window that directly follow the last
+ * written one. Return 0 on success, -1 if a frame could not be written.
+ */
+static int
+reorder_drain(struct gwavi_t *gwavi)
+{
+	struct gwavi_reorder_slot_t *slot;
+	struct iovec iov;
+	int ret = 0;
+
+	while (gwavi->reorder_held > 0) {
+		slot = &gwavi->reorder[gwavi->reorder_next %
+				       gwavi->reorder_window];
+		if (!slot->frame)
+			break;
+		iov.iov_base = slot->frame;
+		iov.iov_len = slot->len;
+		if (add_chunk(gwavi, GWAVI_STREAM_VIDEO, &iov, 1, slot->len)
+				== -1)
+			ret = -1;
+		gwavi_free(gwavi, slot->frame);
+		slot->frame = NULL;
+		gwavi->reorder_held--;
+		gwavi->reorder_next++;
+	}
+
+	return ret;
+}
+
+/*
+ * Write all the frames held in the reorder window, skipping the missing ones,
+ * so that the window ends right after the last held frame. Return 0 on
+ * success, -1 if a frame could not be written.
+ */
+static int
+reorder_flush(struct gwavi_t *gwavi)
+{
+	struct gwavi_reorder_slot_t *slot;
+	struct iovec iov;
+	int ret = 0;
+
+	while (gwavi->reorder_held > 0) {
+		slot = &gwavi->reorder[gwavi->reorder_next %
+				       gwavi->reorder_window];
+		if (slot->frame) {
+			iov.iov_base = slot->frame;
+			iov.iov_len = slot->len;
+			if (add_chunk(gwavi, GWAVI_STREAM_VIDEO, &iov, 1,
+				      slot->len) == -1)
+				ret = -1;
+			gwavi_free(gwavi, slot->frame);
+			slot->frame = NULL;
+			gwavi->reorder_held--;
+		}
+		gwavi->reorder_next++;
+	}
+
+	return ret;
+}
+
+/*
+ * Write the hdrl list and the start of the movi list at the current position
+ * of the output file, which must be right after the RIFF header.
+ * Return 0 on success, -1 on error.
+ */
+static int
+write_headers(struct gwavi_t *gwavi, const char *caller)
+{
+	if (write_avi_header_chunk(gwavi) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "write_avi_header_chunk() failed", 0);
+		return -1;
+	}
+
+	if (write_chars_bin(gwavi->out, "LIST", 4) == -1)
+		goto write_failed;
+	if ((gwavi->marker = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller, "ftell() failed",
+			     errno);
+		return -1;
+	}
+	if (write_int(gwavi->out, 0) == -1 ||
+	    write_chars_bin(gwavi->out, "movi", 4) == -1)
+		goto write_failed;
+	gwavi->movi_offset = 4;
+
+	return 0;
+
+write_failed:
+	gwavi_report(gwavi, GWAVI_EIO, caller, "could not write movi list", 0);
+	return -1;
+}
+
+/*
+ * Create filename and write the AVI headers and the start of the movi list to
+ * it. Return 0 on success, -1 on error.
+ */
+static int
+start_file(struct gwavi_t *gwavi, const char *filename, const char *caller)
+{
+	size_t len = strlen(filename) + 1;
+	char *name;
+	FILE *out;
+
+	/* remembered to reopen the file once parked */
+	name = (char *)gwavi_realloc(gwavi, gwavi->filename, len);
+	if (!name) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, caller,
+			     "could not allocate memory for file name", 0);
+		return -1;
+	}
+	(void)memcpy(name, filename, len);
+	gwavi->filename = name;
+
+	if ((out = fopen(filename, "wb+")) == NULL) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "failed to open file for writing", errno);
+		return -1;
+	}
+	gwavi->out = out;
+
+	if (write_chars_bin(out, "RIFF", 4) == -1)
+		goto write_chars_bin_failed;
+	if (write_int(out, 0) == -1)
+		goto write_int_failed;
+	if (write_chars_bin(out, "AVI ", 4) == -1)
+		goto write_chars_bin_failed;
+
+	if (write_headers(gwavi, caller) == -1)
+		goto close;
+	gwavi_fd_opened(gwavi);
+
+	return 0;
+
+write_int_failed:
+	gwavi_report(gwavi, GWAVI_EIO, caller, "write_int() failed", 0);
+	goto close;
+
+write_chars_bin_failed:
+	gwavi_report(gwavi, GWAVI_EIO, caller, "write_chars_bin() failed", 0);
+close:
+	(void)fclose(out);
+	gwavi->out = NULL;
+	return -1;
+}
+
+/*
+ * Complete the movi list ending at the current position of out, append the
+ * index and update the AVI headers. Return 0 on success, -1 on error.
+ */
+static int
+complete_file(struct gwavi_t *gwavi, const char *caller)
+{
+	long t;
+
+	if ((t = ftell(gwavi->out)) == -1)
+		goto ftell_failed;
+	if (fseek(gwavi->out, gwavi->marker, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_int(gwavi->out, (unsigned int)(t - gwavi->marker - 4)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "write_int() failed", 0);
+		return -1;
+	}
+	if (fseek(gwavi->out,t,SEEK_SET) == -1)
+		goto fseek_failed;
+
+	if (gwavi->fixed_size) {
+		if (write_fixed_index(gwavi->out, gwavi->offset_count,
+				      (unsigned int)pad_length(
+					      gwavi->fixed_size)) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, caller,
+				     "write_fixed_index() failed", 0);
+			return -1;
+		}
+	} else if (gwavi->index) {
+		if (write_chars_bin(gwavi->out, "idx1", 4) == -1 ||
+		    write_int(gwavi->out,
+			      (unsigned int)gwavi->offset_count * 16) == -1 ||
+		    fwrite(gwavi->index, 16, (size_t)gwavi->offset_count,
+			   gwavi->out) != (size_t)gwavi->offset_count) {
+			gwavi_report(gwavi, GWAVI_EIO, caller,
+				     "could not write staged index", 0);
+			return -1;
+		}
+	} else if (write_index(gwavi->out, gwavi->offset_count,
+			       gwavi->offsets) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "write_index() failed", 0);
+		return -1;
+	}
+
+	/* reset some avi header fields */
+	gwavi->avi_header.number_of_frames = gwavi->streams[0].header.data_length;
+
+	if ((t = ftell(gwavi->out)) == -1)
+		goto ftell_failed;
+	if (fseek(gwavi->out, 12, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_avi_header_chunk(gwavi) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "write_avi_header_chunk() failed", 0);
+		return -1;
+	}
+	if (fseek(gwavi->out, t, SEEK_SET) == -1)
+		goto fseek_failed;
+
+	if ((t = ftell(gwavi->out)) == -1)
+		goto ftell_failed;
+	if (fseek(gwavi->out, 4, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_int(gwavi->out, (unsigned int)(t - 8)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller,
+			     "write_int() failed", 0);
+		return -1;
+	}
+	if (fseek(gwavi->out, t, SEEK_SET) == -1)
+		goto fseek_failed;
+
+	return 0;
+
+ftell_failed:
+	gwavi_report(gwavi, GWAVI_EIO, caller, "ftell() failed", errno);
+	return -1;
+
+fseek_failed:
+	gwavi_report(gwavi, GWAVI_EIO, caller, "fseek() failed", errno);
+	return -1;
+}
+
+/*
+ * Complete the movi list, append the index, update the AVI headers and close
+ * the output file. Return 0 on success, -1 on error.
+ */
+static int
+finish_file(struct gwavi_t *gwavi)
+{
+	int ret = -1;
+
+	if (gwavi_fd_resume(gwavi, "gwavi_close") == -1)
+		return -1;
+
+	/* complete a frame that was left being streamed */
+	if (gwavi->in_chunk) {
+		gwavi->chunk_expected = 0;
+		if (gwavi_frame_end(gwavi) == -1)
+			goto done;
+	}
+
+	/*
+	 * write the frames left in the reorder window, skipping the gaps, the
+	 * next file going on with the frame following the last one
+	 */
+	if (reorder_flush(gwavi) == -1)
+		goto done;
+
+	if (complete_file(gwavi, "gwavi_close") == -1)
+		goto done;
+
+	gwavi_fd_forget(gwavi);
+	if (fclose(gwavi->out) == EOF)
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_close", "fclose() failed",
+			     errno);
+	else
+		ret = 0;
+	gwavi->out = NULL;
+	/* freed with out, its sinks drained */
+	gwavi->tee = NULL;
+
+done:
+	gwavi_fd_release(gwavi);
+	return ret;
+}
+
+/*
+ * Set the "##dc" or "##wb" chunk id of the given stream.
+ */
+static void
+set_chunk_id(struct gwavi_t *gwavi, int stream)
+{
+	(void)sprintf(gwavi->streams[stream].chunk_id, "%02d%s", stream,
+		      gwavi->streams[stream].audio ? "wb" : "dc");
+}
+
+/*
+ * Set the header and format of the given stream for a video track.
+ */
+static void
+init_video_stream(struct gwavi_t *gwavi, int stream, unsigned int width,
+		  unsigned int height, const char *fourcc, unsigned int fps)
+{
+	struct gwavi_stream_t *s = &gwavi->streams[stream];
+
+	(void)memset(s, 0, sizeof(struct gwavi_stream_t));
+
+	/* set stream header */
+	(void)strcpy(s->header.data_type, "vids");
+	(void)memcpy(s->header.codec, fourcc, 4);
+	s->header.time_scale = 1;
+	s->header.data_rate = fps;
+	s->header.buffer_size = (width * height * 3);
+	s->header.data_length = 0;
+
+	/* set stream format */
+	s->format_v.header_size = 40;
+	s->format_v.width = width;
+	s->format_v.height = height;
+	s->format_v.num_planes = 1;
+	s->format_v.bits_per_pixel = 24;
+	s->format_v.compression_type =
+		((unsigned int)fourcc[3] << 24) +
+		((unsigned int)fourcc[2] << 16) +
+		((unsigned int)fourcc[1] << 8) +
+		((unsigned int)fourcc[0]);
+	s->format_v.image_size = width * height * 3;
+	s->format_v.colors_used = 0;
+	s->format_v.colors_important = 0;
+
+	s->format_v.palette = 0;
+	s->format_v.palette_count = 0;
+
+	set_chunk_id(gwavi, stream);
+}
+
+/*
+ * Set the header and format of the given stream for an audio track.
+ */
+static void
+init_audio_stream(struct gwavi_t *gwavi, int stream,
+		  const struct gwavi_audio_t *audio)
+{
+	struct gwavi_stream_t *s = &gwavi->streams[stream];
+
+	(void)memset(s, 0, sizeof(struct gwavi_stream_t));
+	s->audio = 1;
+
+	/* set stream header */
+	memcpy(s->header.data_type, "auds", 4);
+	s->header.codec[0] = 1;
+	s->header.codec[1] = 0;
+	s->header.codec[2] = 0;
+	s->header.codec[3] = 0;
+	s->header.time_scale = 1;
+	s->header.data_rate = audio->samples_per_second;
+	s->header.buffer_size =
+		audio->channels * (audio->bits / 8) * audio->samples_per_second;
+	/* when set to -1, drivers use default quality value */
+	s->header.audio_quality = -1;
+	s->header.sample_size = (audio->bits / 8) * audio->channels;
+
+	/* set stream format */
+	s->format_a.format_type = 1;
+	s->format_a.channels = audio->channels;
+	s->format_a.sample_rate = audio->samples_per_second;
+	s->format_a.bytes_per_second =
+		audio->channels * (audio->bits / 8) * audio->samples_per_second;
+	s->format_a.block_align = audio->channels * (audio->bits / 8);
+	s->format_a.bits_per_sample = audio->bits;
+	s->format_a.size = 0;
+
+	set_chunk_id(gwavi, stream);
+}
+
+/**
+ * This is the first function you should call when using gwavi library.
+ * It allocates memory for a gwavi_t structure and returns it and takes care of
+ * initializing the AVI header with the provided information.
+ *
+ * When you're done creating your AVI file, you should call gwavi_close()
+ * function to free memory allocated for the gwavi_t structure and properly
+ * close the output file.
+ *
+ * @param filename This is the name of the AVI file which will be generated by
+ * this library.
+ * @param width Width of a frame.
+ * @param height Height of a frame.
+ * @param fourcc FourCC representing the codec of the video encoded stream. a
+ * FourCC is a sequence of four chars used to uniquely identify data formats.
+ * For more information, you can visit www.fourcc.org.
+ * @param fps Number of frames per second of your video. It needs to be > 0.
+ * @param audio This parameter is optionnal. It is used for the audio track. If
+ * you do not want to add an audio track to your AVI file, simply pass NULL for
+ * this argument.
+ *
+ * @return Structure containing required information in order to create the AVI
+ * file. If an error occured, NULL is returned.
+ */
+struct gwavi_t *
+gwavi_open(const char *filename, unsigned int width, unsigned int height,
+	   const char *fourcc, unsigned int fps, struct gwavi_audio_t *audio)
+{
+	struct gwavi_t *gwavi;
+
+	if (check_fourcc(fourcc) != 0)
+		gwavi_warn_detail(NULL, GWAVI_EINVAL, "gwavi_open",
+				  "given fourcc does not seem to be valid",
+				  fourcc);
+	if (fps < 1) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_open",
+			     "fps must be > 0", 0);
+		return NULL;
+	}
+
+	if ((gwavi = gwavi_alloc_handle()) == NULL) {
+		gwavi_report(NULL, GWAVI_ENOMEM, "gwavi_open",
+			     "could not allocate memory for gwavi structure", 0);
+		return NULL;
+	}
+	gwavi_log_init(gwavi);
+
+	/* set avi header */
+	gwavi->avi_header.time_delay= 1000000 / fps;
+	gwavi->avi_header.data_rate = width * height * 3;
+	gwavi->avi_header.flags = 0x10;
+
+	if (audio)
+		gwavi->avi_header.data_streams = 2;
+	else
+		gwavi->avi_header.data_streams = 1;
+
+	/* this field gets updated when calling gwavi_close() */
+	gwavi->avi_header.number_of_frames = 0;
+	gwavi->avi_header.width = width;
+	gwavi->avi_header.height = height;
+	gwavi->avi_header.buffer_size = (width * height * 3);
+
+	init_video_stream(gwavi, 0, width, height, fourcc, fps);
+	if (audio) {
+		init_audio_stream(gwavi, 1, audio);
+	} else {
+		/* gwavi_add_audio() writes to stream 1 even if undeclared */
+		gwavi->streams[1].audio = 1;
+		set_chunk_id(gwavi, 1);
+	}
+
+	gwavi->offsets_len = 1024;
+	if ((gwavi->offsets = (struct gwavi_index_entry_t *)gwavi_malloc(gwavi,
+				(size_t)gwavi->offsets_len *
+				sizeof(struct gwavi_index_entry_t))) == NULL) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_open", "could not "
+			     "allocate memory for gwavi offsets table", 0);
+		gwavi_free_handle(gwavi);
+		return NULL;
+	}
+
+	if (start_file(gwavi, filename, "gwavi_open") == -1) {
+		gwavi_free(gwavi, gwavi->filename);
+		gwavi_free(gwavi, gwavi->offsets);
+		gwavi_free_handle(gwavi);
+		return NULL;
+	}
+
+	return gwavi;
+}
+
+/*
+ * Add a video chunk in the current mode. Return 0 on success, -1 on error.
+ */
+static int
+add_video_chunk(struct gwavi_t *gwavi, const struct iovec *iov, int iovcnt,
+		size_t len, const char *caller)
+{
+	if (gwavi->threaded)
+		return submit_chunk(gwavi, GWAVI_STREAM_VIDEO, iov, iovcnt, len,
+				    caller);
+	if (gwavi->parallel)
+		return write_parallel_chunk(gwavi, GWAVI_STREAM_VIDEO, iov,
+					    iovcnt, len, caller);
+	return add_checked_chunk(gwavi, GWAVI_STREAM_VIDEO, iov, iovcnt, len,
+				 caller);
+}
+
+/**
+ * This function allows you to add an encoded video frame to the AVI file.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param buffer Video buffer size.
+ * @param len Video buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_frame(struct gwavi_t *gwavi, unsigned char *buffer, size_t len)
+{
+	struct iovec iov;
+
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+
+	return gwavi_add_framev(gwavi, &iov, 1);
+}
+
+/**
+ * This function allows you to add an encoded video frame made of several
+ * buffers to the AVI file. The buffers are written one after the other in a
+ * single chunk so there is no need to gather them in a contiguous buffer
+ * first.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param iov Array of buffers making up the video frame.
+ * @param iovcnt Number of elements in iov.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_framev(struct gwavi_t *gwavi, const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+
+	if (!gwavi || !iov || iovcnt < 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_framev",
+			     "gwavi and/or iov argument cannot be NULL", 0);
+		return -1;
+	}
+
+	len = iov_length(iov, iovcnt);
+	if (len < 256)
+		gwavi_warn(gwavi, GWAVI_EINVAL, "gwavi_add_framev",
+			   "specified buffer len seems rather small");
+	if (check_fixed(gwavi, GWAVI_STREAM_VIDEO, len, "gwavi_add_framev")
+			== -1)
+		return -1;
+
+	return add_video_chunk(gwavi, iov, iovcnt, len, "gwavi_add_framev");
+}
+
+/**
+ * This function adds a video frame captured at the given time, for sources
+ * with jitter or dropped frames. The frame takes the slot of the frame rate
+ * closest to its timestamp, the first frame defining time 0. When slots were
+ * skipped since the previous frame, each one is filled with an empty chunk,
+ * which players show as a repetition of the previous frame, so that timing is
+ * kept at the cost of 8 bytes and one index entry per missing frame. A frame
+ * whose slot is already taken goes to the next one. A timestamp that is not
+ * finite or would skip more than 65536 slots is refused and nothing is
+ * written.
+ *
+ * This function is not available in fixed frame size mode, and must not be
+ * called from several threads at the same time.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param timestamp Capture time of the frame in seconds.
+ * @param buffer Video buffer.
+ * @param len Video buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_frame_ts(struct gwavi_t *gwavi, double timestamp,
+		   unsigned char *buffer, size_t len)
+{
+	struct gwavi_stream_header_t *header;
+	struct iovec iov;
+	double slot;
+
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_ts",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+	if (gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_add_frame_ts",
+			     "not available in fixed frame size mode", 0);
+		return -1;
+	}
+	/* false for NaN as for infinities */
+	if (!(timestamp > -DBL_MAX && timestamp < DBL_MAX)) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_ts",
+			     "timestamp must be finite", 0);
+		return -1;
+	}
+
+	if (!gwavi->ts_started) {
+		gwavi->ts_origin = timestamp;
+		gwavi->ts_next = 0;
+		gwavi->ts_started = 1;
+	}
+	header = &gwavi->streams[GWAVI_STREAM_VIDEO].header;
+	slot = (timestamp - gwavi->ts_origin) * (double)header->data_rate /
+		(double)(header->time_scale ? header->time_scale : 1) + 0.5;
+	if (slot >= (double)gwavi->ts_next + GWAVI_TS_MAX_GAP + 1) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_ts",
+			     "timestamp too far from the previous frame", 0);
+		return -1;
+	}
+
+	/* fill the slots skipped since the previous frame */
+	while (slot >= (double)gwavi->ts_next + 1) {
+		if (add_video_chunk(gwavi, NULL, 0, 0, "gwavi_add_frame_ts")
+				== -1)
+			return -1;
+		gwavi->ts_next++;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+	if (add_video_chunk(gwavi, &iov, 1, len, "gwavi_add_frame_ts") == -1)
+		return -1;
+	gwavi->ts_next++;
+
+	return 0;
+}
+
+/**
+ * This function allows you to add an encoded video frame that may come out of
+ * order, for instance from a pool of encoder threads. Frames are numbered
+ * from 0 in presentation order and written to the AVI file in that order.
+ *
+ * A frame ahead of its turn is copied and held in the reorder window set with
+ * gwavi_set_reorder_window() until the frames before it are added. When a
+ * frame does not fit in the window, the missing frames in front of it are
+ * given up on and the held ones are written. Frames still missing when the
+ * file is closed are skipped as well. Frames added after their turn has
+ * passed are rejected. Numbering goes on across gwavi_reopen(): the next file
+ * starts with the frame following the last one written to the previous file.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param seq Sequence number of the frame.
+ * @param buffer Video buffer.
+ * @param len Video buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_frame_seq(struct gwavi_t *gwavi, unsigned int seq,
+		    unsigned char *buffer, size_t len)
+{
+	struct gwavi_reorder_slot_t *slot;
+	struct iovec iov;
+	int ret = 0;
+
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_seq",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+	if (check_fixed(gwavi, GWAVI_STREAM_VIDEO, len,
+			"gwavi_add_frame_seq") == -1 ||
+	    check_writable(gwavi, "gwavi_add_frame_seq") == -1)
+		return -1;
+	if ((int)(seq - gwavi->reorder_next) < 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_seq",
+			     "frame added after its turn", 0);
+		ret = -1;
+		goto done;
+	}
+
+	if (seq - gwavi->reorder_next >= gwavi->reorder_window &&
+	    seq != gwavi->reorder_next) {
+		gwavi_warn(gwavi, GWAVI_EFULL, "gwavi_add_frame_seq",
+			   "reorder window full, skipping missing frames");
+		if (reorder_advance(gwavi, seq + 1 - (gwavi->reorder_window ?
+					gwavi->reorder_window : 1)) == -1)
+			ret = -1;
+	}
+
+	if (seq == gwavi->reorder_next) {
+		iov.iov_base = buffer;
+		iov.iov_len = len;
+		if (add_chunk(gwavi, GWAVI_STREAM_VIDEO, &iov, 1, len) == -1)
+			ret = -1;
+		gwavi->reorder_next++;
+		if (reorder_drain(gwavi) == -1)
+			ret = -1;
+		goto done;
+	}
+
+	slot = &gwavi->reorder[seq % gwavi->reorder_window];
+	if (slot->frame) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_seq",
+			     "frame with this sequence number already added", 0);
+		ret = -1;
+		goto done;
+	}
+	if ((slot->frame = (unsigned char *)gwavi_malloc(gwavi, len ? len : 1))
+			== NULL) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_add_frame_seq",
+			     "could not allocate memory for frame copy", 0);
+		ret = -1;
+		goto done;
+	}
+	(void)memcpy(slot->frame, buffer, len);
+	slot->len = len;
+	gwavi->reorder_held++;
+
+done:
+	gwavi_fd_release(gwavi);
+	return ret;
+}
+
+/*
+ * Copy len bytes at offset in fd to the output through a buffer, for outputs
+ * without a file descriptor of their own such as a tee. Return 0 on success,
+ * -1 on error.
+ */
+static int
+copy_to_out(struct gwavi_t *gwavi, int fd, off_t offset, size_t len)
+{
+	unsigned char buffer[16384];
+	ssize_t r;
+
+	while (len > 0) {
+		r = pread(fd, buffer, len < sizeof(buffer) ?
+			  len : sizeof(buffer), offset);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fwrite(buffer, 1, (size_t)r, gwavi->out) != (size_t)r)
+			return -1;
+		offset += r;
+		len -= (size_t)r;
+	}
+
+	return 0;
+}
+
+/*
+ * Write a video chunk read from fd at the current position of the output file,
+ * dropping it if it cannot be completed. Return 0 on success, -1 on error.
+ */
+static int
+write_frame_fd(struct gwavi_t *gwavi, int fd, off_t offset, size_t len)
+{
+	static const unsigned char zeros[4] = { 0, 0, 0, 0 };
+	unsigned char header[8];
+	size_t size = pad_length(len);
+	long start, t;
+
+	/* where the chunk starts, to drop it if it cannot be completed */
+	if ((start = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "ftell() failed", errno);
+		return -1;
+	}
+
+	put_chunk_header(header, "00dc", size);
+	if (fwrite(header, 1, 8, gwavi->out) != 8) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "fwrite() failed", 0);
+		goto drop;
+	}
+	if (gwavi->tee) {
+		if (copy_to_out(gwavi, fd, offset, len) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+				     "copy_to_out() failed", errno);
+			goto drop;
+		}
+		goto pad;
+	}
+	if (fflush(gwavi->out) == EOF) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "fflush() failed", errno);
+		goto drop;
+	}
+	t = start + 8;
+	if (copy_fd_range(fileno(gwavi->out), (off_t)t, fd, offset, len)
+			== -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "copy_fd_range() failed", errno);
+		goto drop;
+	}
+	if (fseek(gwavi->out, t + (long)len, SEEK_SET) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "fseek() failed", errno);
+		goto drop;
+	}
+pad:
+	if (fwrite(zeros, 1, size - len, gwavi->out) != size - len) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_frame_fd",
+			     "fwrite() failed", 0);
+		goto drop;
+	}
+
+	if (add_offset(gwavi, GWAVI_STREAM_VIDEO, size) == -1)
+		goto drop;
+	gwavi->streams[0].header.data_length++;
+
+	if (gwavi->live_interval)
+		return gwavi_live_tick(gwavi);
+
+	return 0;
+
+drop:
+	/* the next chunk overwrites the one left incomplete */
+	(void)fseek(gwavi->out, start, SEEK_SET);
+	return -1;
+}
+
+/**
+ * This function allows you to add an encoded video frame read from a file
+ * descriptor to the AVI file. The frame data is copied from fd to the AVI
+ * file by the kernel (copy_file_range() or splice() when available) and does
+ * not go through user space, except when sinks are attached with
+ * gwavi_add_sink(). The file offset of fd is left unchanged.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param fd File descriptor open for reading the video frame from.
+ * @param offset Offset of the video frame in fd.
+ * @param len Video frame length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_frame_fd(struct gwavi_t *gwavi, int fd, off_t offset, size_t len)
+{
+	int ret;
+
+	if (!gwavi || fd < 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_frame_fd",
+			     "gwavi argument cannot be NULL and fd must be "
+			     "valid", 0);
+		return -1;
+	}
+	if (len < 256)
+		gwavi_warn(gwavi, GWAVI_EINVAL, "gwavi_add_frame_fd",
+			   "specified buffer len seems rather small");
+	if (check_fixed(gwavi, GWAVI_STREAM_VIDEO, len,
+			"gwavi_add_frame_fd") == -1 ||
+	    check_writable(gwavi, "gwavi_add_frame_fd") == -1)
+		return -1;
+	ret = write_frame_fd(gwavi, fd, offset, len);
+	gwavi_fd_release(gwavi);
+
+	return ret;
+}
+
+/**
+ * This function allows you to add the audio track to your AVI file.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param buffer Audio buffer size.
+ * @param len Audio buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_audio(struct gwavi_t *gwavi, unsigned char *buffer, size_t len)
+{
+	struct iovec iov;
+
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_audio",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+
+	return gwavi_add_audiov(gwavi, &iov, 1);
+}
+
+/**
+ * This function allows you to add audio data made of several buffers to your
+ * AVI file. The buffers are written one after the other in a single chunk.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param iov Array of buffers making up the audio data.
+ * @param iovcnt Number of elements in iov.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_audiov(struct gwavi_t *gwavi, const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+
+	if (!gwavi || !iov || iovcnt < 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_audiov",
+			     "gwavi and/or iov argument cannot be NULL", 0);
+		return -1;
+	}
+	if (!gwavi->streams[GWAVI_STREAM_AUDIO].audio) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_audiov",
+			     "stream 1 is not an audio stream", 0);
+		return -1;
+	}
+
+	len = iov_length(iov, iovcnt);
+	if (check_fixed(gwavi, GWAVI_STREAM_AUDIO, len, "gwavi_add_audiov")
+			== -1)
+		return -1;
+	if (gwavi->threaded)
+		return submit_chunk(gwavi, GWAVI_STREAM_AUDIO, iov, iovcnt, len,
+				    "gwavi_add_audiov");
+	if (gwavi->parallel)
+		return write_parallel_chunk(gwavi, GWAVI_STREAM_AUDIO, iov,
+					    iovcnt, len, "gwavi_add_audiov");
+	return add_checked_chunk(gwavi, GWAVI_STREAM_AUDIO, iov, iovcnt, len,
+				 "gwavi_add_audiov");
+}
+
+/*
+ * Return the number of the stream to add, the file being held until
+ * commit_stream(), or -1 if no stream can be added.
+ */
+static int
+next_stream(struct gwavi_t *gwavi, const char *caller)
+{
+	if (check_writable(gwavi, caller) == -1)
+		return -1;
+	if (gwavi->offsets_ptr > 0 || gwavi->reorder_held > 0) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller,
+			     "streams must be added before the first chunk", 0);
+		goto fail;
+	}
+	if (gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_ESTATE, caller,
+			     "not available in fixed frame size mode", 0);
+		goto fail;
+	}
+	if (gwavi->avi_header.data_streams >= GWAVI_MAX_STREAMS) {
+		gwavi_report(gwavi, GWAVI_EFULL, caller,
+			     "too many streams", 0);
+		goto fail;
+	}
+
+	return (int)gwavi->avi_header.data_streams;
+
+fail:
+	gwavi_fd_release(gwavi);
+	return -1;
+}
+
+/*
+ * Account for the stream initialized by the caller and write the headers
+ * again since the hdrl list grows. Return the stream number, -1 on error.
+ */
+static int
+commit_stream(struct gwavi_t *gwavi, int stream, const char *caller)
+{
+	gwavi->avi_header.data_streams = (unsigned int)stream + 1;
+	if (fseek(gwavi->out, 12, SEEK_SET) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, caller, "fseek() failed", errno);
+		stream = -1;
+	} else if (write_headers(gwavi, caller) == -1) {
+		stream = -1;
+	}
+	gwavi_fd_release(gwavi);
+
+	return stream;
+}
+
+/**
+ * This function adds a video stream to the AVI file. It must be called before
+ * any frame or audio data is added. Chunks are added to the stream with
+ * gwavi_add_stream_chunk().
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param width Width of a frame.
+ * @param height Height of a frame.
+ * @param fourcc FourCC representing the codec of the stream.
+ * @param fps Number of frames per second of the stream. It needs to be > 0.
+ *
+ * @return Number of the stream, -1 on error.
+ */
+int
+gwavi_add_video_stream(struct gwavi_t *gwavi, unsigned int width,
+		       unsigned int height, const char *fourcc,
+		       unsigned int fps)
+{
+	int stream;
+
+	if (!gwavi || !fourcc || fps < 1) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_video_stream",
+			     "gwavi and/or fourcc argument cannot be NULL and "
+			     "fps must be > 0", 0);
+		return -1;
+	}
+	if (check_fourcc(fourcc) != 0)
+		gwavi_warn_detail(gwavi, GWAVI_EINVAL, "gwavi_add_video_stream",
+				  "given fourcc does not seem to be valid",
+				  fourcc);
+	if ((stream = next_stream(gwavi, "gwavi_add_video_stream")) == -1)
+		return -1;
+
+	init_video_stream(gwavi, stream, width, height, fourcc, fps);
+
+	return commit_stream(gwavi, stream, "gwavi_add_video_stream");
+}
+
+/**
+ * This function adds an audio stream to the AVI file. It must be called before
+ * any frame or audio data is added. If gwavi_open() was given no audio
+ * parameters, the first audio stream added is the one gwavi_add_audio()
+ * writes to.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param audio Audio parameters of the stream.
+ *
+ * @return Number of the stream, -1 on error.
+ */
+int
+gwavi_add_audio_stream(struct gwavi_t *gwavi, struct gwavi_audio_t *audio)
+{
+	int stream;
+
+	if (!gwavi || !audio) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_audio_stream",
+			     "gwavi and/or audio argument cannot be NULL", 0);
+		return -1;
+	}
+	if ((stream = next_stream(gwavi, "gwavi_add_audio_stream")) == -1)
+		return -1;
+
+	init_audio_stream(gwavi, stream, audio);
+
+	return commit_stream(gwavi, stream, "gwavi_add_audio_stream");
+}
+
+/**
+ * This function adds a video frame or audio data to the given stream, as a
+ * "##dc" or "##wb" chunk depending on the type of the stream.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param stream Stream number: 0 for the video of gwavi_open(), 1 for its
+ * audio, or a number returned by gwavi_add_video_stream() or
+ * gwavi_add_audio_stream(). Threaded mode only handles streams 0 and 1.
+ * @param buffer Frame or audio data.
+ * @param len Buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_stream_chunk(struct gwavi_t *gwavi, unsigned int stream,
+		       unsigned char *buffer, size_t len)
+{
+	struct iovec iov;
+
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_stream_chunk",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+	if (stream >= gwavi->avi_header.data_streams) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_stream_chunk",
+			     "no such stream", 0);
+		return -1;
+	}
+
+	if (check_fixed(gwavi, (int)stream, len, "gwavi_add_stream_chunk")
+			== -1)
+		return -1;
+
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+	if (gwavi->threaded) {
+		if (stream > GWAVI_STREAM_AUDIO) {
+			gwavi_report(gwavi, GWAVI_ESTATE,
+				     "gwavi_add_stream_chunk",
+				     "threaded mode only handles streams 0 "
+				     "and 1", 0);
+			return -1;
+		}
+		return submit_chunk(gwavi, (int)stream, &iov, 1, len,
+				    "gwavi_add_stream_chunk");
+	}
+	if (gwavi->parallel)
+		return write_parallel_chunk(gwavi, (int)stream, &iov, 1, len,
+					    "gwavi_add_stream_chunk");
+	return add_checked_chunk(gwavi, (int)stream, &iov, 1, len,
+				 "gwavi_add_stream_chunk");
+}
+
+/**
+ * This function returns a buffer the encoder can write a video frame of up to
+ * max_len bytes into. The buffer has room in front of and after the frame for
+ * the chunk header and padding so that gwavi_commit_frame() can emit the whole
+ * chunk as one contiguous write without copying the frame.
+ *
+ * Buffers come from a per gwavi_t pool and are recycled: once the frame is
+ * committed (or released with gwavi_frame_free()), the next call to this
+ * function will reuse the same memory.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param max_len Maximum length of the frame that will be written in the
+ * buffer.
+ *
+ * @return Pointer to max_len bytes of writable memory, NULL on error.
+ */
+unsigned char *
+gwavi_frame_alloc(struct gwavi_t *gwavi, size_t max_len)
+{
+	struct gwavi_frame_buf_t *buf;
+	size_t size;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_frame_alloc",
+			     "gwavi argument cannot be NULL", 0);
+		return NULL;
+	}
+
+	buf = gwavi->frame_pool;
+	if (buf) {
+		gwavi->frame_pool = buf->next;
+		gwavi->frame_pool_len--;
+		if (buf->capacity >= max_len) {
+			gwavi->frames_out++;
+			return (unsigned char *)(buf + 1) + GWAVI_FRAME_HEADROOM;
+		}
+	}
+
+	size = sizeof(struct gwavi_frame_buf_t) + GWAVI_FRAME_HEADROOM +
+		max_len + GWAVI_FRAME_TAILROOM;
+	buf = (struct gwavi_frame_buf_t *)gwavi_realloc(gwavi, buf, size);
+	if (buf == NULL) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_frame_alloc",
+			     "could not allocate memory for frame buffer", 0);
+		return NULL;
+	}
+	buf->next = NULL;
+	buf->capacity = max_len;
+	gwavi->frames_out++;
+
+	return (unsigned char *)(buf + 1) + GWAVI_FRAME_HEADROOM;
+}
+
+/**
+ * This function gives a buffer obtained with gwavi_frame_alloc() back to the
+ * pool without writing it to the AVI file.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param frame Buffer returned by gwavi_frame_alloc().
+ */
+void
+gwavi_frame_free(struct gwavi_t *gwavi, unsigned char *frame)
+{
+	struct gwavi_frame_buf_t *buf;
+
+	if (!gwavi || !frame)
+		return;
+
+	buf = (struct gwavi_frame_buf_t *)(frame - GWAVI_FRAME_HEADROOM) - 1;
+	gwavi->frames_out--;
+	if (gwavi->frame_pool_len >= GWAVI_FRAME_POOL_MAX) {
+		gwavi_free(gwavi, buf);
+		return;
+	}
+	buf->next = gwavi->frame_pool;
+	gwavi->frame_pool = buf;
+	gwavi->frame_pool_len++;
+}
+
+/**
+ * This function adds a video frame written into a buffer obtained with
+ * gwavi_frame_alloc() to the AVI file. The chunk header and padding are
+ * written into the room reserved around the frame and the whole chunk is
+ * emitted with a single write.
+ *
+ * The buffer is given back to the pool whether the call succeeds or not and
+ * must not be used afterwards.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param frame Buffer returned by gwavi_frame_alloc().
+ * @param len Length of the frame written in the buffer. It cannot exceed the
+ * max_len given to gwavi_frame_alloc().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_commit_frame(struct gwavi_t *gwavi, unsigned char *frame, size_t len)
+{
+	struct gwavi_frame_buf_t *buf;
+	unsigned char *chunk;
+	size_t size;
+	int ret = -1;
+
+	if (!gwavi || !frame) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_commit_frame",
+			     "gwavi and/or frame argument cannot be NULL", 0);
+		return -1;
+	}
+
+	buf = (struct gwavi_frame_buf_t *)(frame - GWAVI_FRAME_HEADROOM) - 1;
+	if (check_fixed(gwavi, GWAVI_STREAM_VIDEO, len,
+			"gwavi_commit_frame") == -1 ||
+	    check_writable(gwavi, "gwavi_commit_frame") == -1)
+		goto free_frame;
+	if (len > buf->capacity) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_commit_frame",
+			     "frame length exceeds buffer capacity", 0);
+		goto release;
+	}
+
+	size = pad_length(len);
+	chunk = frame - GWAVI_FRAME_HEADROOM;
+	put_chunk_header(chunk, "00dc", size);
+	(void)memset(frame + len, 0, size - len);
+
+	if (add_offset(gwavi, GWAVI_STREAM_VIDEO, size) == -1)
+		goto release;
+	gwavi->streams[0].header.data_length++;
+
+	if (fwrite(chunk, 1, GWAVI_FRAME_HEADROOM + size, gwavi->out)
+			!= GWAVI_FRAME_HEADROOM + size) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_commit_frame",
+			     "fwrite() failed", 0);
+		goto release;
+	}
+	ret = gwavi->live_interval ? gwavi_live_tick(gwavi) : 0;
+
+release:
+	gwavi_fd_release(gwavi);
+free_frame:
+	gwavi_frame_free(gwavi, frame);
+	return ret;
+}
+
+/**
+ * This function starts a video frame whose data will be given in several
+ * pieces with gwavi_frame_append(). This allows writing frames too large to be
+ * buffered in memory at once. The frame is completed by gwavi_frame_end() and
+ * no other frame or audio data can be added in between.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param len Total length of the frame if known in advance, 0 otherwise. When
+ * it is known, the chunk size is written upfront and does not need to be
+ * patched by gwavi_frame_end().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_frame_begin(struct gwavi_t *gwavi, size_t len)
+{
+	unsigned char header[8];
+	int ret = -1;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_frame_begin",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_frame_begin",
+			     "not available in fixed frame size mode", 0);
+		return -1;
+	}
+	if (check_writable(gwavi, "gwavi_frame_begin") == -1)
+		return -1;
+
+	put_chunk_header(header, "00dc", pad_length(len));
+	if (fwrite(header, 1, 4, gwavi->out) != 4)
+		goto fwrite_failed;
+	if ((gwavi->chunk_marker = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_begin",
+			     "ftell() failed", errno);
+		goto release;
+	}
+	if (fwrite(header + 4, 1, 4, gwavi->out) != 4)
+		goto fwrite_failed;
+
+	gwavi->in_chunk = 1;
+	gwavi->chunk_len = 0;
+	gwavi->chunk_expected = len;
+	ret = 0;
+	goto release;
+
+fwrite_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_begin", "fwrite() failed",
+		     0);
+release:
+	gwavi_fd_release(gwavi);
+	return ret;
+}
+
+/**
+ * This function appends data to the video frame started with
+ * gwavi_frame_begin(). It can be called as many times as needed.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param buffer Piece of the video frame.
+ * @param len Length of buffer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_frame_append(struct gwavi_t *gwavi, const unsigned char *buffer,
+		   size_t len)
+{
+	if (!gwavi || !buffer) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_frame_append",
+			     "gwavi and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+	if (!gwavi->in_chunk) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_frame_append",
+			     "no frame started, call gwavi_frame_begin() first",
+			     0);
+		return -1;
+	}
+	if (gwavi_fd_resume(gwavi, "gwavi_frame_append") == -1)
+		return -1;
+
+	if (fwrite(buffer, 1, len, gwavi->out) != len) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_append",
+			     "fwrite() failed", 0);
+		gwavi_fd_release(gwavi);
+		return -1;
+	}
+	gwavi->chunk_len += len;
+	gwavi_fd_release(gwavi);
+
+	return 0;
+}
+
+/*
+ * Pad the streamed frame, patch its size and add it to the index.
+ */
+static int
+end_frame(struct gwavi_t *gwavi)
+{
+	static const unsigned char zeros[4] = { 0, 0, 0, 0 };
+	size_t size;
+	long t;
+
+	gwavi->in_chunk = 0;
+
+	size = pad_length(gwavi->chunk_len);
+	if (fwrite(zeros, 1, size - gwavi->chunk_len, gwavi->out)
+			!= size - gwavi->chunk_len) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_end",
+			     "fwrite() failed", 0);
+		return -1;
+	}
+
+	if (gwavi->chunk_expected == 0) {
+		if ((t = ftell(gwavi->out)) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_end",
+				     "ftell() failed", errno);
+			return -1;
+		}
+		if (fseek(gwavi->out, gwavi->chunk_marker, SEEK_SET) == -1)
+			goto fseek_failed;
+		if (write_int(gwavi->out, (unsigned int)size) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_end",
+				     "write_int() failed", 0);
+			return -1;
+		}
+		if (fseek(gwavi->out, t, SEEK_SET) == -1)
+			goto fseek_failed;
+	}
+
+	if (add_offset(gwavi, GWAVI_STREAM_VIDEO, size) == -1)
+		return -1;
+	gwavi->streams[0].header.data_length++;
+
+	if (gwavi->live_interval)
+		return gwavi_live_tick(gwavi);
+
+	return 0;
+
+fseek_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "gwavi_frame_end", "fseek() failed",
+		     errno);
+	return -1;
+}
+
+/**
+ * This function completes the video frame started with gwavi_frame_begin().
+ * The chunk is padded, its size is patched unless it was given to
+ * gwavi_frame_begin() and the frame is added to the index.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_frame_end(struct gwavi_t *gwavi)
+{
+	int ret;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_frame_end",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (!gwavi->in_chunk) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_frame_end",
+			     "no frame started, call gwavi_frame_begin() first",
+			     0);
+		return -1;
+	}
+	if (gwavi->chunk_expected != 0 &&
+	    gwavi->chunk_expected != gwavi->chunk_len) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_frame_end", "length "
+			     "of appended data does not match the one given "
+			     "to gwavi_frame_begin()", 0);
+		return -1;
+	}
+	if (gwavi_fd_resume(gwavi, "gwavi_frame_end") == -1)
+		return -1;
+	ret = end_frame(gwavi);
+	gwavi_fd_release(gwavi);
+
+	return ret;
+}
+
+/*
+ * Stop the worker threads and complete the file. Sets *status to -1 if a
+ * queued chunk could not be written and returns -1 if the file could not be
+ * completed.
+ */
+static int
+close_file(struct gwavi_t *gwavi, int *status)
+{
+	*status = 0;
+	if (gwavi->threaded && gwavi_set_threaded(gwavi, 0) == -1)
+		*status = -1;
+	if (gwavi->parallel && gwavi_set_parallel(gwavi, 0) == -1)
+		*status = -1;
+	gwavi_live_stop(gwavi);
+	if (gwavi_fd_has_file(gwavi) && finish_file(gwavi) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Free the memory held by gwavi, closing the output file without completing
+ * it if close_file() failed.
+ */
+static void
+release_handle(struct gwavi_t *gwavi)
+{
+	struct gwavi_frame_buf_t *buf;
+
+	/* no other handle can park this one once it is out of the list */
+	gwavi_fd_forget(gwavi);
+	if (gwavi->out) {
+		(void)fclose(gwavi->out);
+		gwavi->out = NULL;
+		gwavi->tee = NULL;
+	}
+
+	gwavi_free(gwavi, gwavi->filename);
+	gwavi_free(gwavi, gwavi->offsets);
+	gwavi_free(gwavi, gwavi->index);
+	while (gwavi->frame_pool) {
+		buf = gwavi->frame_pool;
+		gwavi->frame_pool = buf->next;
+		gwavi_free(gwavi, buf);
+	}
+
+	gwavi_free(gwavi, gwavi->reorder);
+
+	if (gwavi->streams[0].format_v.palette != 0)
+		gwavi_free(gwavi, gwavi->streams[0].format_v.palette);
+
+	gwavi_free_handle(gwavi);
+}
+
+/**
+ * This function should be called when the program is done adding video and/or
+ * audio frames to the AVI file. It frees memory allocated for gwavi_open() for
+ * the main gwavi_t structure. It also properly closes the output file.
+ *
+ * In threaded mode, the chunks still queued are written first. If one of the
+ * queued chunks (or, in parallel mode, one of the chunks) could not be
+ * written, the file is still closed and the memory freed but -1 is returned.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_close(struct gwavi_t *gwavi)
+{
+	int ret;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_close",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+
+	if (close_file(gwavi, &ret) == -1)
+		return -1;
+	release_handle(gwavi);
+
+	return ret;
+}
+
+/*
+ * Thread started by gwavi_close_async().
+ */
+static void *
+close_main(void *arg)
+{
+	struct gwavi_t *gwavi = (struct gwavi_t *)arg;
+	void (*cb)(void *, int) = gwavi->close_cb;
+	void *ctx = gwavi->close_ctx;
+	int status;
+
+	/* nobody is left to retry, free the handle even if the file failed */
+	if (close_file(gwavi, &status) == -1)
+		status = -1;
+	release_handle(gwavi);
+	if (cb)
+		cb(ctx, status);
+
+	return NULL;
+}
+
+/**
+ * This function does what gwavi_close() does on a background thread and
+ * returns right away, so that the caller can go on with the next file while
+ * the index and headers of this one are written.
+ *
+ * The gwavi_t structure must not be used anymore once this function succeeds:
+ * it is freed by the background thread even if the file could not be
+ * completed, so the status passed to cb is all the caller gets back.
+ * Errors are reported through the log callback, from the background thread.
+ * The program must wait for the completion callback before exiting, or the
+ * file will be left incomplete.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param cb Function called from the background thread once the file is
+ * closed, with ctx and 0 on success or -1 on error. Can be NULL.
+ * @param ctx Opaque pointer passed to cb.
+ *
+ * @return 0 if the background thread was started, -1 on error. On error, the
+ * gwavi_t structure is left untouched and gwavi_close() can still be used.
+ */
+int
+gwavi_close_async(struct gwavi_t *gwavi, void (*cb)(void *ctx, int status),
+		  void *ctx)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_close_async",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+
+	/* other handles could park it while it is being closed */
+	if (gwavi->parkable && gwavi_set_parkable(gwavi, 0) == -1)
+		return -1;
+
+	gwavi->close_cb = cb;
+	gwavi->close_ctx = ctx;
+	if ((err = pthread_attr_init(&attr)) != 0)
+		goto failed;
+	(void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, close_main, gwavi);
+	(void)pthread_attr_destroy(&attr);
+	if (err != 0)
+		goto failed;
+
+	return 0;
+
+failed:
+	gwavi_report(gwavi, GWAVI_ESYS, "gwavi_close_async",
+		     "could not start closing thread", err);
+	return -1;
+}
+
+/*
+ * Copy the file written so far to path and complete the copy.
+ */
+static int
+take_snapshot(struct gwavi_t *gwavi, const char *path)
+{
+	FILE *out, *snap;
+	long t;
+	int src, dst, ret;
+
+	if (fflush(gwavi->out) == EOF) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "fflush() failed", errno);
+		return -1;
+	}
+	if ((t = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "ftell() failed", errno);
+		return -1;
+	}
+	/* a stream with sinks has no descriptor, read the file itself */
+	if ((src = fileno(gwavi->out)) == -1 &&
+	    (src = open(gwavi->filename, O_RDONLY)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "could not read the file", errno);
+		return -1;
+	}
+	if ((dst = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "failed to open file for writing", errno);
+		goto close_src;
+	}
+	if (copy_fd_range(dst, 0, src, 0, (size_t)t) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "copy_fd_range() failed", errno);
+		(void)close(dst);
+		goto remove;
+	}
+	if ((snap = fdopen(dst, "rb+")) == NULL) {
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_snapshot",
+			     "fdopen() failed", errno);
+		(void)close(dst);
+		goto remove;
+	}
+
+	/* the copy is completed as the file would be by gwavi_close() */
+	gwavi->avi_header.number_of_frames =
+		gwavi->streams[0].header.data_length;
+	out = gwavi->out;
+	gwavi->out = snap;
+	ret = fseek(snap, t, SEEK_SET) == -1 ? -1 :
+		complete_file(gwavi, "gwavi_snapshot");
+	gwavi->out = out;
+	if (fclose(snap) == EOF || ret == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_snapshot",
+			     "could not complete the snapshot", errno);
+		goto remove;
+	}
+
+	if (src != fileno(gwavi->out))
+		(void)close(src);
+	return 0;
+
+remove:
+	(void)remove(path);
+close_src:
+	if (src != fileno(gwavi->out))
+		(void)close(src);
+	return -1;
+}
+
+/**
+ * This function writes a complete AVI file holding the chunks added so far,
+ * while recording goes on to the current file. The data is copied with
+ * copy_file_range(), which shares the blocks instead of copying them on
+ * filesystems supporting it, then the sizes, headers and index are completed
+ * in the copy.
+ *
+ * It is called in sequential mode, between chunks. Frames held in the
+ * reorder window are not part of the snapshot.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param path Name of the AVI file to create.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_snapshot(struct gwavi_t *gwavi, const char *path)
+{
+	int ret;
+
+	if (!gwavi || !path) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_snapshot",
+			     "gwavi and/or path argument cannot be NULL", 0);
+		return -1;
+	}
+	if (check_writable(gwavi, "gwavi_snapshot") == -1)
+		return -1;
+	ret = take_snapshot(gwavi, path);
+	gwavi_fd_release(gwavi);
+
+	return ret;
+}
+
+/**
+ * This function closes the current AVI file the same way gwavi_close() does
+ * and starts a new one with the same settings, reusing the gwavi_t structure.
+ * Memory allocated for the index, the frame buffers pool and the headers is
+ * kept so that going from one file to the next one does not allocate.
+ *
+ * If the new file cannot be created, the gwavi_t structure remains valid and
+ * gwavi_reopen() can be called again with another file name, or gwavi_close()
+ * can be used to free it.
+ *
+ * Sinks attached with gwavi_add_sink() receive the completed file only: they
+ * are detached with a warning and must be attached again to receive the new
+ * one.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param filename Name of the next AVI file to generate.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_reopen(struct gwavi_t *gwavi, const char *filename)
+{
+	int i, sinks;
+
+	if (!gwavi || !filename) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_reopen",
+			     "gwavi and/or filename argument cannot be NULL",
+			     0);
+		return -1;
 	}
+	if (check_sequential(gwavi, "gwavi_reopen") == -1)
+		return -1;
 
-	gwavi->offsets_ptr = 0;
+	sinks = gwavi->tee != NULL;
+	if (gwavi_fd_has_file(gwavi) && finish_file(gwavi) == -1)
+		return -1;
+	if (sinks)
+		gwavi_warn(gwavi, GWAVI_ESTATE, "gwavi_reopen",
+			   "sinks detached with the completed file");
 
-	return gwavi;
+	gwavi->offsets_ptr = 0;
+	gwavi->offset_count = 0;
+	gwavi->avi_header.number_of_frames = 0;
+	for (i = 0; i < GWAVI_MAX_STREAMS; i++)
+		gwavi->streams[i].header.data_length = 0;
+	if (gwavi->live_interval)
+		gwavi_live_reset(gwavi);
+	gwavi->ts_started = 0;
 
-write_chars_bin_failed:
-	(void)fprintf(stderr, "gwavi_open: write_chars_bin() failed\n");
-	return NULL;
+	return start_file(gwavi, filename, "gwavi_reopen");
 }
 
 /**
- * This function allows you to add an encoded video frame to the AVI file.
+ * This function makes sure the index can hold at least the given number of
+ * entries without growing. Each video frame and each audio chunk uses one
+ * entry. Calling it right after gwavi_open() with the expected number of
+ * chunks avoids any allocation while adding them.
  *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param buffer Video buffer size.
- * @param len Video buffer length.
+ * @param count Number of index entries to reserve room for, at most
+ * 268435455 since the whole index must fit in one chunk.
  *
  * @return 0 on success, -1 on error.
  */
 int
-gwavi_add_frame(struct gwavi_t *gwavi, unsigned char *buffer, size_t len)
+gwavi_reserve(struct gwavi_t *gwavi, unsigned int count)
 {
-	size_t maxi_pad;  /* if your frame is raggin, give it some paddin' */
-	size_t t;
-
-	if (!gwavi || !buffer) {
-		(void)fputs("gwavi and/or buffer argument cannot be NULL",
-			    stderr);
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_reserve",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
-	if (len < 256)
-		(void)fprintf(stderr, "WARNING: specified buffer len seems "
-			      "rather small: %d. Are you sure about this?\n",
-			      (int)len);
-
-	gwavi->offset_count++;
-	gwavi->stream_header_v.data_length++;
-
-	maxi_pad = len % 4;
-	if (maxi_pad > 0)
-		maxi_pad = 4 - maxi_pad;
-
-	if (gwavi->offset_count >= gwavi->offsets_len) {
-		gwavi->offsets_len += 1024;
-		gwavi->offsets = (unsigned int *)realloc(gwavi->offsets,
-					(size_t)gwavi->offsets_len *
-					sizeof(unsigned int));
+	if (count <= (unsigned int)gwavi->offsets_len)
+		return 0;
+	if (count > GWAVI_MAX_INDEX_ENTRIES) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_reserve",
+			     "count exceeds the size of an AVI index", 0);
+		return -1;
 	}
+	if (check_sequential(gwavi, "gwavi_reserve") == -1)
+		return -1;
 
-	gwavi->offsets[gwavi->offsets_ptr++] = (unsigned int)(len + maxi_pad);
+	return grow_index(gwavi, (int)count, "gwavi_reserve");
+}
 
-	if (write_chars_bin(gwavi->out, "00dc", 4) == -1) {
-		(void)fprintf(stderr, "gwavi_add_frame: write_chars_bin() "
-			      "failed\n");
+/**
+ * This function allows you to reset the framerate. In a standard use case, you
+ * should not need to call it. However, if you need to, you can call it to reset
+ * the framerate after you are done adding frames to your AVI file and before
+ * you call gwavi_close().
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param fps Number of frames per second of your video.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_framerate(struct gwavi_t *gwavi, unsigned int fps)
+{
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_framerate",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
-	if (write_int(gwavi->out, (unsigned int)(len + maxi_pad)) == -1) {
-		(void)fprintf(stderr, "gwavi_add_frame: write_int() failed\n");
+	gwavi->streams[0].header.data_rate = fps;
+	gwavi->avi_header.time_delay = (10000000 / fps);
+
+	return 0;
+}
+
+/**
+ * This function allows you to reset the video codec. In a standard use case,
+ * you should not need to call it. However, if you need to, you can call it to
+ * reset the video codec after you are done adding frames to your AVI file and
+ * before you call gwavi_close().
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param fourcc FourCC representing the codec of the video encoded stream. a
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_codec(struct gwavi_t *gwavi, const char *fourcc)
+{
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_codec",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
+	if (check_fourcc(fourcc) != 0)
+		gwavi_warn_detail(gwavi, GWAVI_EINVAL, "gwavi_set_codec",
+				  "given fourcc does not seem to be valid",
+				  fourcc);
+
+	memcpy(gwavi->streams[0].header.codec, fourcc, 4);
+	gwavi->streams[0].format_v.compression_type =
+		((unsigned int)fourcc[3] << 24) +
+		((unsigned int)fourcc[2] << 16) +
+		((unsigned int)fourcc[1] << 8) +
+		((unsigned int)fourcc[0]);
+
+	return 0;
+}
+
+/**
+ * This function allows you to reset the video size. In a standard use case, you
+ * should not need to call it. However, if you need to, you can call it to reset
+ * the video height and width set in the AVI file after you are done adding
+ * frames to your AVI file and before you call gwavi_close().
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param width Width of a frame.
+ * @param height Height of a frame.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_size(struct gwavi_t *gwavi, unsigned int width, unsigned int height)
+{
+	unsigned int size = (width * height * 3);
 
-	if ((t = fwrite(buffer, 1, len, gwavi->out)) != len) {
-		(void)fprintf(stderr, "gwavi_add_frame: fwrite() failed\n");
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_size",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
 
-	for (t = 0; t < maxi_pad; t++)
-		if (fputc(0, gwavi->out) == EOF) {
-			(void)fprintf(stderr, "gwavi_add_frame: fputc() failed\n");
-			return -1;
-		}
+	gwavi->avi_header.data_rate = size;
+	gwavi->avi_header.width = width;
+	gwavi->avi_header.height = height;
+	gwavi->avi_header.buffer_size = size;
+	gwavi->streams[0].header.buffer_size = size;
+	gwavi->streams[0].format_v.width = width;
+	gwavi->streams[0].format_v.height = height;
+	gwavi->streams[0].format_v.image_size = size;
 
 	return 0;
 }
 
 /**
- * This function allows you to add the audio track to your AVI file.
+ * This function switches gwavi to realtime mode, meant for capture threads
+ * that cannot afford unbounded latencies. It should be called right after
+ * gwavi_open(). In realtime mode:
+ *
+ * - memory for max_chunks index entries is allocated upfront and adding a
+ *   chunk never allocates: once the index is full, adding fails;
+ * - warnings are dropped and errors are not passed to the log callback, they
+ *   are pushed into a fixed size lock-free ring that another thread can drain
+ *   with gwavi_pop_error(). gwavi_last_error() keeps working.
+ *
+ * The worst case execution path of gwavi_add_frame(), gwavi_add_framev(),
+ * gwavi_add_audio() and gwavi_commit_frame() is then a bounds check on the
+ * index followed by at most three fwrite() calls (chunk header, payload,
+ * padding), the only blocking operation being the write() stdio issues when
+ * its buffer is full. gwavi_reopen() does not allocate either. Buffers
+ * obtained with gwavi_frame_alloc() are only allocated when the pool holds no
+ * buffer, so a buffer should be allocated and freed before going realtime.
+ * Live mode and parkable handles, which refresh headers or reopen the file
+ * while adding chunks, are not available in realtime mode.
  *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param buffer Audio buffer size.
- * @param len Audio buffer length.
+ * @param max_chunks Maximum number of video frames and audio chunks the file
+ * will hold.
  *
  * @return 0 on success, -1 on error.
  */
 int
-gwavi_add_audio(struct gwavi_t *gwavi, unsigned char *buffer, size_t len)
+gwavi_set_realtime(struct gwavi_t *gwavi, unsigned int max_chunks)
 {
-	size_t maxi_pad;  /* in case audio bleeds over the 4 byte boundary  */
-	size_t t;
-
-	if (!gwavi || !buffer) {
-		(void)fputs("gwavi and/or buffer argument cannot be NULL",
-			    stderr);
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_realtime",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (check_sequential(gwavi, "gwavi_set_realtime") == -1)
+		return -1;
+	if (gwavi->live_interval || gwavi->parkable) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_realtime",
+			     "not available in live mode or to parkable handles",
+			     0);
 		return -1;
 	}
+	if (gwavi_reserve(gwavi, max_chunks) == -1)
+		return -1;
 
-	gwavi->offset_count++;
+	gwavi->realtime = 1;
 
-	maxi_pad = len % 4;
-	if (maxi_pad > 0)
-		maxi_pad = 4 - maxi_pad;
+	return 0;
+}
+
+/**
+ * This function switches gwavi to threaded mode, where gwavi_add_frame(),
+ * gwavi_add_framev(), gwavi_add_audio() and gwavi_add_audiov() can be called
+ * concurrently from several threads, for instance a video capture thread and
+ * an audio capture thread, without any external locking.
+ *
+ * These functions then copy the chunk and push it onto a lock-free queue
+ * (one atomic exchange, no lock shared between the producers) and a
+ * dedicated thread writes the queued chunks to the file. Chunks of a same
+ * stream are written in the order the calls adding them were made, even when
+ * several threads add chunks to the same stream. Errors of the writer thread
+ * are reported through the log callback, from the writer thread, and make the
+ * following calls fail.
+ *
+ * The other functions adding chunks, gwavi_reopen(), gwavi_reserve(),
+ * gwavi_set_realtime() and gwavi_set_allocator() are not available in
+ * threaded mode. The allocator must be thread-safe since chunk copies are
+ * allocated by the producers and freed by the writer thread.
+ *
+ * Threaded mode is left by calling this function with max_queued set to 0,
+ * or by gwavi_close(), once all the threads adding chunks are done: the chunks
+ * still queued are written before returning.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param max_queued Maximum number of chunks waiting to be written, adding a
+ * chunk fails when it is reached. 0 leaves threaded mode.
+ *
+ * @return 0 on success, -1 on error. When leaving threaded mode, -1 means that
+ * some chunks could not be written.
+ */
+int
+gwavi_set_threaded(struct gwavi_t *gwavi, unsigned int max_queued)
+{
+	int err;
 
-	if (gwavi->offset_count >= gwavi->offsets_len) {
-		gwavi->offsets_len += 1024;
-		gwavi->offsets = (unsigned int *)realloc(gwavi->offsets,
-					(size_t)gwavi->offsets_len *
-					sizeof(unsigned int));
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_threaded",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
 	}
 
-	gwavi->offsets[gwavi->offsets_ptr++] =
-		(unsigned int)((len + maxi_pad) | 0x80000000);
+	if (max_queued == 0) {
+		if (!gwavi->threaded)
+			return 0;
+		if (gwavi->pool) {
+			gwavi_pool_leave(gwavi);
+			flush_held(gwavi);
+			gwavi->pool = NULL;
+		} else {
+			gwavi->stop_job.stream = -1;
+			gwavi_queue_push(&gwavi->jobs, &gwavi->stop_job.node);
+			(void)sem_post(&gwavi->jobs_sem);
+			(void)pthread_join(gwavi->writer, NULL);
+			(void)sem_destroy(&gwavi->jobs_sem);
+		}
+		gwavi->threaded = 0;
+		if (gwavi->writer_failed) {
+			gwavi->writer_failed = 0;
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_threaded",
+				     "writer thread failed to write a chunk",
+				     0);
+			return -1;
+		}
+		return 0;
+	}
 
-	if (write_chars_bin(gwavi->out,"01wb",4) == -1) {
-		(void)fprintf(stderr, "gwavi_add_audio: write_chars_bin() "
-			      "failed\n");
+	if (gwavi->threaded) {
+		gwavi->jobs_max = max_queued;
+		return 0;
+	}
+	if (gwavi->realtime) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_threaded",
+			     "not available in realtime mode", 0);
 		return -1;
 	}
-	if (write_int(gwavi->out,(unsigned int)(len + maxi_pad)) == -1) {
-		(void)fprintf(stderr, "gwavi_add_audio: write_int() failed\n");
+	if (gwavi->parkable) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_threaded",
+			     "not available to parkable handles", 0);
 		return -1;
 	}
-
-	if ((t = fwrite(buffer, 1, len, gwavi->out)) != len ) {
-		(void)fprintf(stderr, "gwavi_add_audio: fwrite() failed\n");
+	if (check_writable(gwavi, "gwavi_set_threaded") == -1)
 		return -1;
+
+	gwavi_queue_init(&gwavi->jobs);
+	gwavi->jobs_queued = 0;
+	gwavi->jobs_max = max_queued;
+	gwavi->seq_next[GWAVI_STREAM_VIDEO] = 0;
+	gwavi->seq_next[GWAVI_STREAM_AUDIO] = 0;
+	gwavi->seq_write[GWAVI_STREAM_VIDEO] = 0;
+	gwavi->seq_write[GWAVI_STREAM_AUDIO] = 0;
+	gwavi->held[GWAVI_STREAM_VIDEO] = NULL;
+	gwavi->held[GWAVI_STREAM_AUDIO] = NULL;
+	gwavi->writer_failed = 0;
+
+	/* the workers of the pool being attached to write the chunks */
+	if (gwavi->pool) {
+		gwavi->threaded = 1;
+		return 0;
 	}
 
-	for (t = 0; t < maxi_pad; t++)
-		if (fputc(0,gwavi->out) == EOF) {
-			(void)fprintf(stderr, "gwavi_add_audio: fputc() failed\n");
-			return -1;
-		}
+	if (sem_init(&gwavi->jobs_sem, 0, 0) == -1) {
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_set_threaded",
+			     "sem_init() failed", errno);
+		return -1;
+	}
 
-	gwavi->stream_header_a.data_length += (unsigned int)(len + maxi_pad);
+	gwavi->threaded = 1;
+	if ((err = pthread_create(&gwavi->writer, NULL, writer_main, gwavi))
+			!= 0) {
+		gwavi->threaded = 0;
+		(void)sem_destroy(&gwavi->jobs_sem);
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_set_threaded",
+			     "pthread_create() failed", err);
+		return -1;
+	}
 
 	return 0;
 }
 
 /**
- * This function should be called when the program is done adding video and/or
- * audio frames to the AVI file. It frees memory allocated for gwavi_open() for
- * the main gwavi_t structure. It also properly closes the output file.
+ * This function switches gwavi to parallel mode, where gwavi_add_frame(),
+ * gwavi_add_framev(), gwavi_add_audio() and gwavi_add_audiov() can be called
+ * concurrently from several threads which all write to the file at the same
+ * time, for instance one per encoder.
+ *
+ * Each call reserves the byte range and the index entry of its chunk by
+ * advancing a cursor holding the chunk count in its high 32 bits and the byte
+ * count in its low 32 bits with a compare and swap, then writes the chunk
+ * there with one pwritev(), without waiting for the other calls. Chunks and
+ * index entries are laid out in reservation order. Since the index is
+ * preallocated, nothing is allocated while adding chunks. The cursor never
+ * moves past its limits: adding fails with GWAVI_EFULL once max_chunks chunks
+ * are reserved or the file would exceed the 4 GB reached by the 32 bits byte
+ * count, which is also the AVI limit.
+ *
+ * The other functions adding chunks, gwavi_reopen(), gwavi_reserve(),
+ * gwavi_set_realtime(), gwavi_set_threaded() and gwavi_set_allocator() are
+ * not available in parallel mode.
+ *
+ * Parallel mode is left by calling this function with max_chunks set to 0,
+ * or by gwavi_close(), once all the threads adding chunks are done. The index
+ * is written by gwavi_close().
  *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param max_chunks Maximum number of video frames and audio chunks added in
+ * parallel mode. 0 leaves parallel mode.
  *
- * @return 0 on success, -1 on error.
+ * @return 0 on success, -1 on error. When leaving parallel mode, -1 means that
+ * some chunks could not be written.
  */
 int
-gwavi_close(struct gwavi_t *gwavi)
+gwavi_set_parallel(struct gwavi_t *gwavi, unsigned int max_chunks)
 {
-	long t;
+	unsigned long long end;
+	unsigned int i, count;
 
 	if (!gwavi) {
-		(void)fputs("gwavi argument cannot be NULL", stderr);
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_parallel",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
 
-	if ((t = ftell(gwavi->out)) == -1)
-		goto ftell_failed;
-	if (fseek(gwavi->out, gwavi->marker, SEEK_SET) == -1)
-		goto fseek_failed;
-	if (write_int(gwavi->out, (unsigned int)(t - gwavi->marker - 4)) == -1) {
-		(void)fprintf(stderr, "gwavi_close: write_int() failed\n");
-		return -1;
+	if (max_chunks == 0) {
+		if (!gwavi->parallel)
+			return 0;
+		gwavi->parallel = 0;
+
+		count = (unsigned int)(gwavi->parallel_cursor >> 32);
+		end = (unsigned long long)gwavi->parallel_base;
+		for (i = 0; i < count; i++)
+			end += 8 +
+				gwavi->offsets[gwavi->parallel_first + (int)i].size;
+		gwavi->offsets_ptr = gwavi->parallel_first + (int)count;
+		gwavi->offset_count += (int)count;
+		gwavi->movi_offset += (unsigned int)(end -
+			(unsigned long long)gwavi->parallel_base);
+		if (fseek(gwavi->out, (long)end, SEEK_SET) == -1) {
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_parallel",
+				     "fseek() failed", errno);
+			return -1;
+		}
+		if (gwavi->parallel_failed) {
+			gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_parallel",
+				     "some chunks could not be written", 0);
+			return -1;
+		}
+		return 0;
 	}
-	if (fseek(gwavi->out,t,SEEK_SET) == -1)
-		goto fseek_failed;
 
-	if (write_index(gwavi->out, gwavi->offset_count, gwavi->offsets) == -1) {
-		(void)fprintf(stderr, "gwavi_close: write_index() failed\n");
+	if (gwavi->parallel) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parallel",
+			     "already in parallel mode", 0);
 		return -1;
 	}
-
-	free(gwavi->offsets);
-
-	/* reset some avi header fields */
-	gwavi->avi_header.number_of_frames = gwavi->stream_header_v.data_length;
-
-	if ((t = ftell(gwavi->out)) == -1)
-		goto ftell_failed;
-	if (fseek(gwavi->out, 12, SEEK_SET) == -1)
-		goto fseek_failed;
-	if (write_avi_header_chunk(gwavi) == -1) {
-		(void)fprintf(stderr, "gwavi_close: write_avi_header_chunk() "
-			      "failed\n");
+	if (gwavi->realtime) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parallel",
+			     "not available in realtime mode", 0);
 		return -1;
 	}
-	if (fseek(gwavi->out, t, SEEK_SET) == -1)
-		goto fseek_failed;
-
-	if ((t = ftell(gwavi->out)) == -1)
-		goto ftell_failed;
-	if (fseek(gwavi->out, 4, SEEK_SET) == -1)
-		goto fseek_failed;
-	if (write_int(gwavi->out, (unsigned int)(t - 8)) == -1) {
-		(void)fprintf(stderr, "gwavi_close: write_int() failed\n");
+	if (gwavi->parkable || gwavi->tee || gwavi->live_interval ||
+	    gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_parallel",
+			     "not available to parkable handles, with sinks or "
+			     "in live or fixed frame size mode", 0);
 		return -1;
 	}
-	if (fseek(gwavi->out, t, SEEK_SET) == -1)
-		goto fseek_failed;
-
-	if (gwavi->stream_format_v.palette != 0)
-		free(gwavi->stream_format_v.palette);
+	if (check_writable(gwavi, "gwavi_set_parallel") == -1)
+		return -1;
+	if (gwavi_reserve(gwavi, (unsigned int)gwavi->offsets_ptr + max_chunks)
+			== -1)
+		return -1;
 
-	if (fclose(gwavi->out) == EOF) {
-		perror("gwavi_close (fclose)");
+	if (fflush(gwavi->out) == EOF) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_parallel",
+			     "fflush() failed", errno);
+		return -1;
+	}
+	if ((gwavi->parallel_base = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_parallel",
+			     "ftell() failed", errno);
 		return -1;
 	}
-	free(gwavi);
 
-	return 0;
+	/* the file, index included, must stay below 4 GB */
+	end = (unsigned long long)gwavi->parallel_base + 8 +
+		16 * (unsigned long long)gwavi->offsets_len;
+	if (end >= 0xffffffffUL) {
+		gwavi_report(gwavi, GWAVI_EFULL, "gwavi_set_parallel",
+			     "maximum file size reached", 0);
+		return -1;
+	}
+	gwavi->parallel_limit = 0xffffffffUL - (unsigned long)end;
 
-ftell_failed:
-	perror("gwavi_close: (ftell)");
-	return -1;
+	gwavi->parallel_fd = fileno(gwavi->out);
+	gwavi->parallel_first = gwavi->offsets_ptr;
+	gwavi->parallel_cursor = 0;
+	gwavi->parallel_full = 0;
+	gwavi->parallel_failed = 0;
+	gwavi->parallel = 1;
 
-fseek_failed:
-	perror("gwavi_close (fseek)");
-	return -1;
+	return 0;
 }
 
 /**
- * This function allows you to reset the framerate. In a standard use case, you
- * should not need to call it. However, if you need to, you can call it to reset
- * the framerate after you are done adding frames to your AVI file and before
- * you call gwavi_close().
+ * This function sets the number of frames gwavi_add_frame_seq() can hold
+ * while waiting for the frames before them: a frame can be added up to window
+ * - 1 frames ahead of its turn. With the default window of 0, frames must be
+ * added in order and a frame ahead of its turn makes the missing ones
+ * skipped.
+ *
+ * The window can only be changed while it holds no frame.
  *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param fps Number of frames per second of your video.
+ * @param window Number of frames of the reorder window.
  *
  * @return 0 on success, -1 on error.
  */
 int
-gwavi_set_framerate(struct gwavi_t *gwavi, unsigned int fps)
+gwavi_set_reorder_window(struct gwavi_t *gwavi, unsigned int window)
 {
+	struct gwavi_reorder_slot_t *reorder = NULL;
+
 	if (!gwavi) {
-		(void)fputs("gwavi argument cannot be NULL", stderr);
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_reorder_window",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
-	gwavi->stream_header_v.data_rate = fps;
-	gwavi->avi_header.time_delay = (10000000 / fps);
+	if (gwavi->reorder_held > 0) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_reorder_window",
+			     "frames are waiting in the reorder window", 0);
+		return -1;
+	}
+
+	if (window > 0) {
+		reorder = (struct gwavi_reorder_slot_t *)gwavi_malloc(gwavi,
+				window * sizeof(struct gwavi_reorder_slot_t));
+		if (!reorder) {
+			gwavi_report(gwavi, GWAVI_ENOMEM,
+				     "gwavi_set_reorder_window",
+				     "could not allocate memory for reorder "
+				     "window", 0);
+			return -1;
+		}
+		(void)memset(reorder, 0,
+			     window * sizeof(struct gwavi_reorder_slot_t));
+	}
+
+	gwavi_free(gwavi, gwavi->reorder);
+	gwavi->reorder = reorder;
+	gwavi->reorder_window = window;
 
 	return 0;
 }
 
 /**
- * This function allows you to reset the video codec. In a standard use case,
- * you should not need to call it. However, if you need to, you can call it to
- * reset the video codec after you are done adding frames to your AVI file and
- * before you call gwavi_close().
+ * This function makes gwavi serialize the idx1 entry of each chunk as it is
+ * added, into memory allocated alongside the index (16 bytes per chunk
+ * instead of 4). gwavi_close() then writes the index with a single fwrite()
+ * instead of serializing it, which keeps the time it takes to close a file
+ * from growing with its length.
+ *
+ * It can be called at any time: the entries of the chunks already added are
+ * serialized right away.
  *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param fourcc FourCC representing the codec of the video encoded stream. a
+ * @param enable 1 to stage the index, 0 to go back to serializing it when
+ * closing the file.
  *
  * @return 0 on success, -1 on error.
  */
 int
-gwavi_set_codec(struct gwavi_t *gwavi, const char *fourcc)
+gwavi_set_index_staging(struct gwavi_t *gwavi, int enable)
 {
+	unsigned int offset = 4;
+	int i;
+
 	if (!gwavi) {
-		(void)fputs("gwavi argument cannot be NULL", stderr);
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_index_staging",
+			     "gwavi argument cannot be NULL", 0);
 		return -1;
 	}
-	if (check_fourcc(fourcc) != 0)
-		(void)fprintf(stderr, "WARNING: given fourcc does not seem to "
-			      "be valid: %s\n", fourcc);
+	if (check_sequential(gwavi, "gwavi_set_index_staging") == -1)
+		return -1;
 
-	memcpy(gwavi->stream_header_v.codec, fourcc, 4);
-	gwavi->stream_format_v.compression_type =
-		((unsigned int)fourcc[3] << 24) +
-		((unsigned int)fourcc[2] << 16) +
-		((unsigned int)fourcc[1] << 8) +
-		((unsigned int)fourcc[0]);
+	if (!enable) {
+		gwavi_free(gwavi, gwavi->index);
+		gwavi->index = NULL;
+		return 0;
+	}
+	if (gwavi->index)
+		return 0;
+	if (gwavi->fixed_size) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_index_staging",
+			     "no index to stage in fixed frame size mode", 0);
+		return -1;
+	}
+
+	gwavi->index = (unsigned char *)gwavi_malloc(gwavi,
+			(size_t)gwavi->offsets_len * 16);
+	if (!gwavi->index) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_set_index_staging",
+			     "could not allocate memory for staged index", 0);
+		return -1;
+	}
+	for (i = 0; i < gwavi->offsets_ptr; i++) {
+		put_index_entry(gwavi->index + i * 16, &gwavi->offsets[i],
+				offset);
+		offset += gwavi->offsets[i].size + 8;
+	}
 
 	return 0;
 }
 
 /**
- * This function allows you to reset the video size. In a standard use case, you
- * should not need to call it. However, if you need to, you can call it to reset
- * the video height and width set in the AVI file after you are done adding
- * frames to your AVI file and before you call gwavi_close().
+ * This function enables fixed frame size mode, for uncompressed video whose
+ * frames all have the same size. No index entry is stored while recording:
+ * the index is computed from the number of frames when the file is
+ * completed, so memory use does not grow with the duration.
  *
- * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param width Width of a frame.
- * @param height Height of a frame.
+ * It must be called before the first chunk, on a file with a single video
+ * stream. Every frame must then be frame_size bytes long, and no audio nor
+ * streamed frame can be added.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param frame_size Size of every video frame, 0 to go back to storing the
+ * index.
  *
  * @return 0 on success, -1 on error.
  */
 int
-gwavi_set_size(struct gwavi_t *gwavi, unsigned int width, unsigned int height)
+gwavi_set_fixed_frame_size(struct gwavi_t *gwavi, size_t frame_size)
 {
-	unsigned int size = (width * height * 3);
-
 	if (!gwavi) {
-		(void)fputs("gwavi argument cannot be NULL", stderr);
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_fixed_frame_size",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (check_writable(gwavi, "gwavi_set_fixed_frame_size") == -1)
+		return -1;
+	gwavi_fd_release(gwavi);
+	if (gwavi->offsets_ptr > 0 || gwavi->reorder_held > 0) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_fixed_frame_size",
+			     "must be set before the first chunk", 0);
+		return -1;
+	}
+	if (frame_size && (gwavi->avi_header.data_streams > 1 ||
+			   gwavi->index)) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_fixed_frame_size",
+			     "only available to a single video stream without "
+			     "staged index", 0);
 		return -1;
 	}
 
-	gwavi->avi_header.data_rate = size;
-	gwavi->avi_header.width = width;
-	gwavi->avi_header.height = height;
-	gwavi->avi_header.buffer_size = size;
-	gwavi->stream_header_v.buffer_size = size;
-	gwavi->stream_format_v.width = width;
-	gwavi->stream_format_v.height = height;
-	gwavi->stream_format_v.image_size = size;
+	gwavi->fixed_size = frame_size;
 
 	return 0;
 }
-
@@ -7,6 +7,24 @@
  */
 
 #include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "gwavi.h"
+#include "queue.h"
+
+/* bytes reserved in front of a pooled frame for the chunk id and size */
+#define GWAVI_FRAME_HEADROOM	8
+/* bytes reserved after a pooled frame for the 4 bytes alignment padding */
+#define GWAVI_FRAME_TAILROOM	3
+/* maximum number of idle frame buffers kept around for recycling */
+#define GWAVI_FRAME_POOL_MAX	8
+/* number of errors the realtime error ring can hold, must be a power of 2 */
+#define GWAVI_ERROR_RING_SIZE	64
+/* most slots gwavi_add_frame_ts() fills with empty chunks in one call */
+#define GWAVI_TS_MAX_GAP	65536
+/* most idx1 entries of 16 bytes a 32 bits chunk size can describe */
+#define GWAVI_MAX_INDEX_ENTRIES	(0xffffffffU / 16)
 
 /* structures */
 struct gwavi_header_t
@@ -76,20 +94,177 @@ struct gwavi_stream_format_a_t
 	unsigned short size;
 };
 
+/* streams a file can hold, numbered with two digits in chunk ids */
+#define GWAVI_MAX_STREAMS	16
+
+/* "dwFlags" of the idx1 entries */
+#define GWAVI_IF_KEYFRAME	0x10
+
+/**
+ * Stream of the file. Stream 0 is the video of gwavi_open() and stream 1 its
+ * audio, the others are added with gwavi_add_video_stream() and
+ * gwavi_add_audio_stream().
+ */
+struct gwavi_stream_t
+{
+	struct gwavi_stream_header_t header;
+	struct gwavi_stream_format_v_t format_v;	/* video streams */
+	struct gwavi_stream_format_a_t format_a;	/* audio streams */
+	int audio;		/* set for audio streams */
+	char chunk_id[5];	/* "##dc" or "##wb" */
+};
+
+/* idx1 entry of a chunk, see put_index_entry() */
+struct gwavi_index_entry_t
+{
+	unsigned int size;	/* padded chunk size */
+	unsigned char stream;	/* stream number */
+	unsigned char audio;	/* "##wb" chunk, "##dc" otherwise */
+	unsigned short flags;	/* GWAVI_IF_* */
+};
+
+/**
+ * Frame buffer handed out by gwavi_frame_alloc(). The memory handed to the
+ * caller starts GWAVI_FRAME_HEADROOM bytes after the end of this structure and
+ * is followed by capacity + GWAVI_FRAME_TAILROOM bytes.
+ */
+struct gwavi_frame_buf_t
+{
+	struct gwavi_frame_buf_t *next;
+	size_t capacity;
+};
+
+/*
+ * payload parts of a chunk written in parallel mode: the chunk header and
+ * padding take the two other entries of the 16 buffers POSIX guarantees
+ * pwritev() accepts
+ */
+#define GWAVI_PARALLEL_IOV_MAX	14
+
+/* frame held in the reorder window until its turn comes */
+struct gwavi_reorder_slot_t
+{
+	unsigned char *frame;	/* copy of the frame, NULL if the slot is free */
+	size_t len;
+};
+
+/* streams chunks are submitted to in threaded mode */
+#define GWAVI_STREAM_VIDEO	0
+#define GWAVI_STREAM_AUDIO	1
+
+/* state of a handle attached to a pool */
+#define GWAVI_POOL_IDLE		0	/* no job to write */
+#define GWAVI_POOL_READY	1	/* waiting for a worker */
+#define GWAVI_POOL_RUNNING	2	/* a worker is writing its jobs */
+
+/* jobs a pool worker writes for a handle before moving to the next one */
+#define GWAVI_POOL_BATCH	16
+/* most handles a pool worker takes from the ready list at once */
+#define GWAVI_POOL_FILES	8
+
+/**
+ * Chunk submitted in threaded mode, a copy of its payload following the
+ * structure.
+ */
+struct gwavi_job_t
+{
+	struct gwavi_queue_node_t node;	/* must be first */
+	struct gwavi_job_t *held;	/* next job waiting for its turn */
+	int stream;		/* GWAVI_STREAM_*, -1 to stop the writer */
+	unsigned int seq;	/* submission order within the stream */
+	size_t len;
+};
+
 struct gwavi_t
 {
 	FILE *out;
-	struct gwavi_header_t avi_header;
-	struct gwavi_stream_header_t stream_header_v;
-	struct gwavi_stream_format_v_t stream_format_v;
-	struct gwavi_stream_header_t stream_header_a;
-	struct gwavi_stream_format_a_t stream_format_a;
+	struct gwavi_header_t avi_header;	/* data_streams streams used */
+	struct gwavi_stream_t streams[GWAVI_MAX_STREAMS];
 	long marker;
 	int offsets_ptr;
 	int offsets_len;
 	long offsets_start;
-	unsigned int *offsets;
+	struct gwavi_index_entry_t *offsets;
 	int offset_count;
+	unsigned int movi_offset;	/* idx1 offset of the next chunk */
+	/* idx1 entries serialized as chunks are added, see
+	 * gwavi_set_index_staging(), offsets_len entries large */
+	unsigned char *index;
+	struct gwavi_frame_buf_t *frame_pool;	/* idle frame buffers */
+	unsigned int frame_pool_len;
+	int in_chunk;		/* set between gwavi_frame_begin() and _end() */
+	long chunk_marker;	/* position of the size of the streamed chunk */
+	size_t chunk_len;	/* bytes appended to the streamed chunk so far */
+	size_t chunk_expected;	/* announced chunk length, 0 if unknown */
+	int error;		/* code of the last error */
+	void (*log)(void *ctx, const struct gwavi_error_t *error);
+	void *log_ctx;
+	int log_level;		/* most verbose level passed to log */
+	struct gwavi_allocator_t alloc;	/* for the index and frame buffers */
+	struct gwavi_allocator_t handle_alloc;	/* for this structure */
+	unsigned int frames_out;	/* buffers handed out by _frame_alloc() */
+	int realtime;		/* set by gwavi_set_realtime() */
+	size_t fixed_size;	/* set by gwavi_set_fixed_frame_size() */
+	int ts_started;		/* gwavi_add_frame_ts() called on this file */
+	double ts_origin;	/* timestamp of the first frame */
+	unsigned int ts_next;	/* slot of the next frame */
+	/* frames added ahead of their turn, indexed by sequence % window */
+	struct gwavi_reorder_slot_t *reorder;
+	unsigned int reorder_window;	/* set by gwavi_set_reorder_window() */
+	unsigned int reorder_next;	/* sequence number of the next frame */
+	unsigned int reorder_held;	/* frames in the window */
+	int threaded;		/* set by gwavi_set_threaded() */
+	pthread_t writer;
+	struct gwavi_queue_t jobs;
+	sem_t jobs_sem;		/* number of jobs in the queue */
+	struct gwavi_job_t stop_job;
+	volatile unsigned int jobs_queued;	/* submitted, not written yet */
+	unsigned int jobs_max;
+	unsigned int seq_next[2];	/* next number handed out per stream */
+	unsigned int seq_write[2];	/* next number to write per stream */
+	struct gwavi_job_t *held[2];	/* jobs ahead of their turn, sorted */
+	volatile int writer_failed;
+	/* the fields below are protected by the lock of the pool */
+	struct gwavi_pool_t *pool;	/* see gwavi_pool_attach() */
+	struct gwavi_t *pool_next;	/* next handle with jobs to write */
+	int pool_state;		/* GWAVI_POOL_* */
+	/* jobs pushed and not written yet, only decreased with the pool locked */
+	volatile unsigned int pool_jobs;
+	int parallel;		/* set by gwavi_set_parallel() */
+	int parallel_fd;	/* file descriptor of out */
+	long parallel_base;	/* file position of the first parallel chunk */
+	int parallel_first;	/* offsets entry of the first parallel chunk */
+	unsigned long parallel_limit;	/* bytes the parallel chunks can use */
+	/* chunks reserved in the high 32 bits, bytes in the low 32 bits */
+	volatile unsigned long long parallel_cursor;
+	volatile int parallel_full;
+	volatile int parallel_failed;
+	/* fd budget, the links being protected by the lock of budget.c */
+	char *filename;		/* current file, to reopen it once parked */
+	int parkable;		/* set by gwavi_set_parkable() */
+	int parked;		/* out closed until the next write */
+	long parked_pos;	/* where to go on writing once reopened */
+	pthread_mutex_t park_lock;	/* held while using out, see budget.c */
+	int lru_linked;		/* in the least recently used list */
+	struct gwavi_t *lru_prev;	/* more recently used */
+	struct gwavi_t *lru_next;	/* less recently used */
+	struct gwavi_tee_t *tee;	/* sinks, out writing through it */
+	/* live mode, see live.c */
+	unsigned int live_interval;	/* ms between refreshes, 0 if not live */
+	unsigned long live_last;	/* time of the last refresh in ms */
+	struct gwavi_live_index_t *live_index;	/* shared memory, or NULL */
+	size_t live_size;
+	int live_fd;
+	unsigned int live_published;	/* entries in live_index */
+	unsigned int live_offset;	/* movi offset of the next one */
+	char live_name[64];
+	void (*close_cb)(void *ctx, int status);	/* gwavi_close_async() */
+	void *close_ctx;
+	/* single producer, single consumer ring of errors in realtime mode */
+	struct gwavi_error_t errors[GWAVI_ERROR_RING_SIZE];
+	volatile unsigned int errors_head;
+	volatile unsigned int errors_tail;
+	unsigned int errors_dropped;
 };
 
 struct gwavi_audio_t
@@ -100,6 +275,47 @@ struct gwavi_audio_t
 };
 
 
+/* memory allocation, see alloc.c */
+struct gwavi_t *gwavi_alloc_handle(void);
+void gwavi_free_handle(struct gwavi_t *gwavi);
+void *gwavi_malloc(struct gwavi_t *gwavi, size_t size);
+void *gwavi_realloc(struct gwavi_t *gwavi, void *ptr, size_t size);
+void gwavi_free(struct gwavi_t *gwavi, void *ptr);
+void gwavi_default_allocator(struct gwavi_allocator_t *alloc);
+
+/* I/O worker pools, see pool.c */
+void gwavi_pool_schedule(struct gwavi_t *gwavi);
+void gwavi_pool_leave(struct gwavi_t *gwavi);
+void gwavi_run_jobs(struct gwavi_t *gwavi, unsigned int count);
+
+/* file descriptor budget, see budget.c */
+void gwavi_fd_opened(struct gwavi_t *gwavi);
+void gwavi_fd_forget(struct gwavi_t *gwavi);
+int gwavi_fd_has_file(struct gwavi_t *gwavi);
+int gwavi_fd_resume(struct gwavi_t *gwavi, const char *caller);
+void gwavi_fd_release(struct gwavi_t *gwavi);
+
+/* live mode, see live.c */
+int gwavi_live_tick(struct gwavi_t *gwavi);
+void gwavi_live_reset(struct gwavi_t *gwavi);
+void gwavi_live_stop(struct gwavi_t *gwavi);
+
+/* placement, see place.c */
+size_t gwavi_place_path_len(const struct gwavi_place_t *place);
+
+/* diagnostics, see log.c */
+void gwavi_log_init(struct gwavi_t *gwavi);
+void gwavi_log(struct gwavi_t *gwavi, int level, int code, const char *where,
+	       const char *what, const char *detail, int sys_errno);
+
+#define gwavi_report(gwavi, code, where, what, sys_errno) \
+	gwavi_log((gwavi), GWAVI_LOG_ERROR, (code), (where), (what), NULL, \
+		  (sys_errno))
+#define gwavi_warn(gwavi, code, where, what) \
+	gwavi_log((gwavi), GWAVI_LOG_WARNING, (code), (where), (what), NULL, 0)
+#define gwavi_warn_detail(gwavi, code, where, what, detail) \
+	gwavi_log((gwavi), GWAVI_LOG_WARNING, (code), (where), (what), \
+		  (detail), 0)
 
 #endif /* ndef GWAVI_PRIVATE_H */
 
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Live mode: the file being recorded can be played while it grows.
+ *
+ * When the refresh interval has elapsed, the next chunk written updates the
+ * RIFF and movi sizes and the AVI headers to cover what is in the file, and
+ * publishes the new idx1 entries to a POSIX shared memory object. The
+ * entries follow a struct gwavi_live_index_t whose seq field is a seqlock:
+ * it is odd while the object is being updated, so that a reader copying the
+ * index retries when it changed meanwhile.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for shm_open() and clock_gettime() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+#include "avi-utils.h"
+#include "fileio.h"
+#include "atomic.h"
+
+/*
+ * Return a monotonic time in milliseconds.
+ */
+static unsigned long
+now_ms(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long)ts.tv_sec * 1000UL +
+		(unsigned long)ts.tv_nsec / 1000000UL;
+}
+
+/*
+ * Map the shared memory object with room for capacity entries. Return 0 on
+ * success, -1 on error.
+ */
+static int
+map_index(struct gwavi_t *gwavi, unsigned int capacity, const char *caller)
+{
+	struct gwavi_live_index_t *index;
+	size_t size = sizeof(struct gwavi_live_index_t) + (size_t)capacity * 16;
+
+	if (ftruncate(gwavi->live_fd, (off_t)size) == -1) {
+		gwavi_report(gwavi, GWAVI_ESYS, caller, "ftruncate() failed",
+			     errno);
+		return -1;
+	}
+	index = (struct gwavi_live_index_t *)mmap(NULL, size,
+						  PROT_READ | PROT_WRITE,
+						  MAP_SHARED, gwavi->live_fd,
+						  0);
+	if (index == (struct gwavi_live_index_t *)MAP_FAILED) {
+		gwavi_report(gwavi, GWAVI_ESYS, caller, "mmap() failed", errno);
+		return -1;
+	}
+
+	if (gwavi->live_index)
+		(void)munmap(gwavi->live_index, gwavi->live_size);
+	gwavi->live_index = index;
+	gwavi->live_size = size;
+	index->capacity = capacity;
+
+	return 0;
+}
+
+/*
+ * Publish the entries added since the last refresh to the shared memory
+ * object. Return 0 on success, -1 on error.
+ */
+static int
+publish_index(struct gwavi_t *gwavi)
+{
+	struct gwavi_live_index_t *index = gwavi->live_index;
+	const struct gwavi_index_entry_t *entry;
+	struct gwavi_index_entry_t fixed;
+	unsigned char *dst;
+	unsigned int i, capacity, count = (unsigned int)gwavi->offset_count;
+
+	if (count > index->capacity) {
+		/* no offsets table grows in fixed frame size mode */
+		capacity = (unsigned int)gwavi->offsets_len;
+		if (capacity < count)
+			capacity = count + 1024;
+		if (map_index(gwavi, capacity, "gwavi_set_live") == -1)
+			return -1;
+		index = gwavi->live_index;
+	}
+
+	/* in fixed frame size mode, all the entries are alike */
+	fixed.size = (unsigned int)(gwavi->fixed_size + 3) & ~3U;
+	fixed.stream = 0;
+	fixed.audio = 0;
+	fixed.flags = GWAVI_IF_KEYFRAME;
+
+	index->seq++;
+	gwavi_barrier();
+	dst = (unsigned char *)(index + 1);
+	for (i = gwavi->live_published; i < count; i++) {
+		entry = gwavi->fixed_size ? &fixed : &gwavi->offsets[i];
+		put_index_entry(dst + i * 16, entry, gwavi->live_offset);
+		gwavi->live_offset += entry->size + 8;
+	}
+	index->count = count;
+	index->frames = gwavi->streams[0].header.data_length;
+	index->movi = (unsigned int)gwavi->marker + 4;
+	gwavi_barrier();
+	index->seq++;
+	gwavi->live_published = count;
+
+	return 0;
+}
+
+/*
+ * Update the sizes and headers of the file to cover what was written so far,
+ * then publish the index. Return 0 on success, -1 on error.
+ */
+static int
+refresh(struct gwavi_t *gwavi)
+{
+	long t;
+
+	/* the chunks must be in the file before the sizes cover them */
+	if (fflush(gwavi->out) == EOF)
+		goto fflush_failed;
+	if ((t = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_live",
+			     "ftell() failed", errno);
+		return -1;
+	}
+
+	gwavi->avi_header.number_of_frames =
+		gwavi->streams[0].header.data_length;
+	if (fseek(gwavi->out, 12, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_avi_header_chunk(gwavi) == -1)
+		goto write_failed;
+	if (fseek(gwavi->out, gwavi->marker, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_int(gwavi->out, (unsigned int)(t - gwavi->marker - 4)) == -1)
+		goto write_failed;
+	/* no idx1 yet, the RIFF list ends with the movi list */
+	if (fseek(gwavi->out, 4, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (write_int(gwavi->out, (unsigned int)(t - 8)) == -1)
+		goto write_failed;
+	if (fseek(gwavi->out, t, SEEK_SET) == -1)
+		goto fseek_failed;
+	if (fflush(gwavi->out) == EOF)
+		goto fflush_failed;
+
+	if (gwavi->live_index)
+		return publish_index(gwavi);
+
+	return 0;
+
+fflush_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_live", "fflush() failed",
+		     errno);
+	return -1;
+
+fseek_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_live", "fseek() failed",
+		     errno);
+	return -1;
+
+write_failed:
+	gwavi_report(gwavi, GWAVI_EIO, "gwavi_set_live",
+		     "could not update headers", 0);
+	return -1;
+}
+
+/*
+ * Refresh the file if the interval elapsed since the last refresh. Called
+ * once a chunk is written, from the thread writing it. Return 0 on success,
+ * -1 on error.
+ */
+int
+gwavi_live_tick(struct gwavi_t *gwavi)
+{
+	unsigned long now = now_ms();
+
+	if (now - gwavi->live_last < gwavi->live_interval)
+		return 0;
+	gwavi->live_last = now;
+
+	return refresh(gwavi);
+}
+
+/*
+ * Start publishing the index of a new file from its first entry. The first
+ * chunk written refreshes the file right away.
+ */
+void
+gwavi_live_reset(struct gwavi_t *gwavi)
+{
+	struct gwavi_live_index_t *index = gwavi->live_index;
+
+	gwavi->live_published = 0;
+	gwavi->live_offset = 4;
+	gwavi->live_last = now_ms() - gwavi->live_interval;
+	if (!index)
+		return;
+
+	index->seq++;
+	gwavi_barrier();
+	index->count = 0;
+	index->frames = 0;
+	gwavi_barrier();
+	index->seq++;
+}
+
+/*
+ * Leave live mode, removing the shared memory object.
+ */
+void
+gwavi_live_stop(struct gwavi_t *gwavi)
+{
+	if (gwavi->live_index) {
+		(void)munmap(gwavi->live_index, gwavi->live_size);
+		(void)close(gwavi->live_fd);
+		(void)shm_unlink(gwavi->live_name);
+		gwavi->live_index = NULL;
+	}
+	gwavi->live_interval = 0;
+}
+
+/**
+ * This function enables live mode, so that the file can be played while it
+ * is being recorded. Once interval_ms milliseconds have elapsed since the
+ * last refresh, the next chunk written updates the RIFF and movi sizes, the
+ * number of frames and the stream headers in the file to cover the chunks
+ * written so far.
+ *
+ * When shm_name is given, the index is also published to a POSIX shared
+ * memory object of that name: a struct gwavi_live_index_t followed by count
+ * idx1 entries of 16 bytes, their offsets being relative to the movi field.
+ * gwavi_read_live_index() copies it consistently. The object is removed when
+ * live mode is left or the handle is closed.
+ *
+ * Live mode is enabled in sequential mode and is not available in parallel
+ * or realtime mode; once enabled, it goes on in threaded mode.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param interval_ms Minimum time between refreshes, 0 to leave live mode.
+ * @param shm_name Name of the shared memory object, such as "/camera-1", or
+ * NULL not to publish the index.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_set_live(struct gwavi_t *gwavi, unsigned int interval_ms,
+	       const char *shm_name)
+{
+	if (!gwavi) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_live",
+			     "gwavi argument cannot be NULL", 0);
+		return -1;
+	}
+	if (gwavi->threaded || gwavi->parallel) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_live",
+			     "not available in threaded or parallel mode", 0);
+		return -1;
+	}
+
+	gwavi_live_stop(gwavi);
+	if (interval_ms == 0)
+		return 0;
+	/* refreshing the headers would break the bounds of realtime mode */
+	if (gwavi->realtime) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_set_live",
+			     "not available in realtime mode", 0);
+		return -1;
+	}
+
+	if (shm_name) {
+		if (strlen(shm_name) >= sizeof(gwavi->live_name)) {
+			gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_set_live",
+				     "shared memory name too long", 0);
+			return -1;
+		}
+		(void)strcpy(gwavi->live_name, shm_name);
+		gwavi->live_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC,
+					  0644);
+		if (gwavi->live_fd == -1) {
+			gwavi_report(gwavi, GWAVI_ESYS, "gwavi_set_live",
+				     "shm_open() failed", errno);
+			return -1;
+		}
+		if (map_index(gwavi, (unsigned int)gwavi->offsets_len,
+			      "gwavi_set_live") == -1) {
+			(void)close(gwavi->live_fd);
+			(void)shm_unlink(shm_name);
+			return -1;
+		}
+	}
+
+	gwavi->live_interval = interval_ms;
+	gwavi_live_reset(gwavi);
+
+	return 0;
+}
+
+/**
+ * This function copies the index published by a handle in live mode, for a
+ * reader playing the file while it is being recorded. It does not block the
+ * writer, and retries when the index changes while being copied.
+ *
+ * @param shm_name Name of the shared memory object given to
+ * gwavi_set_live().
+ * @param entries Buffer receiving idx1 entries of 16 bytes.
+ * @param max_entries Number of entries entries can hold.
+ * @param movi Receives the file offset the entry offsets are relative to if
+ * not NULL.
+ *
+ * @return Number of entries copied, -1 on error.
+ */
+int
+gwavi_read_live_index(const char *shm_name, unsigned char *entries,
+		      unsigned int max_entries, unsigned int *movi)
+{
+	struct gwavi_live_index_t *index = NULL;
+	size_t size = 0;
+	unsigned int seq, count, base;
+	struct stat st;
+	int fd;
+
+	if (!shm_name || !entries) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_read_live_index",
+			     "shm_name and/or entries argument cannot be NULL",
+			     0);
+		return -1;
+	}
+	if ((fd = shm_open(shm_name, O_RDONLY, 0)) == -1) {
+		gwavi_report(NULL, GWAVI_ESYS, "gwavi_read_live_index",
+			     "shm_open() failed", errno);
+		return -1;
+	}
+
+	for (;;) {
+		if (!index || size < sizeof(struct gwavi_live_index_t) +
+		    (size_t)index->capacity * 16) {
+			/* grown by the writer, or not mapped yet */
+			if (index)
+				(void)munmap(index, size);
+			index = NULL;
+			if (fstat(fd, &st) == -1 || (size_t)st.st_size <
+			    sizeof(struct gwavi_live_index_t)) {
+				gwavi_report(NULL, GWAVI_ESYS,
+					     "gwavi_read_live_index",
+					     "invalid shared memory object",
+					     errno);
+				(void)close(fd);
+				return -1;
+			}
+			size = (size_t)st.st_size;
+			index = (struct gwavi_live_index_t *)mmap(NULL, size,
+					PROT_READ, MAP_SHARED, fd, 0);
+			if (index == (struct gwavi_live_index_t *)MAP_FAILED) {
+				gwavi_report(NULL, GWAVI_ESYS,
+					     "gwavi_read_live_index",
+					     "mmap() failed", errno);
+				(void)close(fd);
+				return -1;
+			}
+			continue;
+		}
+
+		seq = index->seq;
+		gwavi_barrier();
+		if (seq & 1) {
+			(void)sched_yield();
+			continue;
+		}
+		count = index->count;
+		if (count > index->capacity)
+			continue;
+		if (count > max_entries)
+			count = max_entries;
+		base = index->movi;
+		(void)memcpy(entries, index + 1, (size_t)count * 16);
+		gwavi_barrier();
+		if (index->seq == seq)
+			break;
+	}
+
+	(void)munmap(index, size);
+	(void)close(fd);
+	if (movi)
+		*movi = base;
+
+	return (int)count;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Error reporting for gwavi library.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+#include "atomic.h"
+
+static void log_stderr(void *ctx, const struct gwavi_error_t *error);
+
+/* settings used without gwavi_t structure and inherited by gwavi_open() */
+static void (*default_log)(void *, const struct gwavi_error_t *) = log_stderr;
+static void *default_log_ctx = NULL;
+static int default_log_level = GWAVI_LOG_WARNING;
+
+/*
+ * Default log callback, printing messages on stderr.
+ */
+static void
+log_stderr(void *ctx, const struct gwavi_error_t *error)
+{
+	(void)ctx;
+
+	if (error->sys_errno)
+		(void)fprintf(stderr, "%s%s: %s: %s\n",
+			      error->level == GWAVI_LOG_WARNING ? "WARNING: " : "",
+			      error->where, error->what,
+			      strerror(error->sys_errno));
+	else if (error->detail[0])
+		(void)fprintf(stderr, "%s%s: %s: %s\n",
+			      error->level == GWAVI_LOG_WARNING ? "WARNING: " : "",
+			      error->where, error->what, error->detail);
+	else
+		(void)fprintf(stderr, "%s%s: %s\n",
+			      error->level == GWAVI_LOG_WARNING ? "WARNING: " : "",
+			      error->where, error->what);
+}
+
+/*
+ * Initialize the logging settings of a new gwavi_t structure from the
+ * defaults.
+ */
+void
+gwavi_log_init(struct gwavi_t *gwavi)
+{
+	gwavi->error = GWAVI_OK;
+	gwavi->log = default_log;
+	gwavi->log_ctx = default_log_ctx;
+	gwavi->log_level = default_log_level;
+}
+
+/*
+ * Copy at most sizeof(error->detail) - 1 characters of detail into error.
+ */
+static void
+set_detail(struct gwavi_error_t *error, const char *detail)
+{
+	size_t i;
+
+	for (i = 0; detail && detail[i] && i < sizeof(error->detail) - 1; i++)
+		error->detail[i] = detail[i];
+	error->detail[i] = '\0';
+}
+
+/*
+ * Report an error or a warning. gwavi may be NULL when the message is not
+ * related to a gwavi_t structure. where is the name of the function the
+ * problem occurred in and what its description. Both must be string literals
+ * since, in realtime mode, they are queued as is in the error ring. detail,
+ * which can be NULL, is the fourcc at fault and is copied, so it can point to
+ * any string.
+ */
+void
+gwavi_log(struct gwavi_t *gwavi, int level, int code, const char *where,
+	  const char *what, const char *detail, int sys_errno)
+{
+	void (*log)(void *, const struct gwavi_error_t *) = default_log;
+	void *log_ctx = default_log_ctx;
+	int log_level = default_log_level;
+	struct gwavi_error_t error, *slot;
+	unsigned int head;
+
+	if (gwavi) {
+		if (level == GWAVI_LOG_ERROR)
+			gwavi->error = code;
+		log = gwavi->log;
+		log_ctx = gwavi->log_ctx;
+		log_level = gwavi->log_level;
+	}
+
+	/* the ring is the only way realtime errors get out, whatever the level */
+	if (gwavi && gwavi->realtime) {
+		if (level != GWAVI_LOG_ERROR)
+			return;
+		head = gwavi->errors_head;
+		if (head - gwavi->errors_tail >= GWAVI_ERROR_RING_SIZE) {
+			gwavi->errors_dropped++;
+			return;
+		}
+		slot = &gwavi->errors[head % GWAVI_ERROR_RING_SIZE];
+		slot->level = level;
+		slot->code = code;
+		slot->where = where;
+		slot->what = what;
+		slot->sys_errno = sys_errno;
+		set_detail(slot, detail);
+		/* publish the entry before making it visible to the consumer */
+		gwavi_barrier();
+		gwavi->errors_head = head + 1;
+		return;
+	}
+
+	if (!log || level > log_level)
+		return;
+	error.level = level;
+	error.code = code;
+	error.where = where;
+	error.what = what;
+	error.sys_errno = sys_errno;
+	set_detail(&error, detail);
+	log(log_ctx, &error);
+}
+
+/**
+ * This function returns the code of the last error that occurred on a gwavi_t
+ * structure.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ *
+ * @return One of the gwavi_error_code values, GWAVI_OK if no error occurred.
+ */
+int
+gwavi_last_error(struct gwavi_t *gwavi)
+{
+	if (!gwavi)
+		return GWAVI_EINVAL;
+
+	return gwavi->error;
+}
+
+/**
+ * This function returns a description of an error code.
+ *
+ * @param code One of the gwavi_error_code values.
+ *
+ * @return Statically allocated description of the error.
+ */
+const char *
+gwavi_strerror(int code)
+{
+	switch (code) {
+	case GWAVI_OK:
+		return "no error";
+	case GWAVI_EINVAL:
+		return "invalid argument";
+	case GWAVI_ENOMEM:
+		return "memory allocation failed";
+	case GWAVI_EIO:
+		return "input/output error on the AVI file";
+	case GWAVI_ESTATE:
+		return "operation not allowed in the current state";
+	case GWAVI_EFULL:
+		return "index or queue is full";
+	case GWAVI_ESYS:
+		return "system call failed";
+	default:
+		return "unknown error";
+	}
+}
+
+/**
+ * This function sets the callback errors and warnings are passed to. By
+ * default, they are printed on stderr. Messages less severe than level are
+ * dropped before anything is done with them, so setting level to
+ * GWAVI_LOG_NONE disables logging at no cost. Error codes are recorded
+ * whatever the level is, and so are the errors queued in realtime mode.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-, or NULL to
+ * set the defaults used for messages not related to a gwavi_t structure and
+ * inherited by gwavi_open().
+ * @param log Callback receiving the messages, or NULL to drop them.
+ * @param ctx Opaque pointer passed to log.
+ * @param level Most verbose gwavi_log_level passed to log.
+ */
+void
+gwavi_set_log(struct gwavi_t *gwavi,
+	      void (*log)(void *ctx, const struct gwavi_error_t *error),
+	      void *ctx, int level)
+{
+	if (!gwavi) {
+		default_log = log;
+		default_log_ctx = ctx;
+		default_log_level = level;
+		return;
+	}
+
+	gwavi->log = log;
+	gwavi->log_ctx = ctx;
+	gwavi->log_level = level;
+}
+
+/**
+ * This function retrieves the oldest error recorded in realtime mode. It can be
+ * called from another thread than the one adding chunks, but only from one
+ * thread at a time.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param error Structure filled with the error description.
+ *
+ * @return 1 if an error was retrieved, 0 if there is none, -1 on error.
+ */
+int
+gwavi_pop_error(struct gwavi_t *gwavi, struct gwavi_error_t *error)
+{
+	unsigned int tail;
+
+	if (!gwavi || !error) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_pop_error",
+			     "gwavi and/or error argument cannot be NULL", 0);
+		return -1;
+	}
+
+	tail = gwavi->errors_tail;
+	if (tail == gwavi->errors_head)
+		return 0;
+	/* read the entry only once its publication is visible */
+	gwavi_barrier();
+	*error = gwavi->errors[tail % GWAVI_ERROR_RING_SIZE];
+	gwavi_barrier();
+	gwavi->errors_tail = tail + 1;
+
+	return 1;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Placement policies: a gwavi_place_t spreads the files of segmented
+ * recordings, or of any handle, across several directories, typically one
+ * per disk, so that all of them are written to.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+struct gwavi_place_dir_t
+{
+	char *path;
+	unsigned int open;	/* files picked and not released yet */
+};
+
+struct gwavi_place_t
+{
+	struct gwavi_allocator_t alloc;	/* this structure was allocated with */
+	pthread_mutex_t lock;
+	int policy;		/* enum gwavi_place_policy */
+	unsigned int next;	/* next directory in round robin */
+	unsigned int count;
+	size_t path_len;	/* length of the longest directory */
+	struct gwavi_place_dir_t *dirs;	/* count entries after the structure */
+};
+
+/*
+ * Return the bytes available to unprivileged users in a directory, 0 if it
+ * cannot be told.
+ */
+static unsigned long long
+free_space(const char *path)
+{
+	struct statvfs st;
+
+	if (statvfs(path, &st) == -1)
+		return 0;
+
+	return (unsigned long long)st.f_bavail *
+		(unsigned long long)st.f_frsize;
+}
+
+/*
+ * Return the directory the next file goes to. Called with the lock held.
+ */
+static unsigned int
+choose_dir(struct gwavi_place_t *place)
+{
+	unsigned long long space, best_space = 0;
+	unsigned int i, best = 0;
+
+	switch (place->policy) {
+	case GWAVI_PLACE_LEAST_OPEN:
+		for (i = 1; i < place->count; i++)
+			if (place->dirs[i].open < place->dirs[best].open)
+				best = i;
+		return best;
+	case GWAVI_PLACE_FREE_SPACE:
+		for (i = 0; i < place->count; i++) {
+			/* shared between the files being written there */
+			space = free_space(place->dirs[i].path) /
+				(place->dirs[i].open + 1);
+			if (space > best_space) {
+				best_space = space;
+				best = i;
+			}
+		}
+		return best;
+	default:
+		best = place->next;
+		place->next = (place->next + 1) % place->count;
+		return best;
+	}
+}
+
+/*
+ * Return the room needed for a directory of the placement, its separator
+ * and the terminating nul character, to be added to the length of a file
+ * name.
+ */
+size_t
+gwavi_place_path_len(const struct gwavi_place_t *place)
+{
+	return place->path_len + 2;
+}
+
+/**
+ * This function creates a placement policy spreading files across the given
+ * directories.
+ *
+ * @param dirs Directories, typically on different disks.
+ * @param count Number of directories, at least 1.
+ * @param policy GWAVI_PLACE_ROUND_ROBIN to use the directories in turns,
+ * GWAVI_PLACE_LEAST_OPEN to pick the directory with the fewest files being
+ * written, or GWAVI_PLACE_FREE_SPACE to pick the one with the most free space
+ * per file being written.
+ *
+ * @return Structure to pass to the other gwavi_place functions and to
+ * gwavi_seg_open_placed(), NULL on error.
+ */
+struct gwavi_place_t *
+gwavi_place_create(const char *const *dirs, unsigned int count, int policy)
+{
+	struct gwavi_allocator_t alloc;
+	struct gwavi_place_t *place;
+	size_t size, len;
+	unsigned int i;
+	char *path;
+
+	if (!dirs || count == 0 || policy < GWAVI_PLACE_ROUND_ROBIN ||
+	    policy > GWAVI_PLACE_FREE_SPACE) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_place_create",
+			     "invalid directories or policy", 0);
+		return NULL;
+	}
+
+	/* the directories and their paths follow the structure */
+	size = sizeof(struct gwavi_place_t) +
+		count * sizeof(struct gwavi_place_dir_t);
+	for (i = 0; i < count; i++) {
+		if (!dirs[i]) {
+			gwavi_report(NULL, GWAVI_EINVAL, "gwavi_place_create",
+				     "directory cannot be NULL", 0);
+			return NULL;
+		}
+		size += strlen(dirs[i]) + 1;
+	}
+
+	gwavi_default_allocator(&alloc);
+	place = (struct gwavi_place_t *)alloc.malloc(alloc.ctx, size);
+	if (!place) {
+		gwavi_report(NULL, GWAVI_ENOMEM, "gwavi_place_create",
+			     "could not allocate memory for placement", 0);
+		return NULL;
+	}
+	(void)memset(place, 0, sizeof(struct gwavi_place_t));
+	place->alloc = alloc;
+	place->policy = policy;
+	place->count = count;
+	place->dirs = (struct gwavi_place_dir_t *)(place + 1);
+	path = (char *)(place->dirs + count);
+	for (i = 0; i < count; i++) {
+		len = strlen(dirs[i]);
+		(void)memcpy(path, dirs[i], len + 1);
+		place->dirs[i].path = path;
+		place->dirs[i].open = 0;
+		if (len > place->path_len)
+			place->path_len = len;
+		path += len + 1;
+	}
+	(void)pthread_mutex_init(&place->lock, NULL);
+
+	return place;
+}
+
+/**
+ * This function picks the directory of a new file according to the policy,
+ * and builds its path. The file counts as being written to the directory
+ * until gwavi_place_release() is called.
+ *
+ * @param place Placement created with gwavi_place_create().
+ * @param name Name of the file within the directory.
+ * @param path Buffer receiving the path of the file.
+ * @param size Size of path.
+ *
+ * @return Number of the directory to give to gwavi_place_release(), -1 on
+ * error.
+ */
+int
+gwavi_place_pick(struct gwavi_place_t *place, const char *name, char *path,
+		 size_t size)
+{
+	unsigned int dir;
+
+	if (!place || !name || !path) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_place_pick",
+			     "place, name and/or path argument cannot be NULL",
+			     0);
+		return -1;
+	}
+	if (place->path_len + strlen(name) + 2 > size) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_place_pick",
+			     "path buffer too small", 0);
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&place->lock);
+	dir = choose_dir(place);
+	place->dirs[dir].open++;
+	(void)pthread_mutex_unlock(&place->lock);
+
+	(void)sprintf(path, "%s/%s", place->dirs[dir].path, name);
+
+	return (int)dir;
+}
+
+/**
+ * This function tells a file picked with gwavi_place_pick() is complete.
+ *
+ * @param place Placement created with gwavi_place_create().
+ * @param dir Number returned by gwavi_place_pick().
+ */
+void
+gwavi_place_release(struct gwavi_place_t *place, int dir)
+{
+	if (!place || dir < 0 || (unsigned int)dir >= place->count)
+		return;
+
+	(void)pthread_mutex_lock(&place->lock);
+	place->dirs[dir].open--;
+	(void)pthread_mutex_unlock(&place->lock);
+}
+
+/**
+ * This function frees a placement. The segmented recordings using it must
+ * have been closed.
+ *
+ * @param place Placement created with gwavi_place_create().
+ */
+void
+gwavi_place_destroy(struct gwavi_place_t *place)
+{
+	struct gwavi_allocator_t alloc;
+
+	if (!place)
+		return;
+
+	(void)pthread_mutex_destroy(&place->lock);
+	alloc = place->alloc;
+	alloc.free(alloc.ctx, place);
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * I/O worker pools: a small set of threads writing the chunks submitted to
+ * many handles in threaded mode, instead of one writer thread per handle.
+ *
+ * Handles with jobs to write wait in a FIFO list. A worker takes its share
+ * of the first ones, up to GWAVI_POOL_FILES, writes up to GWAVI_POOL_BATCH
+ * jobs of each and puts those with more back at the end of the list, so that
+ * busy files do not starve the others and the pool lock is taken twice per
+ * round over several files rather than per job. Only one worker at a time
+ * writes the jobs of a handle, which keeps the queue of the handle single
+ * consumer and its chunks in order.
+ *
+ * Submitting a job only counts it with an atomic addition: the pool lock is
+ * taken by the submission that finds the handle without pending jobs, to put
+ * it in the list. The count is only decreased with the lock held, by the
+ * worker that wrote the jobs, which puts the handle back in the list or marks
+ * it idle.
+ */
+
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+#include "atomic.h"
+
+struct gwavi_pool_t
+{
+	struct gwavi_allocator_t alloc;	/* this structure was allocated with */
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signaled when a handle gets ready */
+	pthread_cond_t idle;	/* broadcast when a handle gets idle */
+	struct gwavi_t *ready_head;	/* handles with jobs, oldest first */
+	struct gwavi_t *ready_tail;
+	unsigned int ready_count;	/* handles in the list */
+	unsigned int attached;	/* handles attached */
+	int stop;
+	unsigned int threads;
+	pthread_t *workers;	/* threads entries following the structure */
+};
+
+/*
+ * Append a handle to the list of handles with jobs to write. Called with the
+ * pool locked.
+ */
+static void
+make_ready(struct gwavi_pool_t *pool, struct gwavi_t *gwavi)
+{
+	gwavi->pool_state = GWAVI_POOL_READY;
+	gwavi->pool_next = NULL;
+	if (pool->ready_tail)
+		pool->ready_tail->pool_next = gwavi;
+	else
+		pool->ready_head = gwavi;
+	pool->ready_tail = gwavi;
+	pool->ready_count++;
+	(void)pthread_cond_signal(&pool->work);
+}
+
+/*
+ * Worker thread: write the jobs of the ready handles in turn until the pool
+ * is destroyed.
+ */
+static void *
+worker_main(void *arg)
+{
+	struct gwavi_pool_t *pool = (struct gwavi_pool_t *)arg;
+	struct gwavi_t *batch[GWAVI_POOL_FILES];
+	unsigned int count[GWAVI_POOL_FILES];
+	unsigned int i, n;
+	int idle;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->ready_head && !pool->stop)
+			(void)pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->ready_head)
+			break;
+
+		/* leave the other workers their share of the ready handles */
+		n = (pool->ready_count + pool->threads - 1) / pool->threads;
+		if (n > GWAVI_POOL_FILES)
+			n = GWAVI_POOL_FILES;
+		for (i = 0; i < n; i++) {
+			batch[i] = pool->ready_head;
+			pool->ready_head = batch[i]->pool_next;
+			batch[i]->pool_state = GWAVI_POOL_RUNNING;
+		}
+		if (!pool->ready_head)
+			pool->ready_tail = NULL;
+		pool->ready_count -= n;
+		(void)pthread_mutex_unlock(&pool->lock);
+
+		/* the jobs counted are pushed, or about to be */
+		for (i = 0; i < n; i++) {
+			count[i] = batch[i]->pool_jobs < GWAVI_POOL_BATCH ?
+				batch[i]->pool_jobs : GWAVI_POOL_BATCH;
+			gwavi_run_jobs(batch[i], count[i]);
+		}
+
+		(void)pthread_mutex_lock(&pool->lock);
+		idle = 0;
+		for (i = 0; i < n; i++) {
+			if (gwavi_fetch_sub(&batch[i]->pool_jobs, count[i]) >
+					count[i]) {
+				make_ready(pool, batch[i]);
+			} else {
+				batch[i]->pool_state = GWAVI_POOL_IDLE;
+				idle = 1;
+			}
+		}
+		if (idle)
+			(void)pthread_cond_broadcast(&pool->idle);
+	}
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*
+ * Tell the pool a job was pushed to the queue of a handle. Can be called from
+ * any thread, and only locks the pool when the handle had no pending job.
+ */
+void
+gwavi_pool_schedule(struct gwavi_t *gwavi)
+{
+	struct gwavi_pool_t *pool = gwavi->pool;
+
+	/* otherwise a worker has the handle and will see the job */
+	if (gwavi_fetch_add(&gwavi->pool_jobs, 1) != 0)
+		return;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	make_ready(pool, gwavi);
+	(void)pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the workers to be done with a handle whose producers stopped, and
+ * detach it from its pool.
+ */
+void
+gwavi_pool_leave(struct gwavi_t *gwavi)
+{
+	struct gwavi_pool_t *pool = gwavi->pool;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	while (gwavi->pool_state != GWAVI_POOL_IDLE)
+		(void)pthread_cond_wait(&pool->idle, &pool->lock);
+	pool->attached--;
+	(void)pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Stop and join the first count workers of a pool.
+ */
+static void
+stop_workers(struct gwavi_pool_t *pool, unsigned int count)
+{
+	unsigned int i;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	(void)pthread_cond_broadcast(&pool->work);
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < count; i++)
+		(void)pthread_join(pool->workers[i], NULL);
+}
+
+/**
+ * This function creates a pool of I/O worker threads writing the chunks of
+ * the handles attached to it with gwavi_pool_attach(). A few workers, say one
+ * or two per disk, can serve hundreds of files.
+ *
+ * @param threads Number of worker threads, at least 1.
+ * @param cpus Optional array of threads CPU numbers the workers are pinned
+ * to, -1 leaving a worker unpinned. Other numbers must be below CPU_SETSIZE. Pinning workers to the CPUs of the NUMA
+ * node of a disk controller keeps them close to it. Pass NULL to leave all
+ * the workers unpinned.
+ *
+ * @return Structure to pass to the other gwavi_pool functions, NULL on error.
+ */
+struct gwavi_pool_t *
+gwavi_pool_create(unsigned int threads, const int *cpus)
+{
+	struct gwavi_allocator_t alloc;
+	struct gwavi_pool_t *pool;
+	unsigned int i;
+	int err;
+
+	if (threads == 0) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_pool_create",
+			     "threads must be > 0", 0);
+		return NULL;
+	}
+#ifdef __linux__
+	/* CPU_SET() does not check its argument */
+	for (i = 0; cpus && i < threads; i++) {
+		if (cpus[i] < -1 || cpus[i] >= CPU_SETSIZE) {
+			gwavi_report(NULL, GWAVI_EINVAL, "gwavi_pool_create",
+				     "CPU number out of range", 0);
+			return NULL;
+		}
+	}
+#endif
+
+	gwavi_default_allocator(&alloc);
+	pool = (struct gwavi_pool_t *)alloc.malloc(alloc.ctx,
+			sizeof(struct gwavi_pool_t) +
+			threads * sizeof(pthread_t));
+	if (!pool) {
+		gwavi_report(NULL, GWAVI_ENOMEM, "gwavi_pool_create",
+			     "could not allocate memory for pool", 0);
+		return NULL;
+	}
+	(void)memset(pool, 0, sizeof(struct gwavi_pool_t));
+	pool->alloc = alloc;
+	pool->threads = threads;
+	pool->workers = (pthread_t *)(pool + 1);
+	(void)pthread_mutex_init(&pool->lock, NULL);
+	(void)pthread_cond_init(&pool->work, NULL);
+	(void)pthread_cond_init(&pool->idle, NULL);
+
+	for (i = 0; i < threads; i++) {
+		if ((err = pthread_create(&pool->workers[i], NULL, worker_main,
+					  pool)) != 0) {
+			gwavi_report(NULL, GWAVI_ESYS, "gwavi_pool_create",
+				     "pthread_create() failed", err);
+			goto failed;
+		}
+		if (!cpus || cpus[i] < 0)
+			continue;
+#ifdef __linux__
+		{
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET((size_t)cpus[i], &set);
+			if ((err = pthread_setaffinity_np(pool->workers[i],
+							  sizeof(set), &set))
+					!= 0) {
+				gwavi_report(NULL, GWAVI_ESYS,
+					     "gwavi_pool_create",
+					     "pthread_setaffinity_np() failed",
+					     err);
+				i++;
+				goto failed;
+			}
+		}
+#else
+		gwavi_warn(NULL, GWAVI_EINVAL, "gwavi_pool_create",
+			   "pinning workers is not supported here");
+#endif
+	}
+
+	return pool;
+
+failed:
+	stop_workers(pool, i);
+	(void)pthread_cond_destroy(&pool->idle);
+	(void)pthread_cond_destroy(&pool->work);
+	(void)pthread_mutex_destroy(&pool->lock);
+	alloc.free(alloc.ctx, pool);
+	return NULL;
+}
+
+/**
+ * This function puts a handle in threaded mode, see gwavi_set_threaded(),
+ * its chunks being written by the workers of a pool instead of a thread of
+ * its own. The handle leaves the pool when threaded mode is turned off with
+ * gwavi_set_threaded() or when it is closed.
+ *
+ * @param pool Pool created with gwavi_pool_create().
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param max_queued Maximum number of chunks of the handle waiting to be
+ * written.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_pool_attach(struct gwavi_pool_t *pool, struct gwavi_t *gwavi,
+		  unsigned int max_queued)
+{
+	if (!pool || !gwavi || max_queued == 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_pool_attach",
+			     "pool and/or gwavi argument cannot be NULL and "
+			     "max_queued must be > 0", 0);
+		return -1;
+	}
+	if (gwavi->threaded) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_pool_attach",
+			     "already in threaded mode", 0);
+		return -1;
+	}
+
+	gwavi->pool = pool;
+	gwavi->pool_next = NULL;
+	gwavi->pool_state = GWAVI_POOL_IDLE;
+	gwavi->pool_jobs = 0;
+	if (gwavi_set_threaded(gwavi, max_queued) == -1) {
+		gwavi->pool = NULL;
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&pool->lock);
+	pool->attached++;
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * This function stops the workers of a pool and frees it. All the handles
+ * must have left the pool.
+ *
+ * @param pool Pool created with gwavi_pool_create().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_pool_destroy(struct gwavi_pool_t *pool)
+{
+	struct gwavi_allocator_t alloc;
+	unsigned int attached;
+
+	if (!pool) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_pool_destroy",
+			     "pool argument cannot be NULL", 0);
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&pool->lock);
+	attached = pool->attached;
+	(void)pthread_mutex_unlock(&pool->lock);
+	if (attached > 0) {
+		gwavi_report(NULL, GWAVI_ESTATE, "gwavi_pool_destroy",
+			     "handles are still attached", 0);
+		return -1;
+	}
+
+	stop_workers(pool, pool->threads);
+	(void)pthread_cond_destroy(&pool->idle);
+	(void)pthread_cond_destroy(&pool->work);
+	(void)pthread_mutex_destroy(&pool->lock);
+	alloc = pool->alloc;
+	alloc.free(alloc.ctx, pool);
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Intrusive multiple producers, single consumer queue, after the one described
+ * by Dmitry Vyukov. Pushing is wait-free: one atomic exchange of the head and
+ * a store. Popping is lock-free and only done by one thread.
+ */
+
+#include <stddef.h>
+
+#include "queue.h"
+#include "atomic.h"
+
+void
+gwavi_queue_init(struct gwavi_queue_t *queue)
+{
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+/*
+ * Append node to the queue. Can be called from any thread.
+ */
+void
+gwavi_queue_push(struct gwavi_queue_t *queue, struct gwavi_queue_node_t *node)
+{
+	struct gwavi_queue_node_t *prev;
+
+	node->next = NULL;
+	prev = gwavi_exchange(&queue->head, node);
+	/*
+	 * Until this store, the node is not reachable from the tail: the
+	 * consumer sees the queue as empty and has to try again.
+	 */
+	prev->next = node;
+}
+
+/*
+ * Remove the oldest node from the queue. Return NULL when the queue is empty
+ * or when a producer is between the two steps of gwavi_queue_push(). Must
+ * only be called from one thread at a time.
+ */
+struct gwavi_queue_node_t *
+gwavi_queue_pop(struct gwavi_queue_t *queue)
+{
+	struct gwavi_queue_node_t *tail = queue->tail;
+	struct gwavi_queue_node_t *next = tail->next;
+
+	if (tail == &queue->stub) {
+		if (!next)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = next->next;
+	}
+	if (next) {
+		gwavi_barrier();
+		queue->tail = next;
+		return tail;
+	}
+	if (tail != queue->head)
+		return NULL;
+
+	/* tail is the last node: put the stub back behind it */
+	gwavi_queue_push(queue, &queue->stub);
+	next = tail->next;
+	if (next) {
+		gwavi_barrier();
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Segmented recording: a gwavi_seg_t writes a sequence of AVI files, rolling
+ * over to the next one at a keyframe once a size, duration or frame count
+ * threshold is reached.
+ *
+ * Two gwavi_t structures are used in turns: while frames are added to the
+ * current one, a background thread completes the previous file of the other
+ * one and starts the next file with it, so that rolling over only swaps
+ * pointers on the capture path.
+ *
+ * With a placement, each file goes to the directory picked by its policy.
+ *
+ * Settings made on one gwavi_t structure are not carried over to the other
+ * one, so the ones that apply to every file are set with gwavi_seg functions
+ * which apply them to both.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+struct gwavi_seg_t
+{
+	struct gwavi_allocator_t alloc;	/* this structure was allocated with */
+	char *pattern;		/* file name pattern, with one %u */
+	size_t name_len;	/* room for a file name built from pattern */
+	struct gwavi_place_t *place;	/* NULL to use pattern as a path */
+	char *base_name;	/* file name before placement */
+	unsigned int width;
+	unsigned int height;
+	char fourcc[5];
+	unsigned int fps;
+	struct gwavi_audio_t audio;
+	int has_audio;
+	unsigned long max_bytes;	/* thresholds, 0 when not set */
+	unsigned int max_seconds;
+	unsigned int max_frames;
+	void (*log)(void *ctx, const struct gwavi_error_t *error);
+	void *log_ctx;
+	int log_level;
+	int has_log;		/* log set with gwavi_seg_set_log() */
+
+	struct gwavi_t *cur;		/* file frames are added to */
+	unsigned int cur_index;		/* its number in the sequence */
+	unsigned int cur_frames;	/* video frames added to it */
+	int cur_dir;		/* its placement directory, -1 if none */
+
+	/* shared with the background thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct gwavi_t *spare;		/* next file, prepared in background */
+	char *spare_name;
+	int spare_dir;		/* placement directory of spare_name */
+	int spare_ready;	/* spare has its file open */
+	int pending;		/* spare is being prepared */
+	int stop;
+};
+
+/*
+ * Check that pattern holds exactly one %u and no other conversion.
+ */
+static int
+check_pattern(const char *pattern)
+{
+	const char *p;
+	int count = 0;
+
+	for (p = strchr(pattern, '%'); p; p = strchr(p + 2, '%')) {
+		if (p[1] != 'u')
+			return -1;
+		count++;
+	}
+
+	return count == 1 ? 0 : -1;
+}
+
+/*
+ * Build the path of the file numbered index into path, picking its directory
+ * when there is a placement. Return the directory, -1 if none.
+ */
+static int
+build_name(struct gwavi_seg_t *seg, unsigned int index, char *path)
+{
+	if (!seg->place) {
+		(void)sprintf(path, seg->pattern, index);
+		return -1;
+	}
+
+	(void)sprintf(seg->base_name, seg->pattern, index);
+	return gwavi_place_pick(seg->place, seg->base_name, path,
+				seg->name_len);
+}
+
+/*
+ * Open the spare file, numbered cur_index + 1, reusing the spare gwavi_t
+ * structure when there is one. This completes the file it held. Called from
+ * the background thread.
+ */
+static void
+prepare_spare(struct gwavi_seg_t *seg, unsigned int index)
+{
+	struct gwavi_t *spare = seg->spare;
+	int dir, ret;
+
+	dir = build_name(seg, index, seg->spare_name);
+	if (spare) {
+		ret = gwavi_reopen(spare, seg->spare_name);
+	} else {
+		spare = gwavi_open(seg->spare_name, seg->width, seg->height,
+				   seg->fourcc, seg->fps,
+				   seg->has_audio ? &seg->audio : NULL);
+		ret = spare ? 0 : -1;
+		/* not changed while pending, see gwavi_seg_set_log() */
+		if (spare && seg->has_log)
+			gwavi_set_log(spare, seg->log, seg->log_ctx,
+				      seg->log_level);
+	}
+	/* the file held by spare, if any, is complete */
+	gwavi_place_release(seg->place, seg->spare_dir);
+	if (ret == -1) {
+		gwavi_place_release(seg->place, dir);
+		dir = -1;
+	}
+
+	(void)pthread_mutex_lock(&seg->lock);
+	seg->spare = spare;
+	seg->spare_dir = dir;
+	seg->spare_ready = ret == 0;
+	seg->pending = 0;
+	(void)pthread_cond_broadcast(&seg->cond);
+	(void)pthread_mutex_unlock(&seg->lock);
+}
+
+/*
+ * Background thread: prepare the spare file each time it is asked to.
+ */
+static void *
+seg_main(void *arg)
+{
+	struct gwavi_seg_t *seg = (struct gwavi_seg_t *)arg;
+	unsigned int index;
+
+	(void)pthread_mutex_lock(&seg->lock);
+	for (;;) {
+		while (!seg->pending && !seg->stop)
+			(void)pthread_cond_wait(&seg->cond, &seg->lock);
+		if (!seg->pending)
+			break;
+		index = seg->cur_index + 1;
+		(void)pthread_mutex_unlock(&seg->lock);
+		prepare_spare(seg, index);
+		(void)pthread_mutex_lock(&seg->lock);
+	}
+	(void)pthread_mutex_unlock(&seg->lock);
+
+	return NULL;
+}
+
+/*
+ * Ask the background thread to prepare the spare file. Called with the lock
+ * held.
+ */
+static void
+request_spare(struct gwavi_seg_t *seg)
+{
+	seg->pending = 1;
+	(void)pthread_cond_broadcast(&seg->cond);
+}
+
+/*
+ * Return 1 if a threshold is reached by the current file, 0 otherwise.
+ */
+static int
+limit_reached(struct gwavi_seg_t *seg)
+{
+	struct gwavi_t *cur = seg->cur;
+
+	if (seg->max_frames && seg->cur_frames >= seg->max_frames)
+		return 1;
+	if (seg->max_seconds && seg->cur_frames / seg->fps >= seg->max_seconds)
+		return 1;
+	/* movi list and index, the headers are not worth counting */
+	if (seg->max_bytes && (unsigned long)cur->movi_offset +
+	    (unsigned long)cur->offset_count * 16 >= seg->max_bytes)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Switch to the spare file and have the background thread complete the
+ * current one. Return 0 on success, -1 if the spare file could not be opened,
+ * in which case frames keep being added to the current file.
+ */
+static int
+rollover(struct gwavi_seg_t *seg)
+{
+	struct gwavi_t *old;
+	int dir;
+
+	(void)pthread_mutex_lock(&seg->lock);
+	/* only waits when rolling over faster than files can be opened */
+	while (seg->pending)
+		(void)pthread_cond_wait(&seg->cond, &seg->lock);
+	if (!seg->spare_ready) {
+		request_spare(seg);
+		(void)pthread_mutex_unlock(&seg->lock);
+		gwavi_report(seg->cur, GWAVI_EIO, "gwavi_seg_add_frame",
+			     "next segment could not be opened", 0);
+		return -1;
+	}
+
+	old = seg->cur;
+	seg->cur = seg->spare;
+	seg->spare = old;
+	dir = seg->cur_dir;
+	seg->cur_dir = seg->spare_dir;
+	seg->spare_dir = dir;
+	seg->spare_ready = 0;
+	seg->cur_index++;
+	seg->cur_frames = 0;
+	request_spare(seg);
+	(void)pthread_mutex_unlock(&seg->lock);
+
+	return 0;
+}
+
+/**
+ * This function opens a segmented recording. Files are named after pattern,
+ * which must hold one %u replaced by the number of the file in the sequence,
+ * starting from 0. The other parameters are the ones of gwavi_open(), shared
+ * by all the files.
+ *
+ * @param pattern Name of the files, such as "camera-%u.avi".
+ * @param width Width of a frame.
+ * @param height Height of a frame.
+ * @param fourcc FOURCC representing the codec of the video encoded stream.
+ * @param fps Number of frames per second of your video.
+ * @param audio This parameter is optionnal. It is used for the audio track.
+ *
+ * @return Structure to pass to the other gwavi_seg functions, NULL on error.
+ */
+struct gwavi_seg_t *
+gwavi_seg_open(const char *pattern, unsigned int width, unsigned int height,
+	       const char *fourcc, unsigned int fps, struct gwavi_audio_t *audio)
+{
+	return gwavi_seg_open_placed(NULL, pattern, width, height, fourcc, fps,
+				     audio);
+}
+
+/**
+ * This function opens a segmented recording like gwavi_seg_open(), with each
+ * file written to the directory picked by a placement. pattern is then the
+ * name of the files within the directories.
+ *
+ * @param place Placement created with gwavi_place_create(), NULL to behave
+ * like gwavi_seg_open(). It must not be destroyed before the recording is
+ * closed.
+ * @param pattern Name of the files, such as "camera-%u.avi".
+ * @param width Width of a frame.
+ * @param height Height of a frame.
+ * @param fourcc FOURCC representing the codec of the video encoded stream.
+ * @param fps Number of frames per second of your video.
+ * @param audio This parameter is optionnal. It is used for the audio track.
+ *
+ * @return Structure to pass to the other gwavi_seg functions, NULL on error.
+ */
+struct gwavi_seg_t *
+gwavi_seg_open_placed(struct gwavi_place_t *place, const char *pattern,
+		      unsigned int width, unsigned int height,
+		      const char *fourcc, unsigned int fps,
+		      struct gwavi_audio_t *audio)
+{
+	struct gwavi_allocator_t alloc;
+	struct gwavi_seg_t *seg;
+	char *name;
+	int err;
+
+	if (!pattern || !fourcc || check_pattern(pattern) == -1) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_open",
+			     "pattern must hold exactly one %u", 0);
+		return NULL;
+	}
+
+	gwavi_default_allocator(&alloc);
+	seg = (struct gwavi_seg_t *)alloc.malloc(alloc.ctx,
+						 sizeof(struct gwavi_seg_t));
+	if (!seg)
+		goto nomem;
+	(void)memset(seg, 0, sizeof(struct gwavi_seg_t));
+	seg->alloc = alloc;
+	/* %u expands to at most 10 digits */
+	seg->name_len = strlen(pattern) + 9;
+	if (place)
+		seg->name_len += gwavi_place_path_len(place);
+	seg->pattern = (char *)alloc.malloc(alloc.ctx, strlen(pattern) + 1 +
+					    3 * seg->name_len);
+	if (!seg->pattern) {
+		alloc.free(alloc.ctx, seg);
+		goto nomem;
+	}
+	(void)strcpy(seg->pattern, pattern);
+	name = seg->pattern + strlen(pattern) + 1;
+	seg->spare_name = name + seg->name_len;
+	seg->base_name = seg->spare_name + seg->name_len;
+	seg->place = place;
+	seg->spare_dir = -1;
+
+	seg->width = width;
+	seg->height = height;
+	(void)strncpy(seg->fourcc, fourcc, 4);
+	seg->fps = fps;
+	if (audio) {
+		seg->audio = *audio;
+		seg->has_audio = 1;
+	}
+
+	seg->cur_dir = build_name(seg, 0U, name);
+	if ((seg->cur = gwavi_open(name, width, height, fourcc, fps, audio))
+			== NULL) {
+		gwavi_place_release(place, seg->cur_dir);
+		goto free;
+	}
+
+	(void)pthread_mutex_init(&seg->lock, NULL);
+	(void)pthread_cond_init(&seg->cond, NULL);
+	seg->pending = 1;
+	if ((err = pthread_create(&seg->thread, NULL, seg_main, seg)) != 0) {
+		gwavi_report(seg->cur, GWAVI_ESYS, "gwavi_seg_open",
+			     "pthread_create() failed", err);
+		(void)pthread_cond_destroy(&seg->cond);
+		(void)pthread_mutex_destroy(&seg->lock);
+		(void)gwavi_close(seg->cur);
+		gwavi_place_release(place, seg->cur_dir);
+		goto free;
+	}
+
+	return seg;
+
+nomem:
+	gwavi_report(NULL, GWAVI_ENOMEM, "gwavi_seg_open",
+		     "could not allocate memory for segmented recording", 0);
+	return NULL;
+
+free:
+	alloc.free(alloc.ctx, seg->pattern);
+	alloc.free(alloc.ctx, seg);
+	return NULL;
+}
+
+/**
+ * This function sets when a segmented recording rolls over to the next file.
+ * This happens on the first keyframe added once one of the thresholds is
+ * reached, so that a file always starts with a keyframe. A threshold set to
+ * 0 is not used. By default, no threshold is set and a single file is
+ * written.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ * @param max_bytes Size of a file, approximated by the size of its chunks
+ * and index.
+ * @param max_seconds Duration of a file, computed from its number of video
+ * frames and frame rate.
+ * @param max_frames Number of video frames of a file.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_seg_set_limits(struct gwavi_seg_t *seg, unsigned long max_bytes,
+		     unsigned int max_seconds, unsigned int max_frames)
+{
+	if (!seg) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_set_limits",
+			     "seg argument cannot be NULL", 0);
+		return -1;
+	}
+
+	seg->max_bytes = max_bytes;
+	seg->max_seconds = max_seconds;
+	seg->max_frames = max_frames;
+
+	return 0;
+}
+
+/**
+ * This function sets the log callback of every file of a segmented recording,
+ * see gwavi_set_log(). Calling gwavi_set_log() on gwavi_seg_current() would
+ * only change it until the next rollover. It waits for the next file to be
+ * opened if it is being opened in the background.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ * @param log Callback receiving the messages, or NULL to drop them.
+ * @param ctx Opaque pointer passed to log.
+ * @param level Most verbose gwavi_log_level passed to log.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_seg_set_log(struct gwavi_seg_t *seg,
+		  void (*log)(void *ctx, const struct gwavi_error_t *error),
+		  void *ctx, int level)
+{
+	if (!seg) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_set_log",
+			     "seg argument cannot be NULL", 0);
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&seg->lock);
+	/* the spare is only used by the background thread while pending */
+	while (seg->pending)
+		(void)pthread_cond_wait(&seg->cond, &seg->lock);
+	seg->log = log;
+	seg->log_ctx = ctx;
+	seg->log_level = level;
+	seg->has_log = 1;
+	gwavi_set_log(seg->cur, log, ctx, level);
+	if (seg->spare)
+		gwavi_set_log(seg->spare, log, ctx, level);
+	(void)pthread_mutex_unlock(&seg->lock);
+
+	return 0;
+}
+
+/**
+ * This function adds a video frame to a segmented recording, rolling over to
+ * the next file first if a threshold is reached and the frame is a keyframe.
+ * If the next file could not be opened, the frame is added to the current
+ * file and rolling over is tried again at the next keyframe.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ * @param buffer Video buffer.
+ * @param len Video buffer length.
+ * @param keyframe Non zero if the frame is a keyframe.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_seg_add_frame(struct gwavi_seg_t *seg, unsigned char *buffer,
+		    size_t len, int keyframe)
+{
+	if (!seg || !buffer) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_add_frame",
+			     "seg and/or buffer argument cannot be NULL", 0);
+		return -1;
+	}
+
+	if (keyframe && seg->cur_frames > 0 && limit_reached(seg))
+		(void)rollover(seg);
+
+	if (gwavi_add_frame(seg->cur, buffer, len) == -1)
+		return -1;
+	seg->cur_frames++;
+
+	return 0;
+}
+
+/**
+ * This function adds audio data to the current file of a segmented
+ * recording.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ * @param buffer Audio data buffer.
+ * @param len Audio data buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_seg_add_audio(struct gwavi_seg_t *seg, unsigned char *buffer,
+		    size_t len)
+{
+	if (!seg) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_add_audio",
+			     "seg argument cannot be NULL", 0);
+		return -1;
+	}
+
+	return gwavi_add_audio(seg->cur, buffer, len);
+}
+
+/**
+ * This function returns the gwavi_t structure of the file frames are
+ * currently added to, for instance to read its last error or take a
+ * snapshot. It changes when rolling over, and the next file is opened with
+ * the parameters of gwavi_seg_open() only: settings made on this structure,
+ * such as its log, realtime, live or parkable mode, its sinks or its extra
+ * streams, are lost at the next rollover. Use gwavi_seg_set_log() for the
+ * log of every file.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ *
+ * @return Current gwavi_t structure, NULL on error.
+ */
+struct gwavi_t *
+gwavi_seg_current(struct gwavi_seg_t *seg)
+{
+	if (!seg) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_current",
+			     "seg argument cannot be NULL", 0);
+		return NULL;
+	}
+
+	return seg->cur;
+}
+
+/**
+ * This function completes the current file of a segmented recording, waits
+ * for the background thread and frees the memory. The spare file prepared
+ * for the next segment is removed.
+ *
+ * @param seg Segmented recording opened with gwavi_seg_open().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_seg_close(struct gwavi_seg_t *seg)
+{
+	struct gwavi_allocator_t alloc;
+	int ret = 0;
+
+	if (!seg) {
+		gwavi_report(NULL, GWAVI_EINVAL, "gwavi_seg_close",
+			     "seg argument cannot be NULL", 0);
+		return -1;
+	}
+
+	(void)pthread_mutex_lock(&seg->lock);
+	seg->stop = 1;
+	(void)pthread_cond_broadcast(&seg->cond);
+	(void)pthread_mutex_unlock(&seg->lock);
+	(void)pthread_join(seg->thread, NULL);
+	(void)pthread_cond_destroy(&seg->cond);
+	(void)pthread_mutex_destroy(&seg->lock);
+
+	if (gwavi_close(seg->cur) == -1)
+		ret = -1;
+	if (seg->spare) {
+		if (gwavi_close(seg->spare) == -1)
+			ret = -1;
+		if (seg->spare_ready)
+			(void)remove(seg->spare_name);
+	}
+	gwavi_place_release(seg->place, seg->cur_dir);
+	gwavi_place_release(seg->place, seg->spare_dir);
+
+	alloc = seg->alloc;
+	alloc.free(alloc.ctx, seg->pattern);
+	alloc.free(alloc.ctx, seg);
+
+	return ret;
+}
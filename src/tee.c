@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2008-2011, Michael Kohn
+ * Copyright (c) 2013, Robin Hahling
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the author nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Tee output: the bytes written to the file of a handle are also copied to
+ * sinks, such as a pipe to an uploader or a file on another disk, without
+ * serializing the AVI data again.
+ *
+ * Once a sink is attached, the output of the handle is a stdio stream created
+ * with fopencookie() whose functions write to the file and push a copy of
+ * each write, with its offset, to the ring of every sink. A thread per sink
+ * drains its ring, so a slow sink only lags behind; a sink whose ring is full
+ * or whose writes fail is dropped without affecting the file or the other
+ * sinks.
+ */
+
+#define _GNU_SOURCE /* for fopencookie() and pwrite() */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gwavi.h"
+#include "gwavi_private.h"
+
+/* header of a write in a sink ring, followed by its bytes */
+struct gwavi_sink_record_t
+{
+	long offset;		/* file offset of the bytes */
+	size_t len;
+};
+
+struct gwavi_sink_t
+{
+	struct gwavi_sink_t *next;
+	int fd;
+	int seekable;		/* patches are written, not skipped */
+	long end;		/* bytes written so far if not seekable */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signaled when records are pushed */
+	unsigned char *ring;	/* size bytes after the structure */
+	size_t size;
+	size_t head;		/* where the next record is pushed */
+	size_t tail;		/* where the next record is popped */
+	size_t used;
+	int dropped;		/* ring full or write failed */
+	int warned;		/* drop reported */
+	int stop;
+};
+
+struct gwavi_tee_t
+{
+	struct gwavi_t *gwavi;		/* allocated the sinks and this */
+	int fd;			/* the file itself */
+	long pos;		/* its file offset */
+	struct gwavi_sink_t *sinks;
+};
+
+/*
+ * Copy len bytes to the ring of a sink at pos, wrapping around.
+ */
+static void
+ring_put(struct gwavi_sink_t *sink, size_t pos, const void *src, size_t len)
+{
+	size_t first = sink->size - pos;
+
+	if (first >= len) {
+		(void)memcpy(sink->ring + pos, src, len);
+		return;
+	}
+	(void)memcpy(sink->ring + pos, src, first);
+	(void)memcpy(sink->ring, (const unsigned char *)src + first,
+		     len - first);
+}
+
+/*
+ * Copy len bytes from the ring of a sink at pos, wrapping around.
+ */
+static void
+ring_get(struct gwavi_sink_t *sink, size_t pos, void *dst, size_t len)
+{
+	size_t first = sink->size - pos;
+
+	if (first >= len) {
+		(void)memcpy(dst, sink->ring + pos, len);
+		return;
+	}
+	(void)memcpy(dst, sink->ring + pos, first);
+	(void)memcpy((unsigned char *)dst + first, sink->ring, len - first);
+}
+
+/*
+ * Push a write to the ring of a sink, dropping the sink if it does not fit.
+ * Return 0 on success, -1 if the sink is dropped.
+ */
+static int
+push_record(struct gwavi_sink_t *sink, long offset, const void *buf,
+	    size_t len)
+{
+	struct gwavi_sink_record_t record;
+	size_t need = sizeof(record) + len;
+
+	(void)pthread_mutex_lock(&sink->lock);
+	if (!sink->dropped && sink->size - sink->used < need) {
+		sink->dropped = 1;
+		/* the thread discards what is left */
+		(void)pthread_cond_signal(&sink->cond);
+	}
+	if (sink->dropped) {
+		(void)pthread_mutex_unlock(&sink->lock);
+		return -1;
+	}
+
+	record.offset = offset;
+	record.len = len;
+	ring_put(sink, sink->head, &record, sizeof(record));
+	ring_put(sink, (sink->head + sizeof(record)) % sink->size, buf, len);
+	sink->head = (sink->head + need) % sink->size;
+	sink->used += need;
+	(void)pthread_cond_signal(&sink->cond);
+	(void)pthread_mutex_unlock(&sink->lock);
+
+	return 0;
+}
+
+/*
+ * Write len bytes to a sink at offset. A sink that cannot seek gets the bytes
+ * past what it received only: the patches of the headers are skipped.
+ * Return 0 on success, -1 on error.
+ */
+static int
+sink_write(struct gwavi_sink_t *sink, long offset, const unsigned char *buf,
+	   size_t len)
+{
+	static const unsigned char zeros[256];
+	const unsigned char *p;
+	size_t n;
+	ssize_t w;
+
+	if (!sink->seekable) {
+		if (offset + (long)len <= sink->end)
+			return 0;
+		/* a gap is filled with zeros, a patch is cut */
+		while (offset > sink->end) {
+			n = (size_t)(offset - sink->end);
+			if (n > sizeof(zeros))
+				n = sizeof(zeros);
+			if ((w = write(sink->fd, zeros, n)) == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			sink->end += (long)w;
+		}
+		buf += sink->end - offset;
+		len -= (size_t)(sink->end - offset);
+		offset = sink->end;
+	}
+
+	for (p = buf; len > 0; p += w, len -= (size_t)w, offset += (long)w) {
+		if (sink->seekable)
+			w = pwrite(sink->fd, p, len, (off_t)offset);
+		else
+			w = write(sink->fd, p, len);
+		if (w == -1) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (!sink->seekable)
+			sink->end += (long)w;
+	}
+
+	return 0;
+}
+
+/*
+ * Sink thread: write the records of the ring until asked to stop and the
+ * ring is empty, or discard them once the sink is dropped.
+ */
+static void *
+sink_main(void *arg)
+{
+	struct gwavi_sink_t *sink = (struct gwavi_sink_t *)arg;
+	struct gwavi_sink_record_t record;
+	size_t data, first;
+	sigset_t set;
+	int ret;
+
+	/* writing to a closed pipe fails with EPIPE instead of a signal */
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGPIPE);
+	(void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	(void)pthread_mutex_lock(&sink->lock);
+	for (;;) {
+		while (sink->used == 0 && !sink->stop && !sink->dropped)
+			(void)pthread_cond_wait(&sink->cond, &sink->lock);
+		if (sink->dropped) {
+			sink->tail = sink->head;
+			sink->used = 0;
+			if (sink->stop)
+				break;
+			(void)pthread_cond_wait(&sink->cond, &sink->lock);
+			continue;
+		}
+		if (sink->used == 0)
+			break;
+
+		ring_get(sink, sink->tail, &record, sizeof(record));
+		(void)pthread_mutex_unlock(&sink->lock);
+
+		/* the producer does not overwrite the record being written */
+		data = (sink->tail + sizeof(record)) % sink->size;
+		first = sink->size - data;
+		if (first >= record.len) {
+			ret = sink_write(sink, record.offset, sink->ring + data,
+					 record.len);
+		} else {
+			ret = sink_write(sink, record.offset, sink->ring + data,
+					 first);
+			if (ret == 0)
+				ret = sink_write(sink, record.offset +
+						 (long)first, sink->ring,
+						 record.len - first);
+		}
+
+		(void)pthread_mutex_lock(&sink->lock);
+		if (ret == -1)
+			sink->dropped = 1;
+		sink->tail = (sink->tail + sizeof(record) + record.len) %
+			sink->size;
+		sink->used -= sizeof(record) + record.len;
+	}
+	(void)pthread_mutex_unlock(&sink->lock);
+
+	return NULL;
+}
+
+/*
+ * Push a write to every sink, reporting the sinks dropped once.
+ */
+static void
+push_all(struct gwavi_tee_t *tee, long offset, const void *buf, size_t len)
+{
+	struct gwavi_sink_t *sink;
+
+	for (sink = tee->sinks; sink; sink = sink->next) {
+		if (push_record(sink, offset, buf, len) == 0 || sink->warned)
+			continue;
+		sink->warned = 1;
+		gwavi_warn(tee->gwavi, GWAVI_EFULL, "gwavi_add_sink",
+			   "sink dropped, its ring is full or writing failed");
+	}
+}
+
+static ssize_t
+tee_read(void *cookie, char *buf, size_t size)
+{
+	struct gwavi_tee_t *tee = (struct gwavi_tee_t *)cookie;
+	ssize_t r;
+
+	if ((r = read(tee->fd, buf, size)) > 0)
+		tee->pos += (long)r;
+
+	return r;
+}
+
+static ssize_t
+tee_write(void *cookie, const char *buf, size_t size)
+{
+	struct gwavi_tee_t *tee = (struct gwavi_tee_t *)cookie;
+	ssize_t w;
+
+	if ((w = write(tee->fd, buf, size)) <= 0)
+		return w;
+	push_all(tee, tee->pos, buf, (size_t)w);
+	tee->pos += (long)w;
+
+	return w;
+}
+
+static int
+tee_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct gwavi_tee_t *tee = (struct gwavi_tee_t *)cookie;
+	off_t pos;
+
+	if ((pos = lseek(tee->fd, (off_t)*offset, whence)) == -1)
+		return -1;
+	*offset = pos;
+	tee->pos = (long)pos;
+
+	return 0;
+}
+
+/*
+ * Stop a sink once its ring is drained and free it.
+ */
+static void
+stop_sink(struct gwavi_tee_t *tee, struct gwavi_sink_t *sink)
+{
+	(void)pthread_mutex_lock(&sink->lock);
+	sink->stop = 1;
+	(void)pthread_cond_signal(&sink->cond);
+	(void)pthread_mutex_unlock(&sink->lock);
+	(void)pthread_join(sink->thread, NULL);
+	(void)pthread_cond_destroy(&sink->cond);
+	(void)pthread_mutex_destroy(&sink->lock);
+	gwavi_free(tee->gwavi, sink);
+}
+
+static int
+tee_close(void *cookie)
+{
+	struct gwavi_tee_t *tee = (struct gwavi_tee_t *)cookie;
+	struct gwavi_sink_t *sink;
+	int ret;
+
+	while ((sink = tee->sinks) != NULL) {
+		tee->sinks = sink->next;
+		stop_sink(tee, sink);
+	}
+	ret = close(tee->fd);
+	gwavi_free(tee->gwavi, tee);
+
+	return ret;
+}
+
+/*
+ * Replace the output of a handle by a stream writing through a tee with no
+ * sink. Return 0 on success, -1 on error.
+ */
+static int
+install_tee(struct gwavi_t *gwavi)
+{
+	static cookie_io_functions_t funcs = {
+		tee_read, tee_write, tee_seek, tee_close
+	};
+	struct gwavi_tee_t *tee;
+	FILE *out;
+	long pos;
+	int fd;
+
+	if (fflush(gwavi->out) == EOF || (pos = ftell(gwavi->out)) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_sink",
+			     "could not flush the file", errno);
+		return -1;
+	}
+	if ((fd = dup(fileno(gwavi->out))) == -1) {
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_add_sink",
+			     "dup() failed", errno);
+		return -1;
+	}
+
+	tee = (struct gwavi_tee_t *)gwavi_malloc(gwavi,
+						 sizeof(struct gwavi_tee_t));
+	if (!tee) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_add_sink",
+			     "could not allocate memory for tee", 0);
+		(void)close(fd);
+		return -1;
+	}
+	tee->gwavi = gwavi;
+	tee->fd = fd;
+	tee->pos = pos;
+	tee->sinks = NULL;
+
+	if ((out = fopencookie(tee, "w+", funcs)) == NULL) {
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_add_sink",
+			     "fopencookie() failed", errno);
+		gwavi_free(gwavi, tee);
+		(void)close(fd);
+		return -1;
+	}
+	if (fseek(out, pos, SEEK_SET) == -1) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_sink",
+			     "fseek() failed", errno);
+		(void)fclose(out);
+		return -1;
+	}
+
+	(void)fclose(gwavi->out);
+	gwavi->out = out;
+	gwavi->tee = tee;
+
+	return 0;
+}
+
+/*
+ * Push the len bytes already written to the file to a new sink. Return 0 on
+ * success, -1 if they do not fit in its ring or could not be read.
+ */
+static int
+push_written(struct gwavi_tee_t *tee, struct gwavi_sink_t *sink, long len)
+{
+	unsigned char buffer[4096];
+	long offset;
+	size_t n;
+	ssize_t r;
+
+	for (offset = 0; offset < len; offset += (long)r) {
+		n = len - offset < (long)sizeof(buffer) ?
+			(size_t)(len - offset) : sizeof(buffer);
+		if ((r = pread(tee->fd, buffer, n, (off_t)offset)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (push_record(sink, offset, buffer, (size_t)r) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * This function attaches a sink to a handle: the bytes written to its file
+ * are also written to fd, from a thread of its own, so that a slow sink does
+ * not slow down the file. What was written before is sent first.
+ *
+ * A seekable sink, such as a file on another disk, receives the same bytes at
+ * the same offsets and ends up identical to the file. A pipe or a socket
+ * receives the file as it is written: the headers completed by gwavi_close()
+ * are skipped, leaving their sizes at 0 as in a stream being recorded.
+ *
+ * The bytes wait in a ring of ring_size bytes until the sink takes them. When
+ * a write does not fit, or writing to fd fails, the sink is dropped with a
+ * warning and the file goes on being written. Sinks are drained and detached
+ * when the file is completed by gwavi_close() or gwavi_reopen(), the latter
+ * with a warning since the next file is not sent to them; fd is not closed.
+ * The rings come from the allocator of the handle.
+ *
+ * Sinks are attached in sequential mode, and are not available in parallel
+ * mode or to parkable handles.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open().
+ * @param fd File descriptor open for writing.
+ * @param ring_size Bytes the sink can lag behind the file, which must hold
+ * the bytes already written.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int
+gwavi_add_sink(struct gwavi_t *gwavi, int fd, size_t ring_size)
+{
+	struct gwavi_sink_t *sink;
+	long written;
+	int err;
+
+	if (!gwavi || fd < 0 || ring_size == 0) {
+		gwavi_report(gwavi, GWAVI_EINVAL, "gwavi_add_sink",
+			     "gwavi argument cannot be NULL, fd and ring_size "
+			     "must be valid", 0);
+		return -1;
+	}
+	if (gwavi->threaded || gwavi->parallel || gwavi->parkable) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_add_sink",
+			     "not available in threaded or parallel mode or "
+			     "to parkable handles", 0);
+		return -1;
+	}
+	if (!gwavi->out || gwavi->in_chunk) {
+		gwavi_report(gwavi, GWAVI_ESTATE, "gwavi_add_sink",
+			     "no file open or frame being streamed", 0);
+		return -1;
+	}
+	if (!gwavi->tee && install_tee(gwavi) == -1)
+		return -1;
+	if (fflush(gwavi->out) == EOF) {
+		gwavi_report(gwavi, GWAVI_EIO, "gwavi_add_sink",
+			     "fflush() failed", errno);
+		return -1;
+	}
+	written = gwavi->tee->pos;
+
+	sink = (struct gwavi_sink_t *)gwavi_malloc(gwavi,
+			sizeof(struct gwavi_sink_t) + ring_size);
+	if (!sink) {
+		gwavi_report(gwavi, GWAVI_ENOMEM, "gwavi_add_sink",
+			     "could not allocate memory for sink", 0);
+		return -1;
+	}
+	(void)memset(sink, 0, sizeof(struct gwavi_sink_t));
+	sink->fd = fd;
+	sink->seekable = lseek(fd, 0, SEEK_CUR) != -1;
+	sink->ring = (unsigned char *)(sink + 1);
+	sink->size = ring_size;
+	(void)pthread_mutex_init(&sink->lock, NULL);
+	(void)pthread_cond_init(&sink->cond, NULL);
+
+	if (push_written(gwavi->tee, sink, written) == -1) {
+		gwavi_report(gwavi, GWAVI_EFULL, "gwavi_add_sink",
+			     "ring too small for the bytes already written", 0);
+		goto free;
+	}
+	if ((err = pthread_create(&sink->thread, NULL, sink_main, sink))
+			!= 0) {
+		gwavi_report(gwavi, GWAVI_ESYS, "gwavi_add_sink",
+			     "pthread_create() failed", err);
+		goto free;
+	}
+
+	sink->next = gwavi->tee->sinks;
+	gwavi->tee->sinks = sink;
+
+	return 0;
+
+free:
+	(void)pthread_cond_destroy(&sink->cond);
+	(void)pthread_mutex_destroy(&sink->lock);
+	gwavi_free(gwavi, sink);
+	return -1;
+}
@@ -1,5 +1,13 @@
 #include "sput.h"
 
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
 #include "avi-utils.h"
 #include "gwavi.h"
 #include "gwavi_test.h"
@@ -18,9 +26,48 @@ main(void)
     sput_enter_suite("test gwavi_add_audio");
     sput_run_test(gwavi_add_audio_test);
 
+    sput_enter_suite("test gwavi_add_framev");
+    sput_run_test(gwavi_add_framev_test);
+
+    sput_enter_suite("test gwavi_add_frame_fd");
+    sput_run_test(gwavi_add_frame_fd_test);
+
+    sput_enter_suite("test gwavi_frame_alloc");
+    sput_run_test(gwavi_frame_alloc_test);
+
+    sput_enter_suite("test gwavi_commit_frame");
+    sput_run_test(gwavi_commit_frame_test);
+
+    sput_enter_suite("test gwavi_frame_begin");
+    sput_run_test(gwavi_frame_begin_test);
+
     sput_enter_suite("test gwavi_close");
     sput_run_test(gwavi_close_test);
 
+    sput_enter_suite("test gwavi_reopen");
+    sput_run_test(gwavi_reopen_test);
+
+    sput_enter_suite("test gwavi_reserve");
+    sput_run_test(gwavi_reserve_test);
+
+    sput_enter_suite("test gwavi_seg_open");
+    sput_run_test(gwavi_seg_open_test);
+
+    sput_enter_suite("test gwavi_seg_open_placed");
+    sput_run_test(gwavi_seg_open_placed_test);
+
+    sput_enter_suite("test gwavi_add_video_stream");
+    sput_run_test(gwavi_add_video_stream_test);
+
+    sput_enter_suite("test gwavi_dvr_open");
+    sput_run_test(gwavi_dvr_open_test);
+
+    sput_enter_suite("test gwavi_set_index_staging");
+    sput_run_test(gwavi_set_index_staging_test);
+
+    sput_enter_suite("test gwavi_set_fixed_frame_size");
+    sput_run_test(gwavi_set_fixed_frame_size_test);
+
     sput_enter_suite("test gwavi_set_framerate");
     sput_run_test(gwavi_set_framerate_test);
 
@@ -30,9 +77,51 @@ main(void)
     sput_enter_suite("test gwavi_set_size");
     sput_run_test(gwavi_set_size_test);
 
+    sput_enter_suite("test gwavi_set_realtime");
+    sput_run_test(gwavi_set_realtime_test);
+
+    sput_enter_suite("test gwavi_set_log");
+    sput_run_test(gwavi_set_log_test);
+
+    sput_enter_suite("test gwavi_set_allocator");
+    sput_run_test(gwavi_set_allocator_test);
+
+    sput_enter_suite("test gwavi_set_threaded");
+    sput_run_test(gwavi_set_threaded_test);
+
+    sput_enter_suite("test gwavi_set_parkable");
+    sput_run_test(gwavi_set_parkable_test);
+
+    sput_enter_suite("test gwavi_add_sink");
+    sput_run_test(gwavi_add_sink_test);
+
+    sput_enter_suite("test gwavi_snapshot");
+    sput_run_test(gwavi_snapshot_test);
+
+    sput_enter_suite("test gwavi_set_live");
+    sput_run_test(gwavi_set_live_test);
+
+    sput_enter_suite("test gwavi_pool_create");
+    sput_run_test(gwavi_pool_create_test);
+
+    sput_enter_suite("test gwavi_set_parallel");
+    sput_run_test(gwavi_set_parallel_test);
+
+    sput_enter_suite("test gwavi_add_frame_seq");
+    sput_run_test(gwavi_add_frame_seq_test);
+
+    sput_enter_suite("test gwavi_add_frame_ts");
+    sput_run_test(gwavi_add_frame_ts_test);
+
+    sput_enter_suite("test gwavi_close_async");
+    sput_run_test(gwavi_close_async_test);
+
     sput_enter_suite("test check fourcc");
     sput_run_test(check_fourcc_test);
 
+    sput_enter_suite("test write index");
+    sput_run_test(write_index_test);
+
     sput_finish_testing();
 
     return sput_get_return_value();
@@ -99,6 +188,160 @@ gwavi_add_audio_test(void)
 			 "NULL gwavi parameter");
 }
 
+static void
+gwavi_add_framev_test(void)
+{
+	struct gwavi_t *gwavi;
+	struct gwavi_audio_t audio;
+	struct iovec iov[3];
+	unsigned char head[13], body[4096], tail[2];
+
+	audio.channels = 2;
+	audio.bits = 16;
+	audio.samples_per_second = 44100;
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = body;
+	iov[1].iov_len = sizeof(body);
+	iov[2].iov_base = tail;
+	iov[2].iov_len = sizeof(tail);
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, &audio);
+
+	sput_fail_unless(gwavi_add_framev(gwavi, iov, 3) == 0,
+			 "valid call to gwavi_add_framev");
+	sput_fail_unless(gwavi_add_audiov(gwavi, iov, 3) == 0,
+			 "valid call to gwavi_add_audiov");
+	sput_fail_unless(gwavi_add_framev(gwavi, iov, 0) == 0,
+			 "empty iov");
+	sput_fail_unless(gwavi_add_framev(NULL, iov, 3) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_add_audiov(gwavi, NULL, 3) == -1,
+			 "NULL iov parameter");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close after framev");
+}
+
+static void
+gwavi_add_frame_fd_test(void)
+{
+	struct gwavi_t *gwavi;
+	static unsigned char file[65536];
+	unsigned char buffer[8193];
+	long len, pos = 0;
+	int fd, chunks = 0;
+
+	memset(buffer, 0xcd, sizeof(buffer));
+	fd = open("/tmp/foo.jpg", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	(void)write(fd, buffer, sizeof(buffer));
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_add_frame_fd(gwavi, fd, 0, sizeof(buffer)) == 0,
+			 "valid call to gwavi_add_frame_fd");
+	sput_fail_unless(gwavi_add_frame_fd(gwavi, fd, 1, 4096) == 0,
+			 "valid call with an offset");
+	sput_fail_unless(gwavi_add_frame_fd(gwavi, fd, 4096, 8192) == -1,
+			 "fd shorter than len");
+	sput_fail_unless(gwavi_add_frame_fd(NULL, fd, 0, 4096) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_add_frame_fd(gwavi, -1, 0, 4096) == -1,
+			 "invalid fd");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, 256) == 0 &&
+			 gwavi_close(gwavi) == 0, "recording went on");
+	(void)close(fd);
+
+	/* walk the movi list, the failed chunk must have been dropped */
+	len = read_file("/tmp/foo.avi", file, sizeof(file));
+	while (pos + 4 <= len && memcmp(file + pos, "movi", 4) != 0)
+		pos++;
+	for (pos += 4; pos + 8 <= len && memcmp(file + pos, "00dc", 4) == 0;
+	     pos += 8 + (file[pos + 4] | file[pos + 5] << 8 |
+			 (long)file[pos + 6] << 16))
+		chunks++;
+	sput_fail_unless(chunks == 3 && pos + 4 <= len &&
+			 memcmp(file + pos, "idx1", 4) == 0,
+			 "no chunk left by the failed call");
+}
+
+static void
+gwavi_frame_alloc_test(void)
+{
+	struct gwavi_t *gwavi;
+	unsigned char *frame;
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless((frame = gwavi_frame_alloc(gwavi, 8192)) != NULL,
+			 "valid call to gwavi_frame_alloc");
+	gwavi_frame_free(gwavi, frame);
+	sput_fail_unless(gwavi_frame_alloc(gwavi, 4096) == frame,
+			 "buffer is recycled");
+	sput_fail_unless(gwavi_frame_alloc(NULL, 8192) == NULL,
+			 "NULL gwavi parameter");
+}
+
+static void
+gwavi_commit_frame_test(void)
+{
+	struct gwavi_t *gwavi;
+	unsigned char *frame;
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	frame = gwavi_frame_alloc(gwavi, 8191);
+	memset(frame, 0xab, 8191);
+	sput_fail_unless(gwavi_commit_frame(gwavi, frame, 8191) == 0,
+			 "valid call to gwavi_commit_frame");
+	frame = gwavi_frame_alloc(gwavi, 1024);
+	sput_fail_unless(gwavi_commit_frame(gwavi, frame, 65536) == -1,
+			 "frame larger than buffer");
+	sput_fail_unless(gwavi_commit_frame(NULL, frame, 1024) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_commit_frame(gwavi, NULL, 1024) == -1,
+			 "NULL frame parameter");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close after commits");
+}
+
+static void
+gwavi_frame_begin_test(void)
+{
+	struct gwavi_t *gwavi;
+	unsigned char buffer[4097];
+
+	memset(buffer, 0x42, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_frame_append(gwavi, buffer, 16) == -1,
+			 "append without begin");
+	sput_fail_unless(gwavi_frame_end(gwavi) == -1, "end without begin");
+	sput_fail_unless(gwavi_frame_begin(gwavi, 0) == 0,
+			 "valid call to gwavi_frame_begin");
+	sput_fail_unless(gwavi_frame_begin(gwavi, 0) == -1,
+			 "nested gwavi_frame_begin");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == -1,
+			 "gwavi_add_frame while streaming a frame");
+	sput_fail_unless(gwavi_frame_append(gwavi, buffer, sizeof(buffer))
+			 == 0, "valid call to gwavi_frame_append");
+	sput_fail_unless(gwavi_frame_append(gwavi, buffer, 3) == 0,
+			 "second call to gwavi_frame_append");
+	sput_fail_unless(gwavi_frame_end(gwavi) == 0,
+			 "valid call to gwavi_frame_end");
+	sput_fail_unless(gwavi_frame_begin(gwavi, 8) == 0,
+			 "gwavi_frame_begin with known length");
+	sput_fail_unless(gwavi_frame_append(gwavi, buffer, 4) == 0,
+			 "append less than announced");
+	sput_fail_unless(gwavi_frame_end(gwavi) == -1,
+			 "length does not match the announced one");
+	sput_fail_unless(gwavi_frame_append(gwavi, buffer, 4) == 0,
+			 "append the rest");
+	sput_fail_unless(gwavi_frame_end(gwavi) == 0,
+			 "length matches the announced one");
+	sput_fail_unless(gwavi_frame_begin(NULL, 0) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close after streaming");
+}
+
 static void
 gwavi_close_test(void)
 {
@@ -110,6 +353,50 @@ gwavi_close_test(void)
 
 }
 
+static void
+gwavi_reopen_test(void)
+{
+	struct gwavi_t *gwavi;
+	unsigned char buffer[1024];
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	(void)gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+
+	sput_fail_unless(gwavi_reopen(gwavi, "/tmp/bar.avi") == 0,
+			 "valid call to gwavi_reopen");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0,
+			 "add frame to the new file");
+	sput_fail_unless(gwavi_reopen(gwavi, "/tmp/sadfpoisadf/foo.avi")
+			 == -1, "no such directory");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == -1,
+			 "add frame without output file");
+	sput_fail_unless(gwavi_reopen(gwavi, "/tmp/foo.avi") == 0,
+			 "gwavi_reopen after a failure");
+	sput_fail_unless(gwavi_reopen(NULL, "/tmp/foo.avi") == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close after gwavi_reopen");
+}
+
+static void
+gwavi_reserve_test(void)
+{
+	struct gwavi_t *gwavi;
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_reserve(gwavi, 108000) == 0,
+			 "valid call to gwavi_reserve");
+	sput_fail_unless(gwavi_reserve(gwavi, 10) == 0,
+			 "reserve less than current capacity");
+	sput_fail_unless(gwavi_reserve(NULL, 10) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_reserve(gwavi, 0x10000000U) == -1 &&
+			 gwavi_reserve(gwavi, 0x80000000U) == -1,
+			 "more entries than an index can hold");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close after gwavi_reserve");
+}
+
 static void
 gwavi_set_framerate_test(void)
 {
@@ -151,6 +438,1058 @@ gwavi_set_size_test(void)
 			 "parameter");
 }
 
+static void
+gwavi_set_realtime_test(void)
+{
+	struct gwavi_t *gwavi;
+	struct gwavi_error_t error;
+	unsigned char buffer[16];
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_set_realtime(gwavi, 2048) == 0,
+			 "valid call to gwavi_set_realtime");
+	for (i = 0; i < 2048; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "fill the preallocated index");
+	sput_fail_unless(gwavi_pop_error(gwavi, &error) == 0,
+			 "no error queued for small frames");
+	/* the ring is filled whatever the log level is */
+	gwavi_set_log(gwavi, NULL, NULL, GWAVI_LOG_NONE);
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == -1,
+			 "index full in realtime mode");
+	sput_fail_unless(gwavi_pop_error(gwavi, &error) == 1 &&
+			 strcmp(error.where, "add_offset") == 0,
+			 "error queued instead of printed");
+	sput_fail_unless(gwavi_pop_error(gwavi, &error) == 0,
+			 "error ring drained");
+	sput_fail_unless(gwavi_set_realtime(NULL, 16) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_set_live(gwavi, 100, NULL) == -1 &&
+			 gwavi_set_parkable(gwavi, 1) == -1,
+			 "live mode and parking refused in realtime mode");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close in realtime mode");
+
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	gwavi_set_parkable(gwavi, 1);
+	sput_fail_unless(gwavi_set_realtime(gwavi, 16) == -1,
+			 "parkable handle refused");
+	gwavi_set_parkable(gwavi, 0);
+	gwavi_set_live(gwavi, 100, NULL);
+	sput_fail_unless(gwavi_set_realtime(gwavi, 16) == -1,
+			 "live handle refused");
+	gwavi_close(gwavi);
+}
+
+/* read the whole file into memory, return its length or -1 */
+static long
+read_file(const char *filename, unsigned char *buffer, long len)
+{
+	FILE *in = fopen(filename, "rb");
+	long n;
+
+	if (!in)
+		return -1;
+	n = (long)fread(buffer, 1, (size_t)len, in);
+	fclose(in);
+
+	return n;
+}
+
+/* number of frames recorded in the AVI header of a file, -1 on error */
+static long
+avi_frames(const char *filename)
+{
+	unsigned char header[52];
+
+	if (read_file(filename, header, sizeof(header)) != sizeof(header))
+		return -1;
+
+	return header[48] | header[49] << 8 | (long)header[50] << 16;
+}
+
+static void
+gwavi_seg_open_test(void)
+{
+	struct gwavi_seg_t *seg;
+	unsigned char buffer[256];
+	int i, ret = 0;
+	FILE *spare;
+
+	memset(buffer, 0, sizeof(buffer));
+	sput_fail_unless(gwavi_seg_open("/tmp/seg.avi", 1920, 1080, "H264", 30,
+					NULL) == NULL, "pattern without %u");
+	sput_fail_unless(gwavi_seg_open("/tmp/seg-%u-%s.avi", 1920, 1080,
+					"H264", 30, NULL) == NULL,
+			 "pattern with another conversion");
+
+	seg = gwavi_seg_open("/tmp/seg-%u.avi", 1920, 1080, "H264", 30, NULL);
+	sput_fail_unless(seg != NULL, "valid call to gwavi_seg_open");
+	sput_fail_unless(gwavi_seg_set_limits(seg, 0, 0, 8) == 0,
+			 "valid call to gwavi_seg_set_limits");
+	/* a keyframe every 5 frames */
+	for (i = 0; i < 35; i++)
+		ret |= gwavi_seg_add_frame(seg, buffer, sizeof(buffer),
+					   i % 5 == 0);
+	sput_fail_unless(ret == 0, "frames added across segments");
+	sput_fail_unless(gwavi_seg_close(seg) == 0, "valid call to "
+			 "gwavi_seg_close");
+
+	sput_fail_unless(avi_frames("/tmp/seg-0.avi") == 10 &&
+			 avi_frames("/tmp/seg-1.avi") == 10 &&
+			 avi_frames("/tmp/seg-2.avi") == 10 &&
+			 avi_frames("/tmp/seg-3.avi") == 5,
+			 "rolled over at the first keyframe past the limit");
+	spare = fopen("/tmp/seg-4.avi", "rb");
+	sput_fail_unless(spare == NULL, "unused spare file removed");
+	if (spare)
+		fclose(spare);
+}
+
+static void
+gwavi_seg_open_placed_test(void)
+{
+	const char *dirs[] = { "/tmp/place-a", "/tmp/place-b" };
+	struct gwavi_place_t *place;
+	struct gwavi_seg_t *seg;
+	unsigned char buffer[256];
+	char path[64];
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	(void)mkdir(dirs[0], 0755);
+	(void)mkdir(dirs[1], 0755);
+	sput_fail_unless(gwavi_place_create(dirs, 0, GWAVI_PLACE_ROUND_ROBIN)
+			 == NULL, "no directory");
+	sput_fail_unless(gwavi_place_create(dirs, 2, 42) == NULL,
+			 "invalid policy");
+
+	place = gwavi_place_create(dirs, 2, GWAVI_PLACE_LEAST_OPEN);
+	sput_fail_unless(place != NULL, "valid call to gwavi_place_create");
+	sput_fail_unless(gwavi_place_pick(place, "x.avi", path, 8) == -1,
+			 "path buffer too small");
+	sput_fail_unless(gwavi_place_pick(place, "x.avi", path,
+					  sizeof(path)) == 0 &&
+			 gwavi_place_pick(place, "y.avi", path,
+					  sizeof(path)) == 1 &&
+			 strcmp(path, "/tmp/place-b/y.avi") == 0,
+			 "least open directory picked");
+	gwavi_place_release(place, 0);
+	sput_fail_unless(gwavi_place_pick(place, "z.avi", path,
+					  sizeof(path)) == 0,
+			 "released directory picked again");
+	gwavi_place_destroy(place);
+
+	place = gwavi_place_create(dirs, 2, GWAVI_PLACE_ROUND_ROBIN);
+	seg = gwavi_seg_open_placed(place, "seg-%u.avi", 1920, 1080, "H264",
+				    30, NULL);
+	sput_fail_unless(seg != NULL, "valid call to gwavi_seg_open_placed");
+	(void)gwavi_seg_set_limits(seg, 0, 0, 5);
+	for (i = 0; i < 15; i++)
+		ret |= gwavi_seg_add_frame(seg, buffer, sizeof(buffer),
+					   i % 5 == 0);
+	sput_fail_unless(ret == 0, "frames added across segments");
+	sput_fail_unless(gwavi_seg_close(seg) == 0, "segments closed");
+	gwavi_place_destroy(place);
+
+	sput_fail_unless(avi_frames("/tmp/place-a/seg-0.avi") == 5 &&
+			 avi_frames("/tmp/place-b/seg-1.avi") == 5 &&
+			 avi_frames("/tmp/place-a/seg-2.avi") == 5,
+			 "segments written to the directories in turns");
+}
+
+static void
+gwavi_add_video_stream_test(void)
+{
+	struct gwavi_t *gwavi;
+	struct gwavi_audio_t audio = { 2, 16, 44100 };
+	static unsigned char file[65536];
+	unsigned char buffer[256];
+	long len, i;
+	int found = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/streams.avi", 1920, 1080, "H264", 30, NULL);
+	sput_fail_unless(gwavi_add_video_stream(gwavi, 640, 480, "MJPG", 30)
+			 == 1, "valid call to gwavi_add_video_stream");
+	sput_fail_unless(gwavi_add_audio(gwavi, buffer, 64) == -1,
+			 "stream 1 is not an audio stream");
+	sput_fail_unless(gwavi_add_audio_stream(gwavi, &audio) == 2,
+			 "valid call to gwavi_add_audio_stream");
+	sput_fail_unless(gwavi_add_stream_chunk(gwavi, 3, buffer,
+						sizeof(buffer)) == -1,
+			 "no such stream");
+	sput_fail_unless(gwavi_add_stream_chunk(gwavi, 1, buffer,
+						sizeof(buffer)) == 0 &&
+			 gwavi_add_stream_chunk(gwavi, 2, buffer, 64) == 0 &&
+			 gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0,
+			 "valid call to gwavi_add_stream_chunk");
+	sput_fail_unless(gwavi_add_video_stream(gwavi, 640, 480, "MJPG", 30)
+			 == -1, "stream added after the first chunk");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "file closed");
+
+	len = read_file("/tmp/streams.avi", file, sizeof(file));
+	sput_fail_unless(len > 60 && file[56] == 3, "three streams declared");
+	for (i = 0; i + 4 <= len; i++)
+		if (memcmp(file + i, "01dc", 4) == 0 ||
+		    memcmp(file + i, "02wb", 4) == 0)
+			found++;
+	sput_fail_unless(found == 4, "chunks and index entries of the added "
+			 "streams");
+}
+
+static void
+gwavi_dvr_open_test(void)
+{
+	struct gwavi_dvr_t *dvr;
+	struct gwavi_t *gwavi;
+	unsigned char buffer[256];
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	sput_fail_unless(gwavi_dvr_open(0, 1, 10) == NULL, "empty ring");
+	sput_fail_unless(gwavi_dvr_open(65536, 1, 0) == NULL, "fps == 0");
+
+	/* one second at 10 fps, a keyframe every 5 frames */
+	dvr = gwavi_dvr_open(65536, 1, 10);
+	sput_fail_unless(dvr != NULL, "valid call to gwavi_dvr_open");
+	for (i = 1; i < 40; i++) {
+		ret |= gwavi_dvr_add_frame(dvr, buffer, sizeof(buffer),
+					   i % 5 == 0);
+		ret |= gwavi_dvr_add_audio(dvr, buffer, 64);
+	}
+	sput_fail_unless(ret == 0, "frames added to the ring");
+	gwavi = gwavi_open("/tmp/dvr.avi", 1920, 1080, "H264", 10, NULL);
+	sput_fail_unless(gwavi_dvr_trigger(dvr, gwavi) == 0,
+			 "valid call to gwavi_dvr_trigger");
+	for (i = 0; i < 5; i++)
+		ret |= gwavi_dvr_add_frame(dvr, buffer, sizeof(buffer), 0);
+	sput_fail_unless(ret == 0, "frames added after the trigger");
+	sput_fail_unless(gwavi_dvr_detach(dvr) == gwavi,
+			 "valid call to gwavi_dvr_detach");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "dumped file closed");
+	sput_fail_unless(avi_frames("/tmp/dvr.avi") == 15,
+			 "last two groups of pictures and live frames written");
+	gwavi_dvr_close(dvr);
+
+	/* room for about four frames, a keyframe every 2 frames */
+	dvr = gwavi_dvr_open(1200, 0, 10);
+	for (i = 0; i < 20; i++)
+		ret |= gwavi_dvr_add_frame(dvr, buffer, sizeof(buffer),
+					   i % 2 == 0);
+	sput_fail_unless(ret == 0, "frames added to a full ring");
+	sput_fail_unless(gwavi_dvr_add_frame(dvr, buffer, 2000, 1) == -1,
+			 "frame larger than the ring");
+	for (i = 0; i < 4; i++)
+		ret |= gwavi_dvr_add_frame(dvr, buffer, sizeof(buffer),
+					   i % 2 == 0);
+	gwavi = gwavi_open("/tmp/dvr.avi", 1920, 1080, "H264", 10, NULL);
+	sput_fail_unless(gwavi_dvr_trigger(dvr, gwavi) == 0 && ret == 0,
+			 "ring dumped");
+	(void)gwavi_dvr_detach(dvr);
+	sput_fail_unless(gwavi_close(gwavi) == 0 &&
+			 avi_frames("/tmp/dvr.avi") == 4,
+			 "frames evicted by groups of pictures");
+	gwavi_dvr_close(dvr);
+}
+
+static void
+gwavi_set_fixed_frame_size_test(void)
+{
+	static unsigned char stored[65536], computed[65536];
+	struct gwavi_audio_t audio = { 2, 16, 44100 };
+	struct gwavi_t *gwavi;
+	unsigned char buffer[301];
+	long stored_len, computed_len;
+	int i, ret = 0;
+
+	memset(buffer, 0x5a, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/fixed-audio.avi", 64, 48, "RGB ", 30, &audio);
+	sput_fail_unless(gwavi_set_fixed_frame_size(gwavi, sizeof(buffer))
+			 == -1, "refused with an audio stream");
+	gwavi_close(gwavi);
+
+	gwavi = gwavi_open("/tmp/stored.avi", 64, 48, "RGB ", 30, NULL);
+	for (i = 0; i < 50; i++)
+		gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	gwavi_close(gwavi);
+
+	gwavi = gwavi_open("/tmp/computed.avi", 64, 48, "RGB ", 30, NULL);
+	sput_fail_unless(gwavi_set_fixed_frame_size(gwavi, sizeof(buffer))
+			 == 0, "valid call to gwavi_set_fixed_frame_size");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, 300) == -1,
+			 "frame of another size refused");
+	sput_fail_unless(gwavi_add_audio_stream(gwavi, &audio) == -1,
+			 "stream refused");
+	for (i = 0; i < 50; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "frames added");
+	sput_fail_unless(gwavi_set_fixed_frame_size(gwavi, 0) == -1,
+			 "mode set after the first chunk");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "file closed");
+
+	stored_len = read_file("/tmp/stored.avi", stored, sizeof(stored));
+	computed_len = read_file("/tmp/computed.avi", computed,
+				 sizeof(computed));
+	sput_fail_unless(stored_len > 0 && stored_len == computed_len &&
+			 memcmp(stored, computed, (size_t)stored_len) == 0,
+			 "computed index identical to the stored one");
+}
+
+static void
+gwavi_set_index_staging_test(void)
+{
+	static unsigned char direct[65536], staged[65536];
+	struct gwavi_audio_t audio;
+	struct gwavi_t *gwavi;
+	unsigned char buffer[301];
+	long direct_len, staged_len;
+	int i, pass, ret = 0;
+
+	audio.channels = 2;
+	audio.bits = 16;
+	audio.samples_per_second = 44100;
+	memset(buffer, 0, sizeof(buffer));
+
+	for (pass = 0; pass < 2; pass++) {
+		gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30,
+				   &audio);
+		for (i = 0; i < 100; i++) {
+			if (i == 10 && pass == 1)
+				ret |= gwavi_set_index_staging(gwavi, 1);
+			ret |= gwavi_add_frame(gwavi, buffer,
+					       sizeof(buffer) - (size_t)i % 4);
+			ret |= gwavi_add_audio(gwavi, buffer, 42);
+		}
+		ret |= gwavi_close(gwavi);
+		if (pass == 0)
+			direct_len = read_file("/tmp/foo.avi", direct,
+					       sizeof(direct));
+		else
+			staged_len = read_file("/tmp/foo.avi", staged,
+					       sizeof(staged));
+	}
+
+	sput_fail_unless(ret == 0, "valid calls to gwavi_set_index_staging");
+	sput_fail_unless(direct_len > 0 && direct_len == staged_len &&
+			 memcmp(direct, staged, (size_t)direct_len) == 0,
+			 "staged index identical to the serialized one");
+	sput_fail_unless(gwavi_set_index_staging(NULL, 1) == -1,
+			 "NULL gwavi parameter");
+}
+
+static int log_calls;
+static struct gwavi_error_t log_last;
+
+static void
+log_record(void *ctx, const struct gwavi_error_t *error)
+{
+	(void)ctx;
+	log_calls++;
+	log_last = *error;
+}
+
+static void
+gwavi_set_log_test(void)
+{
+	struct gwavi_seg_t *seg;
+	struct gwavi_t *gwavi;
+	unsigned char buffer[16];
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_last_error(gwavi) == GWAVI_OK,
+			 "no error after gwavi_open");
+	gwavi_set_log(gwavi, log_record, NULL, GWAVI_LOG_ERROR);
+	sput_fail_unless(gwavi_add_frame(gwavi, NULL, 16) == -1 &&
+			 log_calls == 1 && log_last.code == GWAVI_EINVAL &&
+			 log_last.level == GWAVI_LOG_ERROR,
+			 "error passed to the log callback");
+	sput_fail_unless(gwavi_last_error(gwavi) == GWAVI_EINVAL,
+			 "error code recorded");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0 &&
+			 log_calls == 1, "warnings filtered by level");
+	gwavi_set_log(gwavi, log_record, NULL, GWAVI_LOG_WARNING);
+	sput_fail_unless(gwavi_set_codec(gwavi, "ab!d") == 0 &&
+			 log_calls == 2 && strcmp(log_last.detail, "ab!d") == 0,
+			 "fourcc passed as detail");
+	gwavi_set_log(gwavi, log_record, NULL, GWAVI_LOG_NONE);
+	sput_fail_unless(gwavi_add_frame(gwavi, NULL, 16) == -1 &&
+			 log_calls == 2 &&
+			 gwavi_last_error(gwavi) == GWAVI_EINVAL,
+			 "logging disabled, error code still recorded");
+	sput_fail_unless(strcmp(gwavi_strerror(GWAVI_ENOMEM),
+				"memory allocation failed") == 0,
+			 "gwavi_strerror");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close");
+
+	/* both files of a segmented recording keep the log across rollovers */
+	seg = gwavi_seg_open("/tmp/seg-%u.avi", 1920, 1080, "H264", 30, NULL);
+	(void)gwavi_seg_set_limits(seg, 0, 0, 1);
+	sput_fail_unless(gwavi_seg_set_log(NULL, log_record, NULL,
+					   GWAVI_LOG_ERROR) == -1,
+			 "NULL seg parameter");
+	sput_fail_unless(gwavi_seg_set_log(seg, log_record, NULL,
+					   GWAVI_LOG_ERROR) == 0,
+			 "valid call to gwavi_seg_set_log");
+	log_calls = 0;
+	for (i = 0; i < 4; i++) {
+		ret |= gwavi_seg_add_frame(seg, buffer, sizeof(buffer), 1);
+		ret |= gwavi_seg_add_audio(seg, NULL, 16) != -1;
+	}
+	sput_fail_unless(ret == 0 && log_calls == 4,
+			 "log of the segments set after rollovers");
+	sput_fail_unless(gwavi_seg_close(seg) == 0, "segments closed");
+}
+
+static int alloc_live;
+
+static void *
+counting_malloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	alloc_live++;
+	return malloc(size);
+}
+
+static void *
+counting_realloc(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	if (!ptr)
+		alloc_live++;
+	return realloc(ptr, size);
+}
+
+static void
+counting_free(void *ctx, void *ptr)
+{
+	(void)ctx;
+	alloc_live--;
+	free(ptr);
+}
+
+static void
+gwavi_set_allocator_test(void)
+{
+	struct gwavi_allocator_t counting = {
+		counting_malloc, counting_realloc, counting_free, NULL
+	};
+	struct gwavi_allocator_t broken = {
+		counting_malloc, NULL, counting_free, NULL
+	};
+	struct gwavi_t *gwavi;
+	unsigned char *frame;
+
+	sput_fail_unless(gwavi_set_allocator(NULL, &counting) == 0,
+			 "set default allocator");
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	/* handle, index and file name */
+	sput_fail_unless(gwavi != NULL && alloc_live == 3,
+			 "gwavi_open uses the default allocator");
+	sput_fail_unless(gwavi_set_allocator(NULL, NULL) == 0,
+			 "reset default allocator");
+	frame = gwavi_frame_alloc(gwavi, 1024);
+	sput_fail_unless(alloc_live == 4, "frame buffer allocated");
+	sput_fail_unless(gwavi_set_allocator(gwavi, NULL) == -1,
+			 "frame buffer in use");
+	gwavi_frame_free(gwavi, frame);
+	sput_fail_unless(gwavi_set_allocator(gwavi, &broken) == -1,
+			 "incomplete allocator");
+	sput_fail_unless(gwavi_set_allocator(gwavi, NULL) == 0 &&
+			 alloc_live == 1,
+			 "index and pool migrated off the allocator");
+	sput_fail_unless(gwavi_close(gwavi) == 0 && alloc_live == 0,
+			 "handle freed with its own allocator");
+}
+
+#define THREADED_FRAMES 500
+
+static void *
+video_producer(void *arg)
+{
+	unsigned char frame[256];
+	long i, ret = 0;
+
+	memset(frame, 0, sizeof(frame));
+	for (i = 0; i < THREADED_FRAMES; i++) {
+		frame[0] = (unsigned char)i;
+		frame[1] = (unsigned char)(i >> 8);
+		ret |= gwavi_add_frame((struct gwavi_t *)arg, frame,
+				       sizeof(frame));
+	}
+
+	return (void *)ret;
+}
+
+static void *
+audio_producer(void *arg)
+{
+	unsigned char samples[64];
+	long i, ret = 0;
+
+	memset(samples, 0, sizeof(samples));
+	for (i = 0; i < THREADED_FRAMES; i++)
+		ret |= gwavi_add_audio((struct gwavi_t *)arg, samples,
+				       sizeof(samples));
+
+	return (void *)ret;
+}
+
+static void
+gwavi_set_threaded_test(void)
+{
+	struct gwavi_audio_t audio;
+	struct gwavi_t *gwavi;
+	pthread_t video, sound;
+	void *video_ret, *sound_ret;
+	unsigned char chunk[8 + 256];
+	unsigned int next = 0;
+	FILE *in;
+
+	audio.channels = 2;
+	audio.bits = 16;
+	audio.samples_per_second = 44100;
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, &audio);
+
+	sput_fail_unless(gwavi_set_threaded(NULL, 16) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_set_threaded(gwavi, THREADED_FRAMES * 2) == 0,
+			 "valid call to gwavi_set_threaded");
+	sput_fail_unless(gwavi_reserve(gwavi, 1 << 20) == -1,
+			 "gwavi_reserve refused in threaded mode");
+	pthread_create(&video, NULL, video_producer, gwavi);
+	pthread_create(&sound, NULL, audio_producer, gwavi);
+	pthread_join(video, &video_ret);
+	pthread_join(sound, &sound_ret);
+	sput_fail_unless(video_ret == NULL && sound_ret == NULL,
+			 "concurrent video and audio producers");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close in threaded mode");
+
+	/* video frames are in submission order */
+	in = fopen("/tmp/foo.avi", "rb");
+	while (fread(chunk, 1, 4, in) == 4 && memcmp(chunk, "idx1", 4) != 0)
+		if (memcmp(chunk, "00dc", 4) == 0 &&
+		    fread(chunk + 4, 1, sizeof(chunk) - 4, in) ==
+		    sizeof(chunk) - 4 &&
+		    (chunk[8] | chunk[9] << 8) == (int)next)
+			next++;
+		else
+			(void)fseek(in, -3, SEEK_CUR);
+	fclose(in);
+	sput_fail_unless(next == THREADED_FRAMES, "video frames in order");
+}
+
+#define PARKED_FILES 5
+
+static void
+gwavi_set_parkable_test(void)
+{
+	struct gwavi_t *gwavi[PARKED_FILES];
+	static unsigned char file[8192];
+	unsigned char buffer[256];
+	pthread_t threads[PARKED_FILES];
+	char filename[32];
+	int i, j, ret = 0, closed = 0, frames = 0;
+	void *failed;
+
+	memset(buffer, 0, sizeof(buffer));
+	sput_fail_unless(gwavi_set_parkable(NULL, 1) == -1, "NULL gwavi");
+	sput_fail_unless(gwavi_set_fd_budget(2) == 0,
+			 "valid call to gwavi_set_fd_budget");
+	for (i = 0; i < PARKED_FILES; i++) {
+		sprintf(filename, "/tmp/park-%d.avi", i);
+		gwavi[i] = gwavi_open(filename, 1920, 1080, "H264", 30, NULL);
+		ret |= gwavi_set_parkable(gwavi[i], 1);
+	}
+	sput_fail_unless(ret == 0, "valid calls to gwavi_set_parkable");
+	sput_fail_unless(gwavi_set_threaded(gwavi[0], 16) == -1,
+			 "threaded mode refused to parkable handles");
+
+	for (j = 0; j < 10; j++)
+		for (i = 0; i < PARKED_FILES; i++)
+			ret |= gwavi_add_frame(gwavi[i], buffer,
+					       sizeof(buffer));
+	sput_fail_unless(ret == 0, "frames added to parked handles");
+	/* data of a parked handle is on disk, not in a stdio buffer */
+	sput_fail_unless(read_file("/tmp/park-0.avi", file, sizeof(file))
+			 > 10 * 264, "least recently used handle parked");
+	sput_fail_unless(gwavi_park(gwavi[4]) == 0,
+			 "valid call to gwavi_park");
+
+	for (i = 0; i < PARKED_FILES; i++) {
+		closed += gwavi_close(gwavi[i]) == 0;
+		sprintf(filename, "/tmp/park-%d.avi", i);
+		frames += avi_frames(filename) == 10;
+	}
+	sput_fail_unless(closed == PARKED_FILES && frames == PARKED_FILES,
+			 "parked handles closed");
+
+	/* handles written from their own threads park each other */
+	(void)gwavi_set_fd_budget(1);
+	for (i = 0; i < PARKED_FILES; i++) {
+		sprintf(filename, "/tmp/park-%d.avi", i);
+		gwavi[i] = gwavi_open(filename, 1920, 1080, "H264", 30, NULL);
+		ret |= gwavi_set_parkable(gwavi[i], 1);
+	}
+	for (i = 0; i < PARKED_FILES; i++)
+		pthread_create(&threads[i], NULL, video_producer, gwavi[i]);
+	for (i = 0; i < PARKED_FILES; i++) {
+		pthread_join(threads[i], &failed);
+		ret |= failed != NULL;
+	}
+	sput_fail_unless(ret == 0, "frames added from several threads");
+	closed = frames = 0;
+	for (i = 0; i < PARKED_FILES; i++) {
+		closed += gwavi_close(gwavi[i]) == 0;
+		sprintf(filename, "/tmp/park-%d.avi", i);
+		frames += avi_frames(filename) == THREADED_FRAMES;
+	}
+	sput_fail_unless(closed == PARKED_FILES && frames == PARKED_FILES,
+			 "handles parked by other threads closed");
+	(void)gwavi_set_fd_budget(0);
+}
+
+#define POOL_FILES 8
+
+/* read what is left in a pipe, return its length */
+static long
+read_pipe(int fd, unsigned char *buffer, long len)
+{
+	long n = 0;
+	ssize_t r;
+
+	while (n < len && (r = read(fd, buffer + n, (size_t)(len - n))) > 0)
+		n += r;
+
+	return n;
+}
+
+static void
+gwavi_add_sink_test(void)
+{
+	struct gwavi_allocator_t counting = {
+		counting_malloc, counting_realloc, counting_free, NULL
+	};
+	struct gwavi_t *gwavi;
+	static unsigned char file[65536], copy[65536], piped[65536];
+	static unsigned char buffer[8192];
+	long len, copy_len, piped_len, dropped_len;
+	int fd, pipes[2], small[2], i, ret = 0, live;
+
+	memset(buffer, 0, sizeof(buffer));
+	fd = open("/tmp/sink.avi", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	sput_fail_unless(fd != -1 && pipe(pipes) == 0 && pipe(small) == 0,
+			 "sinks created");
+
+	gwavi = gwavi_open("/tmp/tee.avi", 1920, 1080, "H264", 30, NULL);
+	sput_fail_unless(gwavi_add_sink(gwavi, fd, 16) == -1,
+			 "ring too small for the headers");
+	sput_fail_unless(gwavi_add_sink(gwavi, fd, 65536) == 0 &&
+			 gwavi_add_sink(gwavi, pipes[1], 65536) == 0,
+			 "valid call to gwavi_add_sink");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, 256) == 0 &&
+			 gwavi_add_sink(gwavi, small[1], 4096) == 0,
+			 "sink added after a frame");
+	sput_fail_unless(gwavi_set_parkable(gwavi, 1) == -1,
+			 "sinks refused to parkable handles");
+	for (i = 0; i < 10; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, 256);
+	/* does not fit in the ring of the last sink */
+	ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "frames added");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "sinks drained");
+	close(fd);
+	close(pipes[1]);
+	close(small[1]);
+
+	len = read_file("/tmp/tee.avi", file, sizeof(file));
+	copy_len = read_file("/tmp/sink.avi", copy, sizeof(copy));
+	piped_len = read_pipe(pipes[0], piped, sizeof(piped));
+	dropped_len = read_pipe(small[0], piped + piped_len,
+				(long)sizeof(piped) - piped_len);
+	close(pipes[0]);
+	close(small[0]);
+
+	sput_fail_unless(avi_frames("/tmp/tee.avi") == 12, "file complete");
+	sput_fail_unless(copy_len == len && memcmp(copy, file,
+						   (size_t)len) == 0,
+			 "seekable sink identical to the file");
+	/* same chunks and index (12 entries), sizes left at 0 */
+	sput_fail_unless(piped_len == len && piped[4] == 0 && piped[48] == 0 &&
+			 memcmp(piped + len - 200, file + len - 200, 200) == 0,
+			 "pipe sink without the completed headers");
+	sput_fail_unless(dropped_len < len, "lagging sink dropped");
+
+	/* sinks use the allocator of the handle and end with its file */
+	gwavi = gwavi_open("/tmp/tee.avi", 1920, 1080, "H264", 30, NULL);
+	(void)gwavi_set_allocator(gwavi, &counting);
+	gwavi_set_log(gwavi, log_record, NULL, GWAVI_LOG_WARNING);
+	live = alloc_live;
+	sput_fail_unless(pipe(pipes) == 0 &&
+			 gwavi_add_sink(gwavi, pipes[1], 65536) == 0 &&
+			 alloc_live == live + 2,
+			 "tee and sink from the allocator of the handle");
+	sput_fail_unless(gwavi_set_allocator(gwavi, NULL) == -1,
+			 "allocator change refused with sinks");
+	log_calls = 0;
+	sput_fail_unless(gwavi_reopen(gwavi, "/tmp/tee-1.avi") == 0 &&
+			 log_calls == 1 && log_last.code == GWAVI_ESTATE &&
+			 alloc_live == live,
+			 "sinks detached by gwavi_reopen with a warning");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close");
+	close(pipes[1]);
+	close(pipes[0]);
+}
+
+static void
+gwavi_snapshot_test(void)
+{
+	struct gwavi_t *gwavi;
+	static unsigned char file[65536];
+	unsigned char buffer[256];
+	long len;
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/recording.avi", 1920, 1080, "H264", 30, NULL);
+	for (i = 0; i < 3; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "frames added");
+	sput_fail_unless(gwavi_snapshot(gwavi, NULL) == -1, "path == NULL");
+	sput_fail_unless(gwavi_snapshot(gwavi, "/tmp/snapshot.avi") == 0,
+			 "valid call to gwavi_snapshot");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0 &&
+			 gwavi_close(gwavi) == 0, "recording went on");
+
+	len = read_file("/tmp/snapshot.avi", file, sizeof(file));
+	sput_fail_unless(avi_frames("/tmp/snapshot.avi") == 3 &&
+			 avi_frames("/tmp/recording.avi") == 4,
+			 "frames recorded so far in the snapshot");
+	sput_fail_unless(len > 56 && (file[4] | file[5] << 8) == len - 8 &&
+			 memcmp(file + len - 56, "idx1", 4) == 0,
+			 "snapshot completed with its index");
+}
+
+static void
+gwavi_set_live_test(void)
+{
+	struct gwavi_t *gwavi;
+	unsigned char buffer[256], header[64], entries[4 * 16];
+	unsigned int movi = 0;
+	int i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/live.avi", 1920, 1080, "H264", 30, NULL);
+	sput_fail_unless(gwavi_set_live(gwavi, 60000, "/gwavi-test-live") == 0,
+			 "valid call to gwavi_set_live");
+	sput_fail_unless(gwavi_read_live_index("/gwavi-test-live", entries, 4,
+					       NULL) == 0,
+			 "empty index published");
+
+	/* the first frame refreshes right away, the next ones wait */
+	for (i = 0; i < 3; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "frames added");
+	sput_fail_unless(read_file("/tmp/live.avi", header, sizeof(header))
+			 == sizeof(header) && header[48] == 1 &&
+			 (header[4] | header[5] << 8) != 0,
+			 "headers refreshed while recording");
+	sput_fail_unless(gwavi_read_live_index("/gwavi-test-live", entries, 4,
+					       &movi) == 1 &&
+			 memcmp(entries, "00dc", 4) == 0 && entries[8] == 4 &&
+			 movi > 12, "index published to shared memory");
+	sput_fail_unless(gwavi_set_parallel(gwavi, 4) == -1,
+			 "parallel mode refused in live mode");
+
+	sput_fail_unless(gwavi_close(gwavi) == 0, "file closed");
+	sput_fail_unless(avi_frames("/tmp/live.avi") == 3, "file complete");
+	sput_fail_unless(gwavi_read_live_index("/gwavi-test-live", entries, 4,
+					       NULL) == -1,
+			 "shared memory removed on close");
+}
+
+static void
+gwavi_pool_create_test(void)
+{
+	struct gwavi_pool_t *pool;
+	struct gwavi_t *gwavi[POOL_FILES];
+	pthread_t threads[POOL_FILES];
+	static const int cpus[2] = { 0, -1 };
+	static const int bad_cpus[3] = { -1, -2, 100000 };
+	char filename[32];
+	void *ret;
+	long failed = 0;
+	int i, closed = 0, frames = 0;
+
+	sput_fail_unless(gwavi_pool_create(0, NULL) == NULL, "no thread");
+	sput_fail_unless(gwavi_pool_create(2, bad_cpus) == NULL &&
+			 gwavi_pool_create(1, bad_cpus + 2) == NULL,
+			 "CPU numbers out of range");
+	pool = gwavi_pool_create(2, cpus);
+	sput_fail_unless(pool != NULL, "valid call to gwavi_pool_create");
+
+	for (i = 0; i < POOL_FILES; i++) {
+		sprintf(filename, "/tmp/pool-%d.avi", i);
+		gwavi[i] = gwavi_open(filename, 1920, 1080, "H264", 30, NULL);
+		failed |= gwavi_pool_attach(pool, gwavi[i], THREADED_FRAMES);
+	}
+	sput_fail_unless(failed == 0, "valid calls to gwavi_pool_attach");
+	sput_fail_unless(gwavi_pool_attach(pool, gwavi[0], 16) == -1,
+			 "handle already in threaded mode");
+	sput_fail_unless(gwavi_pool_destroy(pool) == -1,
+			 "pool destroyed with handles attached");
+
+	for (i = 0; i < POOL_FILES; i++)
+		pthread_create(&threads[i], NULL, video_producer, gwavi[i]);
+	for (i = 0; i < POOL_FILES; i++) {
+		pthread_join(threads[i], &ret);
+		failed |= (long)ret;
+	}
+	sput_fail_unless(failed == 0, "frames added from several threads");
+
+	for (i = 0; i < POOL_FILES; i++) {
+		closed += gwavi_close(gwavi[i]) == 0;
+		sprintf(filename, "/tmp/pool-%d.avi", i);
+		frames += avi_frames(filename) == THREADED_FRAMES;
+	}
+	sput_fail_unless(closed == POOL_FILES && frames == POOL_FILES,
+			 "all frames written");
+	sput_fail_unless(gwavi_pool_destroy(pool) == 0,
+			 "valid call to gwavi_pool_destroy");
+}
+
+#define PARALLEL_THREADS 4
+
+static void
+gwavi_set_parallel_test(void)
+{
+	struct gwavi_t *gwavi;
+	pthread_t threads[PARALLEL_THREADS];
+	void *ret;
+	unsigned char buffer[256], chunk[8];
+	long total = 0;
+	int i, failed = 0;
+	FILE *in;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_set_parallel(NULL, 16) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0,
+			 "frame added before parallel mode");
+	sput_fail_unless(gwavi_set_parallel(gwavi,
+				PARALLEL_THREADS * THREADED_FRAMES) == 0,
+			 "valid call to gwavi_set_parallel");
+	sput_fail_unless(gwavi_reopen(gwavi, "/tmp/bar.avi") == -1,
+			 "gwavi_reopen refused in parallel mode");
+	for (i = 0; i < PARALLEL_THREADS; i++)
+		pthread_create(&threads[i], NULL, video_producer, gwavi);
+	for (i = 0; i < PARALLEL_THREADS; i++) {
+		pthread_join(threads[i], &ret);
+		failed |= ret != NULL;
+	}
+	sput_fail_unless(!failed, "concurrent producers");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == -1,
+			 "reserved chunks exhausted");
+	sput_fail_unless(gwavi_set_parallel(gwavi, 0) == 0,
+			 "leave parallel mode");
+	sput_fail_unless(gwavi_add_frame(gwavi, buffer, sizeof(buffer)) == 0,
+			 "frame added after parallel mode");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close");
+
+	/* every chunk made it to the file, in one contiguous movi list */
+	in = fopen("/tmp/foo.avi", "rb");
+	while (fread(chunk, 1, 4, in) == 4 && memcmp(chunk, "movi", 4) != 0)
+		(void)fseek(in, -3, SEEK_CUR);
+	while (fread(chunk, 1, 8, in) == 8 && memcmp(chunk, "00dc", 4) == 0) {
+		total++;
+		(void)fseek(in, chunk[4] | chunk[5] << 8, SEEK_CUR);
+	}
+	fclose(in);
+	sput_fail_unless(total == PARALLEL_THREADS * THREADED_FRAMES + 2,
+			 "all chunks written");
+}
+
+static void
+gwavi_add_frame_ts_test(void)
+{
+	struct gwavi_t *gwavi;
+	static unsigned char file[65536];
+	unsigned char buffer[256];
+	double zero = 0.0;
+	long len, i;
+	int ret = 0, drops = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/fixed-ts.avi", 16, 4, "RGB ", 10, NULL);
+	gwavi_set_fixed_frame_size(gwavi, sizeof(buffer));
+	sput_fail_unless(gwavi_add_frame_ts(gwavi, 0.0, buffer,
+					    sizeof(buffer)) == -1,
+			 "refused in fixed frame size mode");
+	gwavi_close(gwavi);
+
+	gwavi = gwavi_open("/tmp/ts.avi", 1920, 1080, "H264", 10, NULL);
+	sput_fail_unless(gwavi_add_frame_ts(gwavi, 12.0, NULL, 0) == -1,
+			 "buffer == NULL");
+	/* slots 0 and 1, 2 and 3 missing, 4, then 5 despite the jitter */
+	ret |= gwavi_add_frame_ts(gwavi, 12.0, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_ts(gwavi, 12.1, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_ts(gwavi, 12.41, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_ts(gwavi, 12.44, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0, "valid calls to gwavi_add_frame_ts");
+	sput_fail_unless(gwavi_add_frame_ts(gwavi, zero / zero, buffer,
+					    sizeof(buffer)) == -1,
+			 "NaN timestamp");
+	sput_fail_unless(gwavi_add_frame_ts(gwavi, HUGE_VAL, buffer,
+					    sizeof(buffer)) == -1 &&
+			 gwavi_add_frame_ts(gwavi, -HUGE_VAL, buffer,
+					    sizeof(buffer)) == -1,
+			 "infinite timestamps");
+	sput_fail_unless(gwavi_add_frame_ts(gwavi, 1e9, buffer,
+					    sizeof(buffer)) == -1,
+			 "gap too long");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "file closed");
+
+	sput_fail_unless(avi_frames("/tmp/ts.avi") == 6,
+			 "missing frames counted");
+	len = read_file("/tmp/ts.avi", file, sizeof(file));
+	/* empty chunks and their index entries, which are no keyframes */
+	for (i = 0; i + 8 <= len; i++)
+		if (memcmp(file + i, "00dc\0\0\0\0", 8) == 0)
+			drops++;
+	sput_fail_unless(drops == 4, "gaps filled with empty chunks");
+}
+
+static void
+gwavi_add_frame_seq_test(void)
+{
+	static const unsigned int order[] = { 1, 0, 3, 2, 5, 6, 4 };
+	struct gwavi_t *gwavi;
+	unsigned char buffer[256], chunk[8 + 256];
+	unsigned int i, next = 0;
+	int ret = 0;
+	FILE *in;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+
+	sput_fail_unless(gwavi_set_reorder_window(gwavi, 4) == 0,
+			 "valid call to gwavi_set_reorder_window");
+	for (i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+		buffer[0] = (unsigned char)order[i];
+		ret |= gwavi_add_frame_seq(gwavi, order[i], buffer,
+					   sizeof(buffer));
+	}
+	sput_fail_unless(ret == 0, "frames added out of order");
+	sput_fail_unless(gwavi_add_frame_seq(gwavi, 3, buffer, sizeof(buffer))
+			 == -1, "frame added after its turn");
+	buffer[0] = 9;
+	sput_fail_unless(gwavi_add_frame_seq(gwavi, 9, buffer, sizeof(buffer))
+			 == 0, "frame ahead of its turn held");
+	sput_fail_unless(gwavi_set_reorder_window(gwavi, 8) == -1,
+			 "window cannot change while holding frames");
+	sput_fail_unless(gwavi_add_frame_seq(NULL, 10, buffer, sizeof(buffer))
+			 == -1, "NULL gwavi parameter");
+	sput_fail_unless(gwavi_close(gwavi) == 0, "close flushes the window");
+
+	/* frames 0 to 6 then 9, skipping the gap */
+	in = fopen("/tmp/foo.avi", "rb");
+	while (fread(chunk, 1, 4, in) == 4 && memcmp(chunk, "idx1", 4) != 0)
+		if (memcmp(chunk, "00dc", 4) == 0 &&
+		    fread(chunk + 4, 1, sizeof(chunk) - 4, in) ==
+		    sizeof(chunk) - 4 &&
+		    chunk[8] == (next < 7 ? next : 9))
+			next++;
+		else
+			(void)fseek(in, -3, SEEK_CUR);
+	fclose(in);
+	sput_fail_unless(next == 8, "frames written in sequence order");
+
+	/* 2 is missing when the file changes, numbering goes on after 3 */
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	gwavi_set_reorder_window(gwavi, 4);
+	ret = gwavi_add_frame_seq(gwavi, 0, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_seq(gwavi, 1, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_seq(gwavi, 3, buffer, sizeof(buffer));
+	ret |= gwavi_reopen(gwavi, "/tmp/foo2.avi");
+	ret |= gwavi_add_frame_seq(gwavi, 4, buffer, sizeof(buffer));
+	ret |= gwavi_add_frame_seq(gwavi, 5, buffer, sizeof(buffer));
+	sput_fail_unless(ret == 0 && gwavi_close(gwavi) == 0,
+			 "sequence numbers go on across gwavi_reopen");
+	sput_fail_unless(avi_frames("/tmp/foo.avi") == 3 &&
+			 avi_frames("/tmp/foo2.avi") == 2,
+			 "held frame written to the first file");
+}
+
+static pthread_mutex_t closed_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closed_cond = PTHREAD_COND_INITIALIZER;
+static int closed_status = 1;
+
+static void
+closed(void *ctx, int status)
+{
+	pthread_mutex_lock(&closed_lock);
+	closed_status = status;
+	*(int *)ctx = 1;
+	pthread_cond_signal(&closed_cond);
+	pthread_mutex_unlock(&closed_lock);
+}
+
+static void
+gwavi_close_async_test(void)
+{
+	struct gwavi_allocator_t counting = {
+		counting_malloc, counting_realloc, counting_free, NULL
+	};
+	struct rlimit limit, small;
+	struct gwavi_t *gwavi;
+	unsigned char buffer[256];
+	int done = 0, i, ret = 0;
+
+	memset(buffer, 0, sizeof(buffer));
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	for (i = 0; i < 1000; i++)
+		ret |= gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+
+	sput_fail_unless(gwavi_close_async(NULL, closed, &done) == -1,
+			 "NULL gwavi parameter");
+	sput_fail_unless(ret == 0 && gwavi_close_async(gwavi, closed, &done)
+			 == 0, "valid call to gwavi_close_async");
+	pthread_mutex_lock(&closed_lock);
+	while (!done)
+		pthread_cond_wait(&closed_cond, &closed_lock);
+	pthread_mutex_unlock(&closed_lock);
+	sput_fail_unless(closed_status == 0, "completion callback called");
+
+	/* the buffered frame and the index are refused at close */
+	(void)gwavi_set_allocator(NULL, &counting);
+	gwavi = gwavi_open("/tmp/foo.avi", 1920, 1080, "H264", 30, NULL);
+	(void)gwavi_set_allocator(NULL, NULL);
+	ret = gwavi_add_frame(gwavi, buffer, sizeof(buffer));
+	(void)getrlimit(RLIMIT_FSIZE, &limit);
+	small = limit;
+	small.rlim_cur = 1;
+	(void)signal(SIGXFSZ, SIG_IGN);
+	done = 0;
+	sput_fail_unless(ret == 0 && setrlimit(RLIMIT_FSIZE, &small) == 0 &&
+			 gwavi_close_async(gwavi, closed, &done) == 0,
+			 "gwavi_close_async past the file size limit");
+	pthread_mutex_lock(&closed_lock);
+	while (!done)
+		pthread_cond_wait(&closed_cond, &closed_lock);
+	pthread_mutex_unlock(&closed_lock);
+	(void)setrlimit(RLIMIT_FSIZE, &limit);
+	(void)signal(SIGXFSZ, SIG_DFL);
+	sput_fail_unless(closed_status == -1 && alloc_live == 0,
+			 "handle freed although the file failed");
+}
+
 /* helpers functions */
 static void
 check_fourcc_test(void)
@@ -160,3 +1499,30 @@ check_fourcc_test(void)
 	sput_fail_unless(check_fourcc(NULL) == -1, "NULL fourcc");
 	sput_fail_unless(check_fourcc("H264") == 0, "valid fourcc");
 }
+
+static void
+write_index_test(void)
+{
+	static const unsigned char expected[] = {
+		'i', 'd', 'x', '1', 48, 0, 0, 0,
+		'0', '0', 'd', 'c', 0x10, 0, 0, 0, 4, 0, 0, 0, 0, 1, 0, 0,
+		'0', '1', 'w', 'b', 0x10, 0, 0, 0, 12, 1, 0, 0, 8, 0, 0, 0,
+		'1', '2', 'd', 'c', 0x10, 0, 0, 0, 28, 1, 0, 0, 4, 0, 0, 0
+	};
+	struct gwavi_index_entry_t offsets[3] = {
+		{ 256, 0, 0, 0x10 }, { 8, 1, 1, 0x10 }, { 4, 12, 0, 0x10 }
+	};
+	unsigned char buffer[sizeof(expected) + 1];
+	FILE *out = tmpfile();
+
+	sput_fail_unless(write_index(out, 3, offsets) == 0,
+			 "valid call to write_index");
+	rewind(out);
+	sput_fail_unless(fread(buffer, 1, sizeof(buffer), out) ==
+			 sizeof(expected) &&
+			 memcmp(buffer, expected, sizeof(expected)) == 0,
+			 "little endian entries");
+	sput_fail_unless(offsets[1].size == 8, "offsets left untouched");
+	sput_fail_unless(write_index(out, 3, NULL) == -1, "NULL offsets");
+	fclose(out);
+}
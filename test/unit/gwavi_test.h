@@ -9,13 +9,43 @@
 static void gwavi_open_test(void);
 static void gwavi_add_frame_test(void);
 static void gwavi_add_audio_test(void);
+static void gwavi_add_framev_test(void);
+static void gwavi_add_frame_fd_test(void);
+static void gwavi_frame_alloc_test(void);
+static void gwavi_commit_frame_test(void);
+static void gwavi_frame_begin_test(void);
 static void gwavi_close_test(void);
+static void gwavi_reopen_test(void);
+static void gwavi_reserve_test(void);
+static void gwavi_seg_open_test(void);
+static void gwavi_seg_open_placed_test(void);
+static void gwavi_add_video_stream_test(void);
+static void gwavi_dvr_open_test(void);
+static void gwavi_set_index_staging_test(void);
+static void gwavi_set_fixed_frame_size_test(void);
 static void gwavi_set_framerate_test(void);
 static void gwavi_set_codec_test(void);
 static void gwavi_set_size_test(void);
+static void gwavi_set_realtime_test(void);
+static void gwavi_set_log_test(void);
+static void gwavi_set_allocator_test(void);
+static void gwavi_set_threaded_test(void);
+static void gwavi_set_parkable_test(void);
+static void gwavi_add_sink_test(void);
+static void gwavi_snapshot_test(void);
+static void gwavi_set_live_test(void);
+static void gwavi_pool_create_test(void);
+static void gwavi_set_parallel_test(void);
+static void gwavi_add_frame_seq_test(void);
+static void gwavi_add_frame_ts_test(void);
+static void gwavi_close_async_test(void);
 
 /* helpers functions */
 static void check_fourcc_test(void);
+static void write_index_test(void);
+
+/* helpers */
+static long read_file(const char *filename, unsigned char *buffer, long len);
 
 #endif /* ndef H_GWAVI_TEST */
 